@@ -1,4 +1,5 @@
 #include <pthread.h>
+#include <semaphore.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
@@ -7,15 +8,44 @@
 #include <ctype.h>
 
 #define NANOSECOND_CONVERSION 1e9
+#define TICK_NANOSECONDS 100000000L // one unit of load or cross time is a tenth of a second
+#define WHEEL_SLOTS 256             // slots in the timer wheel of the pool mode, one per tick
+#define HEAP_CAPACITY 16            // starting size of a heap, it doubles whenever it gets full
 
-pthread_mutex_t loading_mutex, queue_mutex, track_mutex;                  // mutexes
-pthread_cond_t start_loading, done_loading, ready_to_load, done_crossing; // condition variables
-int train_count = 0;
+#define DEFAULT_STATIONS "West,East,North,South"
+
+// the stations trains leave from, -s changes them. A train is at the station its input letter is the first letter of
+// and the order is the order ties are broken in after the last station
+char **station_names;
+int station_count;
+
+// each main track keeps its own count of trains in a row from the same station so no station gets starved on it
+struct track
+{
+  int busy;
+  int last_station; // the station the last train on this track came from, -1 for neither
+  int in_a_row;     // counts the amount of trains that have gone in a row from last_station
+};
+
+// a binary heap, items[0] is the item that goes first according to before
+struct heap
+{
+  void **items; // grows when it is full so a heap only takes memory for the items in it
+  int count;
+  int capacity;
+  int (*before)(const void *a, const void *b); // returns 1 if a should come out of the heap before b
+};
+
+pthread_mutex_t queue_mutex; // guards the stations, the track and the flags below
+pthread_cond_t start_loading; // broadcast once every thread is made so they all start loading at the same time
 struct timespec global_start_time;
-int start_loading_condition, train_in_queue, train_on_track = 0;
-struct Node *westbound_head = NULL; // head of the westbound linked list
-struct Node *eastbound_head = NULL; // head of the westbound linked list
-enum status *status_flags;          // this is an array flags for each train to confirm when it is time to cross
+int start_loading_condition, train_in_queue = 0;
+double *grant_latency;   // with -l the time from each train being granted the track to it being on it, a train is
+                         // granted the track as soon as it is free and the train is first in line
+struct heap *stations;              // the trains waiting at each station, one heap per station
+struct track *tracks;               // the main tracks, there is one unless -t says otherwise
+int track_count = 1;
+struct Train **trains;              // every train read from the input file, indexed by train number
 
 enum priority // the priority of each train
 {
@@ -23,11 +53,11 @@ enum priority // the priority of each train
   high
 } priority;
 
-enum status // whether a train has beem granted permission to cross the main track
+enum event // what happens to a train next in the pool and virtual modes, events at the same tick are handled in this order
 {
-  READY,
-  GRANTED
-} status;
+  CROSSED,
+  LOADED
+};
 
 // Struct for each train object 🚂
 struct Train
@@ -35,13 +65,21 @@ struct Train
   int train_num;
   enum priority prio;
   pthread_t threadID;
-  char direction[5]; // direction the train is bound for
+  char *direction;   // direction the train is bound for, the name of its station
+  int station;       // the station the train waits at, the same as the direction
+  int track;         // the main track the train is given
   int load_time;
   int cross_time;
-  pthread_cond_t cross_condition; // the trains condition variable that is unique to each train
+  sem_t granted;                  // posted once when the train is given the track, unique to each train
+  struct timespec grant_time;     // when the train was granted the track, its crossing is timed from it
+  enum event event;               // the next event of the train in the pool and virtual modes
+  long event_tick;                // the tick that event happens at
+  struct Train *next_event;       // the next train in the same timer wheel slot
+  char message[100];              // the line a pool worker made for the event
 };
 
-// struct for the linked list node
+// struct for the linked list node, the station queues used to be sorted linked lists and they are only kept for the
+// burst benchmark now
 struct Node
 {
   struct Train *train;
@@ -66,11 +104,152 @@ void read_time(struct timespec *ts)
   }
 }
 
+// This function prints a message with the time of the simulation in seconds in front of it
+void print_seconds(double time, char *message)
+{
+  long tenths = (long)(time * 10 + 0.5); // whole tenths first so 59.96 becomes 00:01:00.0 and not 00:00:60.0
+  printf("%02ld:%02ld:%04.1f %s", tenths / 36000, tenths / 600 % 60, tenths % 600 / 10.0, message);
+}
+
 // This function takes two time spec structures and prints out the time for the simulation
 void print_time(struct timespec *start_time, struct timespec *end_time, char *message)
 {
-  double time = timespec_to_seconds(end_time) - timespec_to_seconds(start_time);
-  printf("%02.0f:%02.0f:%04.1f %s", (time / 3600), (time / 60), time, message);
+  print_seconds(timespec_to_seconds(end_time) - timespec_to_seconds(start_time), message);
+}
+
+// prints a message at a tick of the simulation, ticks are a tenth of a second each
+void print_tick(long tick, char *message)
+{
+  print_seconds(tick / 10.0, message);
+}
+
+// makes the line printed when a train gets on or off its track, the track is only named when there is more than one
+void on_track_message(char *message, struct Train *train_ptr)
+{
+  if (track_count == 1)
+  {
+    sprintf(message, "Train %2d is ON the main track going %4s\n", train_ptr->train_num, train_ptr->direction);
+  }
+  else
+  {
+    sprintf(message, "Train %2d is ON track %d going %4s\n", train_ptr->train_num, train_ptr->track + 1, train_ptr->direction);
+  }
+}
+
+void off_track_message(char *message, struct Train *train_ptr)
+{
+  if (track_count == 1)
+  {
+    sprintf(message, "Train %2d is OFF the main track after going %4s\n", train_ptr->train_num, train_ptr->direction);
+  }
+  else
+  {
+    sprintf(message, "Train %2d is OFF track %d after going %4s\n", train_ptr->train_num, train_ptr->track + 1,
+            train_ptr->direction);
+  }
+}
+
+// sleeps until the given number of ticks after start, sleeping to an absolute time means how late the thread got
+// here does not add up over the ticks
+void sleep_until(struct timespec *start, long tick)
+{
+  struct timespec deadline;
+  long nanoseconds = start->tv_nsec + tick * TICK_NANOSECONDS;
+  deadline.tv_sec = start->tv_sec + nanoseconds / 1000000000L;
+  deadline.tv_nsec = nanoseconds % 1000000000L;
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) != 0)
+  {
+  }
+}
+
+// sleeps until the given tick after the start of the simulation
+void sleep_until_tick(long tick)
+{
+  sleep_until(&global_start_time, tick);
+}
+
+// makes an empty heap with room for capacity items before it has to grow
+void heap_init(struct heap *heap, int capacity, int (*before)(const void *a, const void *b))
+{
+  heap->items = malloc(sizeof(void *) * (capacity > 0 ? capacity : 1));
+  if (heap->items == NULL)
+  {
+    printf("ERROR: could not allocate memory\n");
+    exit(1);
+  }
+  heap->count = 0;
+  heap->capacity = capacity > 0 ? capacity : 1;
+  heap->before = before;
+}
+
+void heap_free(struct heap *heap)
+{
+  free(heap->items);
+  heap->items = NULL;
+  heap->count = heap->capacity = 0;
+}
+
+// adds an item to the heap by moving it up from the bottom until its parent goes before it
+void heap_push(struct heap *heap, void *item)
+{
+  if (heap->count == heap->capacity)
+  {
+    heap->capacity *= 2;
+    heap->items = realloc(heap->items, sizeof(void *) * heap->capacity);
+    if (heap->items == NULL)
+    {
+      printf("ERROR: could not allocate memory\n");
+      exit(1);
+    }
+  }
+  int i = heap->count++;
+  while (i > 0 && heap->before(item, heap->items[(i - 1) / 2]))
+  {
+    heap->items[i] = heap->items[(i - 1) / 2];
+    i = (i - 1) / 2;
+  }
+  heap->items[i] = item;
+}
+
+// removes and returns the first item of the heap, the last item is moved down from the top to fill the gap
+void *heap_pop(struct heap *heap)
+{
+  void *first = heap->items[0];
+  void *last = heap->items[--heap->count];
+  int i = 0;
+  while (2 * i + 1 < heap->count)
+  {
+    int child = 2 * i + 1;
+    if (child + 1 < heap->count && heap->before(heap->items[child + 1], heap->items[child]))
+    {
+      child++;
+    }
+    if (!heap->before(heap->items[child], last))
+    {
+      break;
+    }
+    heap->items[i] = heap->items[child];
+    i = child;
+  }
+  heap->items[i] = last;
+  return first;
+}
+
+// orders the trains of a station, high priority first then the one that finished loading first and then the lower
+// train number
+int train_before(const void *a, const void *b)
+{
+  const struct Train *t1 = a;
+  const struct Train *t2 = b;
+  if (t1->prio != t2->prio)
+  {
+    return t1->prio > t2->prio;
+  }
+  if (t1->load_time != t2->load_time)
+  {
+    return t1->load_time < t2->load_time;
+  }
+  return t1->train_num < t2->train_num;
 }
 
 // returns 1 if t1 is higher priority than t2 and 0 if t1 is less than t2 or if they are equal
@@ -93,7 +272,7 @@ int compare_trains(struct Train *t1, struct Train *t2)
   return 0;
 }
 
-void enqueue(struct Train *train_ptr, struct Node **head)
+void list_enqueue(struct Train *train_ptr, struct Node **head)
 {
   // make node
   struct Node *new_node = malloc(sizeof(struct Node));
@@ -128,86 +307,130 @@ void enqueue(struct Train *train_ptr, struct Node **head)
   }
 }
 
+// This function dequeues the first node from the linked list and frees the memory while returning the train in that node
+struct Train *list_dequeue(struct Node **head)
+{
+  struct Node *temp = *head;
+  struct Train *train = (*head)->train;
+  (*head) = (*head)->next;
+  free(temp);
+  return train;
+}
+
+// adds a train to a station queue
+void enqueue(struct Train *train_ptr, struct heap *queue)
+{
+  heap_push(queue, train_ptr);
+}
+
 // this function returns 1 if the queue is empty and 0 otherwise
-int isEmpty(struct Node **head)
+int isEmpty(struct heap *queue)
 {
-  return (*head) == NULL;
+  return queue->count == 0;
 }
 
 // this function returns the train from the first element of the queue
-struct Train *peek(struct Node **head)
+struct Train *peek(struct heap *queue)
 {
-  return (*head)->train;
+  return queue->items[0];
 }
 
-// This function dequeues the first node from the linked list and frees the memory while returning the train in that node
-struct Train *dequeue(struct Node **head)
+// This function removes and returns the first train of the queue
+struct Train *dequeue(struct heap *queue)
 {
-  struct Node *temp = *head;
-  struct Train *train = (*head)->train;
-  (*head) = (*head)->next;
-  free(temp);
-  return train;
+  return heap_pop(queue);
 }
 
+void dispatch_next_train();
+
 // this is the function each thread runs once created
 void *ThreadFunction(void *void_train_pointer)
 {
   struct Train *train_ptr = void_train_pointer;
   struct timespec thread_time; // creates a thread specific timespec
 
-  pthread_mutex_lock(&loading_mutex);
-  train_count++; // increments the count of the number of trains that are ready
-  pthread_cond_signal(&ready_to_load);
+  pthread_mutex_lock(&queue_mutex);
   while (!start_loading_condition) // checks that the flag to start loading is true
   {
-    pthread_cond_wait(&start_loading, &loading_mutex); // waits for a signal from main to start
+    pthread_cond_wait(&start_loading, &queue_mutex); // waits for a signal from main to start
   }
-  pthread_mutex_unlock(&loading_mutex);
-  usleep((train_ptr->load_time) * 100000.0); // Sleeps to simulate loading
-  char message[100];                         // this holds the messages that the thread creates before it prints them
+  pthread_mutex_unlock(&queue_mutex);
+  sleep_until_tick(train_ptr->load_time); // Sleeps to simulate loading
+  char message[100];                      // this holds the messages that the thread creates before it prints them
   sprintf(message, "Train %2d is ready to go %4s\n", train_ptr->train_num, train_ptr->direction);
   read_time(&thread_time);
   print_time(&global_start_time, &thread_time, message);
 
-  // adds train to queue
+  // adds train to queue and takes the track straight away if it is free, otherwise the train that is on it now
+  // hands it over when it is done
   pthread_mutex_lock(&queue_mutex);
-  if (strcmp(train_ptr->direction, "West") == 0)
-  {
-    enqueue(train_ptr, &westbound_head);
-  }
-  else
-  {
-    enqueue(train_ptr, &eastbound_head);
-  }
+  enqueue(train_ptr, &stations[train_ptr->station]);
   train_in_queue++;
-  pthread_cond_signal(&done_loading);
-  status_flags[train_ptr->train_num] = READY;
+  dispatch_next_train();
   pthread_mutex_unlock(&queue_mutex);
-
-  pthread_mutex_lock(&track_mutex);
-  while (status_flags[train_ptr->train_num] != GRANTED) // waits for flag to change giving it permission to cross
+  while (sem_wait(&train_ptr->granted) != 0) // waits without the lock for permission to cross
   {
-    pthread_cond_wait(&train_ptr->cross_condition, &track_mutex); // waits for signal to start crossing
   }
 
-  sprintf(message, "Train %2d is ON the main track going %4s\n", train_ptr->train_num, train_ptr->direction);
+  // the track is this trains until it hands it over below so it does not need the lock while crossing
+  on_track_message(message, train_ptr);
   read_time(&thread_time);
+  if (grant_latency != NULL)
+  {
+    grant_latency[train_ptr->train_num] = timespec_to_seconds(&thread_time) - timespec_to_seconds(&train_ptr->grant_time);
+  }
   print_time(&global_start_time, &thread_time, message);
-  usleep((train_ptr->cross_time) * 100000.0); // Sleeps to simulate loading
-  sprintf(message, "Train %2d is OFF the main track after going %4s\n", train_ptr->train_num, train_ptr->direction);
+  sleep_until(&train_ptr->grant_time, train_ptr->cross_time); // Sleeps to simulate crossing
+  off_track_message(message, train_ptr);
   read_time(&thread_time);
   print_time(&global_start_time, &thread_time, message);
 
-  train_on_track = 0;                  // resets global variable so main thread knows the train is finished crossing
-  pthread_cond_signal(&done_crossing); // signal main that train is done crossing
-  pthread_mutex_unlock(&track_mutex);
-  pthread_cond_destroy(&train_ptr->cross_condition); // destroys the trains individual condition variable
+  pthread_mutex_lock(&queue_mutex);
+  tracks[train_ptr->track].busy = 0;
+  dispatch_next_train(); // hands the track to the next train
+  pthread_mutex_unlock(&queue_mutex);
+  sem_destroy(&train_ptr->granted); // destroys the trains individual semaphore
   free(train_ptr);                                   // frees train memory
   pthread_exit(NULL);                                // returns from the thread function
 }
 
-// this function reads from the given input file and creates all the corresponding trains
+// splits the comma separated station names of -s, every name has to start with a different letter since that letter
+// is what the input file uses for it
+void Read_Stations(char *list)
+{
+  station_count = 0;
+  station_names = malloc(sizeof(char *) * (strlen(list) + 1));
+  if (station_names == NULL)
+  {
+    printf("ERROR: could not allocate memory\n");
+    exit(1);
+  }
+  for (char *name = strtok(list, ","); name != NULL; name = strtok(NULL, ","))
+  {
+    if (!isalpha(name[0]))
+    {
+      printf("ERROR: station '%s' does not start with a letter\n", name);
+      exit(1);
+    }
+    for (int i = 0; i < station_count; i++)
+    {
+      if (toupper(station_names[i][0]) == toupper(name[0]))
+      {
+        printf("ERROR: stations '%s' and '%s' start with the same letter\n", station_names[i], name);
+        exit(1);
+      }
+    }
+    station_names[station_count++] = name;
+  }
+  if (station_count == 0)
+  {
+    printf("ERROR: there has to be at least one station\n");
+    exit(1);
+  }
+}
+
+// this function reads from the given input file and makes all the corresponding trains, the threads of the
+// trains are only made in the thread mode
 int Read_Input(char *file)
 {
   FILE *file_ptr = fopen(file, "r");
@@ -216,187 +439,695 @@ int Read_Input(char *file)
     printf("ERROR: no such file.\n");
     exit(1);
   }
-  struct Node *root = NULL;
   struct Train *train_ptr;
   char dir_and_prio;
-  int load_t, cross_t, error_check;
+  int load_t, cross_t;
   int train_num = 0;
   enum priority prio;
-  char *direction;
+  int station;
+  int trains_size = 16;
+  trains = malloc(sizeof(struct Train *) * trains_size);
   while (fscanf(file_ptr, "%c %d %d\n", &dir_and_prio, &load_t, &cross_t) != EOF)
   {
     prio = isupper(dir_and_prio) ? high : low;
-    if (toupper(dir_and_prio) == 'E')
+    // a letter that isn't a station goes to the first station like it always went West
+    station = 0;
+    for (int i = 0; i < station_count; i++)
+    {
+      if (toupper(dir_and_prio) == toupper(station_names[i][0]))
+      {
+        station = i;
+      }
+    }
+    train_ptr = malloc(sizeof(struct Train));
+    if (train_num == trains_size)
     {
-      direction = "East";
+      trains_size *= 2;
+      trains = realloc(trains, sizeof(struct Train *) * trains_size);
     }
-    else
+    if (train_ptr == NULL || trains == NULL)
     {
-      direction = "West";
+      printf("ERROR: could not allocate memory\n");
+      exit(1);
     }
-    train_ptr = malloc(sizeof(struct Train));
+    trains[train_num] = train_ptr;
     train_ptr->train_num = train_num;
     train_ptr->prio = prio;
-    strcpy(train_ptr->direction, direction);
+    train_ptr->station = station;
+    train_ptr->direction = station_names[station];
     train_ptr->load_time = load_t;
     train_ptr->cross_time = cross_t;
-    pthread_cond_init(&(train_ptr->cross_condition), NULL);
-
     train_num++;
-    error_check = pthread_create(&(train_ptr->threadID), NULL, ThreadFunction, (void *)train_ptr);
+  }
+  fclose(file_ptr);
+  return train_num;
+}
+
+// this function creates the thread of every train for the thread mode, the ids are kept in thread_ids since the
+// trains are freed by their threads
+void Create_Threads(int max_trains, pthread_t *thread_ids)
+{
+  for (int i = 0; i < max_trains; i++)
+  {
+    sem_init(&(trains[i]->granted), 0, 0);
+    int error_check = pthread_create(&(trains[i]->threadID), NULL, ThreadFunction, (void *)trains[i]);
     if (error_check)
     {
       printf("ERROR: return code from pthread_create() is %d\n", error_check);
       exit(1);
     }
+    thread_ids[i] = trains[i]->threadID;
   }
-  status_flags = malloc(sizeof(enum status) * train_num);
-  return train_num;
 }
 
-// dequeues a train from the westbound station and updates the appropriate variables
-struct Train *dequeue_westbound(char *last_station, int *in_a_row)
+// This function chooses the next train for a track based on the crossing criteria. The first train of the station
+// with the highest priority goes, ties go to the first station after the one the last train on this track came from
+// (starting from the first station). After 3 trains in a row from the same station that station has to wait if any other has a
+// train, with two stations this is the same as always going the opposite way of the last train on a tie.
+struct Train *choose_next_train(struct track *track)
+{
+  int others_waiting = 0;
+  for (int station = 0; station < station_count; station++)
+  {
+    if (station != track->last_station && !isEmpty(&stations[station]))
+    {
+      others_waiting = 1;
+    }
+  }
+
+  int best = -1;
+  for (int i = 0; i < station_count; i++)
+  {
+    int station = (track->last_station + 1 + i) % station_count;
+    if (isEmpty(&stations[station]) || (station == track->last_station && track->in_a_row >= 3 && others_waiting))
+    {
+      continue;
+    }
+    if (best == -1 || peek(&stations[station])->prio > peek(&stations[best])->prio)
+    {
+      best = station;
+    }
+  }
+  if (best == -1)
+  {
+    printf("ERROR: no trains in queue\n");
+    return NULL;
+  }
+  track->in_a_row = track->last_station == best ? track->in_a_row + 1 : 1;
+  track->last_station = best;
+  return dequeue(&stations[best]);
+}
+
+// gives the lowest free track to the next train if a train is waiting, returns NULL if there is no free track or no
+// train. Has to be called with the queue mutex held in the thread and pool modes
+struct Train *grant_next_train()
+{
+  if (train_in_queue <= 0)
+  {
+    return NULL;
+  }
+  for (int i = 0; i < track_count; i++)
+  {
+    if (!tracks[i].busy)
+    {
+      struct Train *cur_train = choose_next_train(&tracks[i]);
+      train_in_queue--;
+      tracks[i].busy = 1;
+      cur_train->track = i;
+      return cur_train;
+    }
+  }
+  return NULL;
+}
+
+// gives every free track to the next train waiting, the granted trains are woken directly on their own semaphores
+// so they never have to take the queue mutex again to start crossing. Has to be called with the queue mutex held
+void dispatch_next_train()
+{
+  struct Train *cur_train;
+  while ((cur_train = grant_next_train()) != NULL)
+  {
+    read_time(&cur_train->grant_time);
+    sem_post(&(cur_train->granted));
+  }
+}
+
+// this is the original mode, every train is a thread that sleeps while it loads and crosses. The trains hand the
+// track over between themselves so the main thread only starts them and waits for them to finish
+void Run_Threads(int max_trains)
+{
+  pthread_t *thread_ids = malloc(sizeof(pthread_t) * max_trains);
+  if (thread_ids == NULL)
+  {
+    printf("ERROR: could not allocate memory\n");
+    exit(1);
+  }
+  Create_Threads(max_trains, thread_ids);
+
+  pthread_mutex_lock(&queue_mutex);
+  start_loading_condition = 1;            // this line lets the threads exit their while loop and start loading
+  read_time(&global_start_time);          // stars the global timer
+  pthread_cond_broadcast(&start_loading); // sends signal to start loading thus waking up all the threads
+  pthread_mutex_unlock(&queue_mutex);
+
+  for (int i = 0; i < max_trains; i++)
+  {
+    pthread_join(thread_ids[i], NULL);
+  }
+  free(thread_ids);
+}
+
+// compares two latencies for qsort
+int compare_latencies(const void *a, const void *b)
+{
+  double l1 = *(const double *)a;
+  double l2 = *(const double *)b;
+  return (l1 > l2) - (l1 < l2);
+}
+
+// prints a summary of how long the trains took to get on the track after being granted it to stderr
+void Report_Latency(int max_trains)
 {
-  *in_a_row = *last_station == 'w' ? (*in_a_row) + 1 : 1;
-  *last_station = 'w';
-  return dequeue(&westbound_head);
+  if (max_trains == 0)
+  {
+    return;
+  }
+  double total = 0;
+  qsort(grant_latency, max_trains, sizeof(double), compare_latencies);
+  for (int i = 0; i < max_trains; i++)
+  {
+    total += grant_latency[i];
+  }
+  fprintf(stderr, "grant to on track latency over %d trains: min %.1fus avg %.1fus p99 %.1fus max %.1fus\n", max_trains,
+          grant_latency[0] * 1e6, total / max_trains * 1e6, grant_latency[(max_trains * 99 + 99) / 100 - 1] * 1e6,
+          grant_latency[max_trains - 1] * 1e6);
 }
 
-// dequeues a train from the eastbound station and updates the appropriate variables
-struct Train *dequeue_eastbound(char *last_station, int *in_a_row)
+// Pool mode
+// Instead of a thread per train sleeping through its load and cross times, the main thread keeps a timer wheel of
+// what happens to each train next and wakes once a tick (a tenth of a second). Everything due at a tick is handed to
+// a fixed pool of worker threads as tasks: a train that finished loading is added to its station queue and a train
+// that finished crossing frees the track. Once the tick's tasks are done the main thread prints their lines, crossed
+// trains first and then by train number, and gives the track to the next train picked by choose_next_train. So the
+// number of threads stays the same however many trains there are and each train only costs its struct.
+struct timer_wheel
 {
-  *in_a_row = *last_station == 'e' ? (*in_a_row) + 1 : 1;
-  *last_station = 'e';
-  return dequeue(&eastbound_head);
+  struct Train *slots[WHEEL_SLOTS]; // the trains with an event at each tick modulo WHEEL_SLOTS
+  long now;                         // the tick being handled
+  int pending;                      // the number of events in the wheel
+};
+
+struct task_pool
+{
+  pthread_mutex_t mutex;
+  pthread_cond_t work; // signalled when a tick's tasks are ready
+  pthread_cond_t done; // signalled when the last task of a tick is finished
+  struct Train **tasks;
+  int task_count, next_task, finished;
+  int stop;
+};
+
+struct task_pool pool;
+
+// adds an event for a train to the timer wheel
+void wheel_add(struct timer_wheel *wheel, struct Train *train_ptr, enum event event, long tick)
+{
+  train_ptr->event = event;
+  train_ptr->event_tick = tick;
+  train_ptr->next_event = wheel->slots[tick % WHEEL_SLOTS];
+  wheel->slots[tick % WHEEL_SLOTS] = train_ptr;
+  wheel->pending++;
 }
 
-// This function chooses the next train to dequeue based on the crossing criteria
-struct Train *choose_next_train(char *last_station, int *in_a_row)
+// takes the trains whose events are due at the current tick out of the wheel, events in the same slot that are more
+// than WHEEL_SLOTS ticks away stay where they are. returns how many were put in due
+int wheel_take_due(struct timer_wheel *wheel, struct Train **due)
 {
-  if (!isEmpty(&westbound_head) && isEmpty(&eastbound_head))
+  int count = 0;
+  struct Train **link = &wheel->slots[wheel->now % WHEEL_SLOTS];
+  while (*link != NULL)
   {
-    return dequeue_westbound(last_station, in_a_row);
+    if ((*link)->event_tick == wheel->now)
+    {
+      due[count++] = *link;
+      *link = (*link)->next_event;
+    }
+    else
+    {
+      link = &(*link)->next_event;
+    }
   }
-  else if (!isEmpty(&eastbound_head) && isEmpty(&westbound_head))
+  wheel->pending -= count;
+  return count;
+}
+
+// orders the tasks of a tick the way their lines are printed, crossed trains first and then by train number
+int compare_tasks(const void *a, const void *b)
+{
+  struct Train *t1 = *(struct Train **)a;
+  struct Train *t2 = *(struct Train **)b;
+  if (t1->event != t2->event)
   {
-    return dequeue_eastbound(last_station, in_a_row);
+    return t1->event - t2->event;
   }
-  else if (!isEmpty(&westbound_head) && !isEmpty(&eastbound_head))
+  return t1->train_num - t2->train_num;
+}
+
+// runs the task of one train, making the line it prints and queueing it if it has finished loading
+void run_task(struct Train *train_ptr)
+{
+  if (train_ptr->event == LOADED)
   {
-    if (*in_a_row < 3)
+    sprintf(train_ptr->message, "Train %2d is ready to go %4s\n", train_ptr->train_num, train_ptr->direction);
+    pthread_mutex_lock(&queue_mutex);
+    enqueue(train_ptr, &stations[train_ptr->station]);
+    train_in_queue++;
+    pthread_mutex_unlock(&queue_mutex);
+  }
+  else
+  {
+    off_track_message(train_ptr->message, train_ptr);
+  }
+}
+
+// this is the function each worker of the pool runs
+void *Worker_Function(void *arg)
+{
+  pthread_mutex_lock(&pool.mutex);
+  while (1)
+  {
+    while (pool.next_task >= pool.task_count && !pool.stop)
+    {
+      pthread_cond_wait(&pool.work, &pool.mutex);
+    }
+    if (pool.stop)
     {
-      if (peek(&westbound_head)->prio == high && peek(&eastbound_head)->prio == low)
+      break;
+    }
+    struct Train *train_ptr = pool.tasks[pool.next_task++];
+    pthread_mutex_unlock(&pool.mutex);
+    run_task(train_ptr);
+    pthread_mutex_lock(&pool.mutex);
+    if (++pool.finished == pool.task_count)
+    {
+      pthread_cond_signal(&pool.done);
+    }
+  }
+  pthread_mutex_unlock(&pool.mutex);
+  return NULL;
+}
+
+// hands the tasks of a tick to the workers and waits for all of them to finish
+void run_tasks(struct Train **tasks, int task_count)
+{
+  pthread_mutex_lock(&pool.mutex);
+  pool.tasks = tasks;
+  pool.task_count = task_count;
+  pool.next_task = 0;
+  pool.finished = 0;
+  pthread_cond_broadcast(&pool.work);
+  while (pool.finished < task_count)
+  {
+    pthread_cond_wait(&pool.done, &pool.mutex);
+  }
+  pool.task_count = 0;
+  pthread_mutex_unlock(&pool.mutex);
+}
+
+// This function runs the simulation with a pool of workers, the main thread sleeps until each tick with an absolute
+// deadline so the ticks do not drift however long the schedule is
+void Run_Pool(int max_trains, int workers)
+{
+  pthread_mutex_init(&pool.mutex, NULL);
+  pthread_cond_init(&pool.work, NULL);
+  pthread_cond_init(&pool.done, NULL);
+  pthread_t threads[workers];
+  for (int i = 0; i < workers; i++)
+  {
+    int error_check = pthread_create(&threads[i], NULL, Worker_Function, NULL);
+    if (error_check)
+    {
+      printf("ERROR: return code from pthread_create() is %d\n", error_check);
+      exit(1);
+    }
+  }
+
+  struct timer_wheel *wheel = calloc(1, sizeof(struct timer_wheel));
+  struct Train **due = malloc(sizeof(struct Train *) * (max_trains + 1));
+  if (wheel == NULL || due == NULL)
+  {
+    printf("ERROR: could not allocate memory\n");
+    exit(1);
+  }
+  for (int i = 0; i < max_trains; i++)
+  {
+    wheel_add(wheel, trains[i], LOADED, trains[i]->load_time);
+  }
+
+  int trains_left = max_trains;
+  read_time(&global_start_time);
+  while (trains_left > 0)
+  {
+    // a train that crosses in 0 ticks is done in the same tick so the tick is handled until nothing else happens
+    int dispatched = 1;
+    while (dispatched)
+    {
+      int due_count = wheel_take_due(wheel, due);
+      qsort(due, due_count, sizeof(struct Train *), compare_tasks);
+      run_tasks(due, due_count);
+      for (int i = 0; i < due_count; i++)
+      {
+        print_tick(wheel->now, due[i]->message);
+        if (due[i]->event == CROSSED)
+        {
+          tracks[due[i]->track].busy = 0;
+          trains_left--;
+          free(due[i]);
+        }
+      }
+
+      dispatched = 0;
+      struct Train *cur_train;
+      pthread_mutex_lock(&queue_mutex);
+      while ((cur_train = grant_next_train()) != NULL)
       {
-        return dequeue_westbound(last_station, in_a_row);
+        char message[100];
+        on_track_message(message, cur_train);
+        print_tick(wheel->now, message);
+        wheel_add(wheel, cur_train, CROSSED, wheel->now + cur_train->cross_time);
+        dispatched = 1;
       }
-      else if (peek(&westbound_head)->prio == low && peek(&eastbound_head)->prio == high)
+      pthread_mutex_unlock(&queue_mutex);
+    }
+    if (trains_left == 0)
+    {
+      break;
+    }
+
+    // sleeps until the start of the next tick
+    wheel->now++;
+    sleep_until_tick(wheel->now);
+  }
+
+  pthread_mutex_lock(&pool.mutex);
+  pool.stop = 1;
+  pthread_cond_broadcast(&pool.work);
+  pthread_mutex_unlock(&pool.mutex);
+  for (int i = 0; i < workers; i++)
+  {
+    pthread_join(threads[i], NULL);
+  }
+  free(due);
+  free(wheel);
+  pthread_mutex_destroy(&pool.mutex);
+  pthread_cond_destroy(&pool.work);
+  pthread_cond_destroy(&pool.done);
+}
+
+// Virtual mode
+// The same schedule as the pool mode but nothing sleeps, the clock jumps straight to the next event in a heap ordered
+// by tick, then crossed before loaded and then by train number, so a schedule that would take hours runs as fast as
+// the events can be handled and prints the same times.
+int event_before(const void *a, const void *b)
+{
+  const struct Train *t1 = a;
+  const struct Train *t2 = b;
+  if (t1->event_tick != t2->event_tick)
+  {
+    return t1->event_tick < t2->event_tick;
+  }
+  if (t1->event != t2->event)
+  {
+    return t1->event < t2->event;
+  }
+  return t1->train_num < t2->train_num;
+}
+
+void Run_Virtual(int max_trains)
+{
+  struct heap events; // each train has at most one event waiting
+  heap_init(&events, HEAP_CAPACITY, event_before);
+  for (int i = 0; i < max_trains; i++)
+  {
+    trains[i]->event = LOADED;
+    trains[i]->event_tick = trains[i]->load_time;
+    heap_push(&events, trains[i]);
+  }
+
+  char message[100];
+  while (events.count > 0)
+  {
+    // handles every event at the next tick and then gives the free tracks away, a train that crosses in 0
+    // ticks puts its event at the same tick so it is handled on the next time around
+    long now = ((struct Train *)events.items[0])->event_tick;
+    while (events.count > 0 && ((struct Train *)events.items[0])->event_tick == now)
+    {
+      struct Train *train_ptr = heap_pop(&events);
+      if (train_ptr->event == LOADED)
       {
-        return dequeue_eastbound(last_station, in_a_row);
+        sprintf(message, "Train %2d is ready to go %4s\n", train_ptr->train_num, train_ptr->direction);
+        print_tick(now, message);
+        enqueue(train_ptr, &stations[train_ptr->station]);
+        train_in_queue++;
       }
       else
       {
-        if (*last_station == 'w')
-        {
-          return dequeue_eastbound(last_station, in_a_row);
-        }
-        else
-        {
-          return dequeue_westbound(last_station, in_a_row);
-        }
+        off_track_message(message, train_ptr);
+        print_tick(now, message);
+        tracks[train_ptr->track].busy = 0;
+        free(train_ptr);
       }
     }
-    else
+
+    struct Train *cur_train;
+    while ((cur_train = grant_next_train()) != NULL)
+    {
+      on_track_message(message, cur_train);
+      print_tick(now, message);
+      cur_train->event = CROSSED;
+      cur_train->event_tick = now + cur_train->cross_time;
+      heap_push(&events, cur_train);
+    }
+  }
+  heap_free(&events);
+}
+
+// Burst benchmark
+// Times a burst of trains that all finish loading at the same tick being added to the station queues and then taken
+// back out, once with the old sorted linked lists and once with the heaps. The queue mutex is held for every one of
+// these so the enqueue time is how long the other trains wait on it during the burst.
+double elapsed_seconds(struct timespec *start)
+{
+  struct timespec now;
+  read_time(&now);
+  return timespec_to_seconds(&now) - timespec_to_seconds(start);
+}
+
+void Burst_Benchmark(int burst_trains)
+{
+  struct Train *burst = malloc(sizeof(struct Train) * burst_trains);
+  struct Train **order = malloc(sizeof(struct Train *) * burst_trains);
+  if (burst == NULL || order == NULL)
+  {
+    printf("ERROR: could not allocate memory\n");
+    exit(1);
+  }
+  srand(360);
+  for (int i = 0; i < burst_trains; i++)
+  {
+    burst[i].train_num = i;
+    burst[i].prio = rand() % 2 ? high : low;
+    burst[i].direction = rand() % 2 ? "East" : "West";
+    burst[i].load_time = 1;
+    burst[i].cross_time = 1;
+  }
+
+  printf("queue,trains,enqueue_ms,max_enqueue_us,dequeue_ms\n");
+  for (int use_heap = 0; use_heap <= 1; use_heap++)
+  {
+    struct Node *west_list = NULL, *east_list = NULL;
+    struct heap west_heap, east_heap;
+    heap_init(&west_heap, burst_trains, train_before);
+    heap_init(&east_heap, burst_trains, train_before);
+    struct timespec start, one;
+    double max_enqueue = 0;
+
+    read_time(&start);
+    for (int i = 0; i < burst_trains; i++)
     {
-      if (*last_station == 'w')
+      int west = strcmp(burst[i].direction, "West") == 0;
+      read_time(&one);
+      pthread_mutex_lock(&queue_mutex);
+      if (use_heap)
       {
-        return dequeue_eastbound(last_station, in_a_row);
+        enqueue(&burst[i], west ? &west_heap : &east_heap);
       }
       else
       {
-        return dequeue_westbound(last_station, in_a_row);
+        list_enqueue(&burst[i], west ? &west_list : &east_list);
+      }
+      pthread_mutex_unlock(&queue_mutex);
+      double took = elapsed_seconds(&one);
+      if (took > max_enqueue)
+      {
+        max_enqueue = took;
       }
     }
+    double enqueue_time = elapsed_seconds(&start);
+
+    // both stations are drained west first, the order is kept to check the heaps agree with the lists
+    read_time(&start);
+    int count = 0;
+    while (use_heap ? !isEmpty(&west_heap) : west_list != NULL)
+    {
+      struct Train *train_ptr = use_heap ? dequeue(&west_heap) : list_dequeue(&west_list);
+      if (use_heap && order[count] != train_ptr)
+      {
+        printf("ERROR: heap and list order differ at train %d\n", train_ptr->train_num);
+        exit(1);
+      }
+      order[count++] = train_ptr;
+    }
+    while (use_heap ? !isEmpty(&east_heap) : east_list != NULL)
+    {
+      struct Train *train_ptr = use_heap ? dequeue(&east_heap) : list_dequeue(&east_list);
+      if (use_heap && order[count] != train_ptr)
+      {
+        printf("ERROR: heap and list order differ at train %d\n", train_ptr->train_num);
+        exit(1);
+      }
+      order[count++] = train_ptr;
+    }
+    double dequeue_time = elapsed_seconds(&start);
+
+    printf("%s,%d,%.3f,%.3f,%.3f\n", use_heap ? "heap" : "list", burst_trains, enqueue_time * 1000,
+           max_enqueue * 1000000, dequeue_time * 1000);
+    heap_free(&west_heap);
+    heap_free(&east_heap);
   }
-  else
-  {
-    printf("ERROR: no trains in queue\n");
-    return NULL;
-  }
+  free(order);
+  free(burst);
 }
 
 int main(int argc, char *argv[])
 {
+  // -m picks the mode (threads, pool or virtual) and -w the number of workers in the pool mode, -l reports the grant
+  // to on track latency of the thread mode, -t sets the number of main tracks, -s the stations and -b runs the burst
+  // benchmark instead
+  char *mode = "threads";
+  char default_stations[] = DEFAULT_STATIONS;
+  char *station_list = default_stations;
+  int workers = sysconf(_SC_NPROCESSORS_ONLN);
+  int burst_trains = 0;
+  int latency = 0;
+  int option;
+  while ((option = getopt(argc, argv, "m:w:t:s:b:l")) != -1)
+  {
+    if (option == 'm')
+    {
+      mode = optarg;
+    }
+    else if (option == 'w' && atoi(optarg) > 0)
+    {
+      workers = atoi(optarg);
+    }
+    else if (option == 't' && atoi(optarg) > 0)
+    {
+      track_count = atoi(optarg);
+    }
+    else if (option == 's')
+    {
+      station_list = optarg;
+    }
+    else if (option == 'l')
+    {
+      latency = 1;
+    }
+    else if (option == 'b' && atoi(optarg) > 0)
+    {
+      burst_trains = atoi(optarg);
+    }
+    else
+    {
+      optind = argc; // prints the usage below
+      break;
+    }
+  }
+  if (burst_trains > 0 && optind == argc)
+  {
+    pthread_mutex_init(&queue_mutex, NULL);
+    Burst_Benchmark(burst_trains);
+    pthread_mutex_destroy(&queue_mutex);
+    return 0;
+  }
+  if (optind != argc - 1 || (strcmp(mode, "threads") != 0 && strcmp(mode, "pool") != 0 &&
+                                  strcmp(mode, "virtual") != 0))
+  {
+    printf("Usage: %s [-m threads|pool|virtual] [-w workers] [-t tracks] [-s stations] [-l] <input file>\n", argv[0]);
+    printf("       %s -b <trains>\n", argv[0]);
+    exit(1);
+  }
+
   // initializes all mutexes and convars
-  pthread_mutex_init(&loading_mutex, NULL);
   pthread_mutex_init(&queue_mutex, NULL);
-  pthread_mutex_init(&track_mutex, NULL);
-  pthread_cond_init(&done_loading, NULL);
   pthread_cond_init(&start_loading, NULL);
-  pthread_cond_init(&ready_to_load, NULL);
-  pthread_cond_init(&done_crossing, NULL);
-
-  int max_trains = Read_Input(argv[1]); // read file and create all threads
-
-  pthread_mutex_lock(&loading_mutex);
 
-  while (train_count < max_trains) // waits for all trains to finish loading before signaling
+  Read_Stations(station_list);
+  int max_trains = Read_Input(argv[optind]); // read file and make all the trains
+  tracks = calloc(track_count, sizeof(struct track));
+  if (tracks == NULL)
   {
-    pthread_cond_wait(&ready_to_load, &loading_mutex);
+    printf("ERROR: could not allocate memory\n");
+    exit(1);
   }
-
-  start_loading_condition = 1;            // this line lets the threads exit their while loop and start loading
-  pthread_cond_broadcast(&start_loading); // sends signal to start loading thus waking up all the threads
-  read_time(&global_start_time);          // stars the global timer
-  pthread_mutex_unlock(&loading_mutex);   // unlocks the loading mutex so other threads can start loading
-
-  // Done loading, now crossing section
-  char last_station = 'n';         // starts as neither
-  int in_a_row = 0;                // counts the amount of trains that have gone in a row
-  int trains_left = max_trains;    // counts the number of trains that have left to cross
-  pthread_t threadIDs[max_trains]; // keeps track of the thread id as it processes the trains
-
-  while (trains_left > 0)
+  for (int i = 0; i < track_count; i++)
   {
-    pthread_mutex_lock(&queue_mutex);
-    while (train_in_queue <= 0)
+    tracks[i].last_station = -1;
+  }
+  stations = malloc(sizeof(struct heap) * station_count);
+  if (stations == NULL)
+  {
+    printf("ERROR: could not allocate memory\n");
+    exit(1);
+  }
+  for (int station = 0; station < station_count; station++)
+  {
+    heap_init(&stations[station], HEAP_CAPACITY, train_before);
+  }
+  if (strcmp(mode, "pool") == 0)
+  {
+    Run_Pool(max_trains, workers);
+  }
+  else if (strcmp(mode, "virtual") == 0)
+  {
+    Run_Virtual(max_trains);
+  }
+  else
+  {
+    if (latency)
     {
-      pthread_cond_wait(&done_loading, &queue_mutex);
+      grant_latency = calloc(max_trains > 0 ? max_trains : 1, sizeof(double));
     }
-    struct Train *cur_train = choose_next_train(&last_station, &in_a_row);
-    threadIDs[cur_train->train_num] = cur_train->threadID;
-    train_in_queue--;
-    trains_left--;
-    train_on_track = 1;
-    pthread_mutex_unlock(&queue_mutex);
-
-    pthread_mutex_lock(&track_mutex);
-    status_flags[cur_train->train_num] = GRANTED;
-    pthread_mutex_unlock(&track_mutex);
-    pthread_cond_signal(&(cur_train->cross_condition));
-
-    pthread_mutex_lock(&track_mutex);
-    while (train_on_track)
+    Run_Threads(max_trains);
+    if (latency)
     {
-      pthread_cond_wait(&done_crossing, &track_mutex);
+      Report_Latency(max_trains);
+      free(grant_latency);
     }
-    pthread_mutex_unlock(&track_mutex);
   }
 
-  for (int i = 0; i < max_trains; i++)
+  // frees all memory and variables that were used
+  free(trains);
+  for (int station = 0; station < station_count; station++)
   {
-    pthread_join(threadIDs[i], NULL); // this is like waiting for the mutex
+    heap_free(&stations[station]);
   }
+  free(stations);
+  free(station_names);
+  free(tracks);
 
-  // frees all memory and variables that were used
-  free(status_flags);
-
-  pthread_mutex_destroy(&loading_mutex);
   pthread_mutex_destroy(&queue_mutex);
-  pthread_mutex_destroy(&track_mutex);
-  pthread_cond_destroy(&done_loading);
   pthread_cond_destroy(&start_loading);
-  pthread_cond_destroy(&ready_to_load);
-  pthread_cond_destroy(&done_crossing);
 
   pthread_exit(NULL);
 }
@@ -1,22 +1,40 @@
+#define _GNU_SOURCE // for copy_file_range
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <string.h>
-#include <limits.h>
 #include <assert.h>
 #include <time.h>
 #include <sys/mman.h>
 #include <fcntl.h>
 #include <arpa/inet.h>
 #include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <dirent.h>
+#include <ftw.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <linux/io_uring.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <emmintrin.h>
+#include <immintrin.h>
+#endif
 
 // Constants
 #define FREE 0x00000000
 #define RESERVED 0x00000001
 #define LAST 0xFFFFFFFF
 #define FAT_ENTRY_SIZE 4
+#define SKIP_INTERVAL 64 // seeks into a chain keep every this many blocks of it
 
 // Super block
 struct __attribute__((__packed__)) superblock_t
@@ -54,10 +72,40 @@ struct __attribute__((__packed__)) dir_entry_t
     uint8_t unused[6];
 };
 
+// An opened disk image, the superblock is decoded once when the image is opened so every command
+// run against it can use the values directly instead of calling htonl/htons on each access
+struct fs_image
+{
+    FILE *file;
+    int fd;                      // file descriptor of the image or -1 if the image only exists in memory
+    unsigned char *memory;       // the memory map of the whole image or NULL if it is read through a block cache
+    off_t size;
+    struct block_device *device; // every read and write of the image goes through this
+    void *device_state;
+    size_t block_size;
+    uint32_t block_count;
+    uint32_t fat_start_block;
+    uint32_t fat_block_count;
+    uint32_t root_dir_start_block;
+    uint32_t root_dir_block_count;
+    size_t fat_entry_count;
+    uint32_t *fat; // the FAT decoded once into host byte order, every chain walk reads this instead of the image
+    size_t fat_dirty_first, fat_dirty_last; // the range of FAT entries changed since it was last written out
+    int writable; // set if the image was opened for writing
+    struct block_allocator *allocator; // made the first time blocks are allocated
+    struct dir_index *dir_index;       // NULL unless directory lookups are indexed
+    struct skip_index *skip_index;     // every Kth block of the chains that have been seeked into
+    struct journal *journal;           // changed metadata blocks not written to the image yet, NULL without a file
+};
+
+// every command takes the image and the arguments that come after the image name
+typedef int (*command_fn)(struct fs_image *image, int argc, char *argv[]);
+#define MAX_COMMAND_ARGS 16 // the most words a command read from a script or a socket can have
+
 // This function opens and returns the File pointer while also handling any errors
-FILE *open_file(char *name)
+FILE *open_file(char *name, int writable)
 {
-    FILE *file = fopen(name, "r");
+    FILE *file = fopen(name, writable ? "r+" : "r");
     if (file == NULL)
     {
         printf("ERROR: could not open file\n");
@@ -67,7 +115,8 @@ FILE *open_file(char *name)
 }
 
 // This function maps the file onto memory and returns a pointer to it
-unsigned char *get_memory_map(FILE *file, off_t *file_size)
+// writes to a writable map go straight to the file
+unsigned char *get_memory_map(FILE *file, off_t *file_size, int writable)
 {
     int file_num = fileno(file);
     struct stat fileStat;
@@ -80,350 +129,6749 @@ unsigned char *get_memory_map(FILE *file, off_t *file_size)
 
     off_t fileSize = fileStat.st_size;
     *file_size = fileSize;
-    unsigned char *file_memory = mmap(NULL, fileSize, PROT_READ, MAP_PRIVATE, file_num, 0);
+    int protection = writable ? PROT_READ | PROT_WRITE : PROT_READ;
+    unsigned char *file_memory = mmap(NULL, fileSize, protection, writable ? MAP_SHARED : MAP_PRIVATE, file_num, 0);
+    if (file_memory == MAP_FAILED)
+    {
+        printf("ERROR: could not map file\n");
+        fclose(file);
+        exit(1);
+    }
     return file_memory;
 }
 
-// This funtion returns the next block of a file or directory from a fat
-uint32_t get_next_block(unsigned char *base_file_memory, struct superblock_t *superblock, uint32_t entry_num)
+// Block devices
+// Everything that reads or writes the image goes through one of these so how the image is accessed can be picked
+// for each workload with the FATFS_IO environment variable. The mmap device (the default) maps the whole image and
+// lets the page cache and page faults do the work. The pread device reads whole pages with pread and keeps the most
+// recently used ones in a cache of FATFS_CACHE_PAGES pages, the direct device does the same with the image opened
+// with O_DIRECT so the kernel does not cache the image as well. Writes to the cached devices go straight through to
+// the file so nothing in the cache is ever newer than the file.
+struct extent;
+
+struct block_device
 {
-    size_t start_of_fat = htonl(superblock->fat_start_block) * htons(superblock->block_size);
-    unsigned char *fat_pointer = base_file_memory + start_of_fat; // moves to start of FAT
-    fat_pointer += (uint32_t)(entry_num * sizeof(uint32_t));      // moves to entry of the fat correlating to the next entry
-    return htonl(*((uint32_t *)fat_pointer));
+    char *name;
+    int zero_copy; // set if data can be copied straight out of the image file with copy_file_range or splice
+    void (*open)(struct fs_image *image);
+    int (*read)(struct fs_image *image, uint64_t offset, void *buffer, size_t length);
+    int (*write)(struct fs_image *image, uint64_t offset, const void *buffer, size_t length);
+    int (*sync)(struct fs_image *image);
+    void (*close)(struct fs_image *image);
+    // copies extents of the image to a file, NULL or returning 1 before anything is written means copy_extents
+    // does it the normal way
+    int (*copy)(struct fs_image *image, struct extent *extents, size_t extent_count, uint64_t size, int out_fd);
+};
+
+void map_device_open(struct fs_image *image)
+{
+    image->memory = get_memory_map(image->file, &image->size, image->writable);
+}
+
+int map_device_read(struct fs_image *image, uint64_t offset, void *buffer, size_t length)
+{
+    memcpy(buffer, image->memory + offset, length);
+    return 0;
+}
+
+int map_device_write(struct fs_image *image, uint64_t offset, const void *buffer, size_t length)
+{
+    memcpy(image->memory + offset, buffer, length);
+    return 0;
+}
+
+int map_device_sync(struct fs_image *image)
+{
+    return image->fd >= 0 ? msync(image->memory, image->size, MS_SYNC) : 0;
+}
+
+void map_device_close(struct fs_image *image)
+{
+    munmap(image->memory, image->size);
+}
+
+// images that only exist in memory use the map functions on a buffer
+void memory_device_close(struct fs_image *image)
+{
+    free(image->memory);
 }
 
-// This function prints out a given file or directory entry based on the given format
-void print_dir_entry(struct dir_entry_t *entry)
+#define DEFAULT_CACHE_PAGES 1024
+#define CACHE_BYPASS_PAGES 16 // reads at least this long skip the cache so copying a large file does not flush it
+
+// one page of the cache, the slots are kept in a list from most to least recently used
+struct cache_slot
+{
+    uint64_t page;
+    int in_use;
+    int newer, older;  // neighbours in the recently used list
+    int hash_next;     // next slot in the same hash bucket
+    unsigned char *data;
+};
+
+struct page_cache
+{
+    pthread_mutex_t mutex;
+    size_t page_size; // a multiple of 4096 so pages can be read with O_DIRECT
+    int direct_fd;    // the image opened with O_DIRECT or -1
+    int slot_count;
+    struct cache_slot *slots;
+    int *buckets;
+    int bucket_count;
+    int newest, oldest;
+    unsigned char *pages;
+    uint64_t hits, misses;
+};
+
+// reads count whole pages starting at first from the image into an aligned buffer, past the end of the image is zeros
+int cache_read_pages(struct fs_image *image, struct page_cache *cache, uint64_t first, size_t count, unsigned char *buffer)
 {
-    struct dir_entry_timedate_t time = entry->create_time;
-    if (entry->status == 3) // file
+    uint64_t offset = first * cache->page_size;
+    size_t length = count * cache->page_size;
+    size_t wanted = offset >= (uint64_t)image->size ? 0 : (image->size - offset < length ? image->size - offset : length);
+    size_t done = 0;
+    while (done < wanted)
     {
-        printf("F %10u %30s %u/%.2u/%.2u %u:%.2u:%.2u\n", htonl(entry->size), entry->filename, htons(time.year), time.month, time.day, time.hour, time.minute, time.second);
+        // O_DIRECT needs whole pages so the last page of the image is read through the normal descriptor
+        int direct = cache->direct_fd >= 0 && (wanted - done) >= cache->page_size;
+        size_t part = direct ? (wanted - done) / cache->page_size * cache->page_size : wanted - done;
+        ssize_t result = pread(direct ? cache->direct_fd : image->fd, buffer + done, part, offset + done);
+        if (result < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (result <= 0)
+        {
+            return -1;
+        }
+        done += result;
     }
-    else if (entry->status == 5) // directory
+    memset(buffer + wanted, 0, length - wanted);
+    return 0;
+}
+
+// writes count whole pages starting at first from an aligned buffer, the part past the end of the image is not written
+int cache_write_pages(struct fs_image *image, struct page_cache *cache, uint64_t first, size_t count, const unsigned char *buffer)
+{
+    uint64_t offset = first * cache->page_size;
+    size_t length = count * cache->page_size;
+    size_t wanted = offset >= (uint64_t)image->size ? 0 : (image->size - offset < length ? image->size - offset : length);
+    size_t done = 0;
+    while (done < wanted)
     {
-        printf("D %10u %30s %u/%.2u/%.2u %u:%.2u:%.2u\n", htonl(entry->size), entry->filename, htons(time.year), time.month, time.day, time.hour, time.minute, time.second);
+        int direct = cache->direct_fd >= 0 && (wanted - done) >= cache->page_size;
+        size_t part = direct ? (wanted - done) / cache->page_size * cache->page_size : wanted - done;
+        ssize_t result = pwrite(direct ? cache->direct_fd : image->fd, buffer + done, part, offset + done);
+        if (result < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (result <= 0)
+        {
+            return -1;
+        }
+        done += result;
     }
+    return 0;
 }
 
-// returns the pointer to the memory of an entry given a specific file or directory name
-size_t find_file_in_dir(unsigned char *base_file_memory, struct superblock_t *superblock, uint32_t start_block, char *name, int file_type)
+// takes a slot out of the recently used list
+void cache_unlink(struct page_cache *cache, int slot)
 {
-    if (file_type != 3 && file_type != 5)
+    struct cache_slot *cur = &cache->slots[slot];
+    if (cur->newer >= 0)
     {
-        printf("ERROR: incorrect file type given");
-        exit(1);
+        cache->slots[cur->newer].older = cur->older;
     }
-    size_t block_size = htons(superblock->block_size);
-    size_t entries_per_block = block_size / sizeof(struct dir_entry_t);
-    uint32_t cur_block = start_block;
-    struct dir_entry_t *entry = (struct dir_entry_t *)(base_file_memory + (block_size * cur_block));
-    // loop while the block in the FAT is not 0xFFFFFFFF meaning the directory ended
-    while (cur_block != LAST)
+    else
     {
-        // loops through each entry in this block of the directory
-        entry = (struct dir_entry_t *)(base_file_memory + (cur_block * block_size));
-        for (size_t i = 0; i < entries_per_block; i++)
-        {
-            // returns the offset if the value is correct
-            if (entry->status == file_type && strcmp((char *)(entry->filename), name) == 0)
-            {
-                return (size_t)((unsigned char *)entry - base_file_memory);
-            }
-
-            entry++;
-        }
-        cur_block = get_next_block(base_file_memory, superblock, cur_block);
+        cache->newest = cur->older;
+    }
+    if (cur->older >= 0)
+    {
+        cache->slots[cur->older].newer = cur->newer;
+    }
+    else
+    {
+        cache->oldest = cur->newer;
     }
-    // prints an error and returns if the file or directory is not found
-    printf("ERROR: File '%s' not found.\n", name);
-    exit(1);
-    return -1;
 }
 
-// This function returns the block number of the sub given sub directory
-uint32_t goto_sub_dir(unsigned char *base_file_memory, struct superblock_t *superblock, char *subdir_path)
+// puts a slot at the front of the recently used list
+void cache_push_newest(struct page_cache *cache, int slot)
 {
-    // sets up variables
-    size_t block_size = htons(superblock->block_size);
-    size_t start_of_root = (htonl(superblock->root_dir_start_block)) * block_size;
-    size_t entries_per_block = block_size / sizeof(struct dir_entry_t);
-
-    uint32_t cur_block = htonl(superblock->root_dir_start_block);
+    cache->slots[slot].newer = -1;
+    cache->slots[slot].older = cache->newest;
+    if (cache->newest >= 0)
+    {
+        cache->slots[cache->newest].newer = slot;
+    }
+    cache->newest = slot;
+    if (cache->oldest < 0)
+    {
+        cache->oldest = slot;
+    }
+}
 
-    // Parses the strings of the directory path given
-    char path[strlen(subdir_path) + 1];
-    strcpy(path, subdir_path);
+// returns the slot holding a page or -1 if it is not cached
+int cache_find(struct page_cache *cache, uint64_t page)
+{
+    int slot = cache->buckets[page % cache->bucket_count];
+    while (slot >= 0 && cache->slots[slot].page != page)
+    {
+        slot = cache->slots[slot].hash_next;
+    }
+    return slot;
+}
 
-    char *token = strtok(path, "/");
-    int next_block_count = 0;
-    struct dir_entry_t *entry = (struct dir_entry_t *)(base_file_memory + start_of_root);
-    // loops through each directory in the given path
-    while (token != NULL)
+// This function returns the slot holding a page, reading the page into the least recently used slot if it is not
+// cached, returns -1 if the page could not be read. The cache mutex must be held
+int cache_get(struct fs_image *image, struct page_cache *cache, uint64_t page)
+{
+    int slot = cache_find(cache, page);
+    if (slot >= 0)
     {
-        next_block_count = 0;
+        cache->hits++;
+        cache_unlink(cache, slot);
+        cache_push_newest(cache, slot);
+        return slot;
+    }
+    cache->misses++;
 
-        // looping through all the directory blocks directory
-        while (cur_block != LAST)
-        {
-            if (entry->status == 5 && strcmp((char *)(entry->filename), token) == 0)
-            {
-                // Move to the next subdirectory
-                cur_block = htonl(entry->starting_block);
-                entry = (struct dir_entry_t *)(base_file_memory + (cur_block * block_size));
-                break; // Exit the inner loop once the subdirectory is found
-            }
-            else if (next_block_count == entries_per_block)
-            {
-                // moves to the next block after visiting all the directory entries
-                cur_block = get_next_block(base_file_memory, superblock, cur_block);
-                entry = (struct dir_entry_t *)(base_file_memory + (cur_block * block_size));
-                next_block_count = 0;
-            }
-            else
-            {
-                entry++;
-                next_block_count++;
-            }
-        }
-        // if the function reaches the end of the last block of the file the sub directory has not been found and the program exits
-        if (cur_block == LAST)
+    // the oldest slot is reused, it is taken out of its hash bucket first
+    slot = cache->oldest;
+    struct cache_slot *cur = &cache->slots[slot];
+    if (cur->in_use)
+    {
+        int *link = &cache->buckets[cur->page % cache->bucket_count];
+        while (*link != slot)
         {
-            printf("ERROR: Subdirectory '%s' not found.\n", token);
-            exit(1);
+            link = &cache->slots[*link].hash_next;
         }
-        token = strtok(NULL, "/");
+        *link = cur->hash_next;
+        cur->in_use = 0;
     }
-    // return the block of the start of the next directory
-    return cur_block;
+    if (cache_read_pages(image, cache, page, 1, cur->data) == -1)
+    {
+        return -1;
+    }
+    cur->page = page;
+    cur->in_use = 1;
+    cur->hash_next = cache->buckets[page % cache->bucket_count];
+    cache->buckets[page % cache->bucket_count] = slot;
+    cache_unlink(cache, slot);
+    cache_push_newest(cache, slot);
+    return slot;
 }
 
-void walk_the_fat(FILE *file)
+// allocates a buffer that can be used with O_DIRECT
+unsigned char *alloc_aligned(size_t length)
 {
+    void *buffer;
+    if (posix_memalign(&buffer, 4096, length) != 0)
+    {
+        printf("ERROR: could not allocate memory\n");
+        exit(1);
+    }
+    return buffer;
 }
 
-// part 1
-void diskinfo(int argc, char *argv[])
+void cache_device_open(struct fs_image *image, int direct)
 {
-    // check command line arguments
-    if (argc != 2)
+    struct stat file_stat;
+    if (fstat(image->fd, &file_stat) == -1)
     {
-        printf("ERROR: Incorrect command line arguments\n");
+        printf("ERROR: could not get file status\n");
         exit(1);
     }
+    image->size = file_stat.st_size;
 
-    // get the file and memory map
-    FILE *file = open_file(argv[1]);
-    off_t file_size;
-    unsigned char *file_memory = get_memory_map(file, &file_size);
-    struct superblock_t *superblock = (struct superblock_t *)file_memory;
-
-    // print superblock information
-    printf("Super block information\n");
-    printf("Block size: %u\n", htons(superblock->block_size));
-    printf("Block count: %u\n", htonl(superblock->file_system_block_count));
-    printf("FAT starts: %u\n", htonl(superblock->fat_start_block));
-    printf("FAT blocks: %u\n", htonl(superblock->fat_block_count));
-    printf("Root directory starts: %u\n", htonl(superblock->root_dir_start_block));
-    printf("Root directory blocks: %u\n", htonl(superblock->root_dir_block_count));
+    struct page_cache *cache = calloc(1, sizeof(struct page_cache));
+    char *pages_setting = getenv("FATFS_CACHE_PAGES");
+    cache->slot_count = pages_setting != NULL && atoi(pages_setting) > 0 ? atoi(pages_setting) : DEFAULT_CACHE_PAGES;
+    cache->page_size = 4096;
+    cache->direct_fd = -1;
+    if (direct)
+    {
+        // the page size can only be known once the superblock is read so it is read through the normal descriptor
+        uint16_t block_size;
+        if (pread(image->fd, &block_size, sizeof(block_size), offsetof(struct superblock_t, block_size)) == sizeof(block_size))
+        {
+            cache->page_size = (htons(block_size) + 4095) / 4096 * 4096;
+        }
+        char path[64];
+        sprintf(path, "/proc/self/fd/%d", image->fd);
+        cache->direct_fd = open(path, (image->writable ? O_RDWR : O_RDONLY) | O_DIRECT);
+        // file systems like tmpfs do not support O_DIRECT, the cache still works without it
+    }
+    if (cache->page_size == 0)
+    {
+        cache->page_size = 4096;
+    }
+    cache->bucket_count = cache->slot_count * 2 + 1;
+    cache->slots = calloc(cache->slot_count, sizeof(struct cache_slot));
+    cache->buckets = malloc(cache->bucket_count * sizeof(int));
+    if (cache->slots == NULL || cache->buckets == NULL)
+    {
+        printf("ERROR: could not allocate memory\n");
+        exit(1);
+    }
+    cache->pages = alloc_aligned(cache->slot_count * cache->page_size);
+    memset(cache->buckets, 0xFF, cache->bucket_count * sizeof(int));
+    cache->newest = -1;
+    cache->oldest = -1;
+    for (int i = 0; i < cache->slot_count; i++)
+    {
+        cache->slots[i].data = cache->pages + (size_t)i * cache->page_size;
+        cache->slots[i].hash_next = -1;
+        cache_push_newest(cache, i);
+    }
+    pthread_mutex_init(&cache->mutex, NULL);
+    image->device_state = cache;
+}
 
-    size_t block_size = htons(superblock->block_size);
-    size_t num_fat_blocks = htonl(superblock->fat_block_count);
-    size_t fat_start_block = htonl(superblock->fat_start_block);
+void pread_device_open(struct fs_image *image)
+{
+    cache_device_open(image, 0);
+}
 
-    int block_count = 0;
-    int free_count = 0;
-    int reserved_count = 0;
-    int allocated_count = 0;
+void direct_device_open(struct fs_image *image)
+{
+    cache_device_open(image, 1);
+}
 
-    size_t fatSize = block_size * num_fat_blocks; // size of FAT in bytes
-    size_t numEntries = fatSize / FAT_ENTRY_SIZE;
-    size_t fat_offset = (fat_start_block) * (block_size);
-    uint32_t *fat_entry = (uint32_t *)(file_memory + fat_offset);
-    uint32_t cur_entry;
+// This function reads a range of the image through the page cache, large reads go straight to the file through a
+// bounce buffer so they do not push everything else out of the cache
+int cache_device_read(struct fs_image *image, uint64_t offset, void *buffer, size_t length)
+{
+    struct page_cache *cache = image->device_state;
+    unsigned char *out = buffer;
+    uint64_t first = offset / cache->page_size;
+    uint64_t last = (offset + length - 1) / cache->page_size;
+    if (length == 0)
+    {
+        return 0;
+    }
 
-    // calculate FAT information
-    while (block_count < numEntries)
+    if (last - first + 1 >= CACHE_BYPASS_PAGES)
     {
-        cur_entry = htonl(*fat_entry);
+        size_t chunk_pages = 256;
+        unsigned char *bounce = alloc_aligned(chunk_pages * cache->page_size);
+        int status = 0;
+        for (uint64_t page = first; page <= last && status == 0; page += chunk_pages)
+        {
+            size_t count = last - page + 1 < chunk_pages ? last - page + 1 : chunk_pages;
+            status = cache_read_pages(image, cache, page, count, bounce);
+            uint64_t start = page * cache->page_size > offset ? page * cache->page_size : offset;
+            uint64_t end = (page + count) * cache->page_size < offset + length ? (page + count) * cache->page_size : offset + length;
+            memcpy(out + (start - offset), bounce + (start - page * cache->page_size), end - start);
+        }
+        free(bounce);
+        return status;
+    }
 
-        if (cur_entry == FREE)
+    pthread_mutex_lock(&cache->mutex);
+    for (uint64_t page = first; page <= last; page++)
+    {
+        int slot = cache_get(image, cache, page);
+        if (slot == -1)
         {
-            free_count++;
+            pthread_mutex_unlock(&cache->mutex);
+            return -1;
         }
-        else if (cur_entry == RESERVED)
+        uint64_t start = page * cache->page_size > offset ? page * cache->page_size : offset;
+        uint64_t end = (page + 1) * cache->page_size < offset + length ? (page + 1) * cache->page_size : offset + length;
+        memcpy(out + (start - offset), cache->slots[slot].data + (start - page * cache->page_size), end - start);
+    }
+    pthread_mutex_unlock(&cache->mutex);
+    return 0;
+}
+
+// This function writes a range of the image one page at a time, every page touched is brought into the cache,
+// changed there and written straight to the file
+int cache_device_write(struct fs_image *image, uint64_t offset, const void *buffer, size_t length)
+{
+    struct page_cache *cache = image->device_state;
+    const unsigned char *in = buffer;
+    uint64_t first = offset / cache->page_size;
+    uint64_t last = (offset + length - 1) / cache->page_size;
+    if (length == 0)
+    {
+        return 0;
+    }
+    pthread_mutex_lock(&cache->mutex);
+    for (uint64_t page = first; page <= last; page++)
+    {
+        int slot = cache_get(image, cache, page);
+        if (slot == -1)
         {
-            reserved_count++;
+            pthread_mutex_unlock(&cache->mutex);
+            return -1;
         }
-        else
+        uint64_t start = page * cache->page_size > offset ? page * cache->page_size : offset;
+        uint64_t end = (page + 1) * cache->page_size < offset + length ? (page + 1) * cache->page_size : offset + length;
+        memcpy(cache->slots[slot].data + (start - page * cache->page_size), in + (start - offset), end - start);
+        if (cache_write_pages(image, cache, page, 1, cache->slots[slot].data) == -1)
         {
-            allocated_count++;
+            pthread_mutex_unlock(&cache->mutex);
+            return -1;
         }
-        block_count++;
-        fat_entry++;
     }
+    pthread_mutex_unlock(&cache->mutex);
+    return 0;
+}
 
-    // Print FAT informations
-    printf("FAT information\n");
-    printf("Free blocks: %d\n", free_count);
-    printf("Reserved blocks: %d\n", reserved_count);
-    printf("Allocated blocks: %d\n", allocated_count);
-
-    // unmap memory and close file
-    munmap(superblock, file_size);
-    fclose(file);
+int cache_device_sync(struct fs_image *image)
+{
+    return fdatasync(image->fd);
 }
 
-// part 2
-void disklist(int argc, char *argv[])
+void cache_device_close(struct fs_image *image)
 {
-    // check command line arguments
-    if (argc < 2 || argc > 3)
+    struct page_cache *cache = image->device_state;
+    if (getenv("FATFS_CACHE_STATS") != NULL)
     {
-        printf("ERROR: Incorrect command line arguments\n");
-        exit(1);
+        fprintf(stderr, "cache: %lu hits, %lu misses\n", (unsigned long)cache->hits, (unsigned long)cache->misses);
     }
+    if (cache->direct_fd >= 0)
+    {
+        close(cache->direct_fd);
+    }
+    pthread_mutex_destroy(&cache->mutex);
+    free(cache->pages);
+    free(cache->slots);
+    free(cache->buckets);
+    free(cache);
+}
 
-    // get the file and memory map
-    FILE *file = open_file(argv[1]);
-    off_t file_size;
-    unsigned char *file_memory = get_memory_map(file, &file_size);
-
-    // get superblock information
-    struct superblock_t *superblock = (struct superblock_t *)file_memory;
-    size_t start_of_root = htonl(superblock->root_dir_start_block);
-    size_t block_size = htons(superblock->block_size);
-    // size_t start_of_root_in_bytes = (start_of_root)*block_size;
-
-    size_t entries_per_block = block_size / sizeof(struct dir_entry_t);
+void uring_device_open(struct fs_image *image);
+int uring_copy_extents(struct fs_image *image, struct extent *extents, size_t extent_count, uint64_t size, int out_fd);
 
-    struct dir_entry_t *entry;
-    uint32_t cur_block = start_of_root;
+struct block_device block_devices[] = {
+    {"mmap", 1, map_device_open, map_device_read, map_device_write, map_device_sync, map_device_close, NULL},
+    {"pread", 1, pread_device_open, cache_device_read, cache_device_write, cache_device_sync, cache_device_close, NULL},
+    {"direct", 0, direct_device_open, cache_device_read, cache_device_write, cache_device_sync, cache_device_close, NULL},
+    {"uring", 0, uring_device_open, map_device_read, map_device_write, map_device_sync, map_device_close, uring_copy_extents},
+};
+#define BLOCK_DEVICE_COUNT (sizeof(block_devices) / sizeof(block_devices[0]))
 
-    // sets the directory block
-    if (argc == 3)
-    {
-        cur_block = goto_sub_dir(file_memory, superblock, argv[2]);
-    }
+struct block_device memory_device = {"memory", 0, NULL, map_device_read, map_device_write, map_device_sync, memory_device_close, NULL};
 
-    // loops through each block of the directory and prints out each other directory and file
-    while (cur_block != LAST)
+// returns the block device named by FATFS_IO or the mmap device if it is not set
+struct block_device *choose_block_device(void)
+{
+    char *name = getenv("FATFS_IO");
+    for (size_t i = 0; name != NULL && i < BLOCK_DEVICE_COUNT; i++)
     {
-        entry = (struct dir_entry_t *)(file_memory + (cur_block * block_size));
-        for (size_t i = 0; i < entries_per_block; i++)
+        if (strcmp(block_devices[i].name, name) == 0)
         {
-            print_dir_entry(entry);
-            entry++;
+            return &block_devices[i];
         }
-        cur_block = get_next_block(file_memory, superblock, cur_block);
     }
-    // unmaps memory and closes file
-    munmap(file_memory, file_size);
-    fclose(file);
+    if (name != NULL)
+    {
+        printf("ERROR: unknown FATFS_IO '%s', using mmap\n", name);
+    }
+    return &block_devices[0];
 }
 
-// part 3
-void diskget(int argc, char *argv[])
+void journal_overlay(struct fs_image *image, uint64_t offset, void *buffer, size_t length);
+int journal_has_blocks(struct fs_image *image);
+
+// reads a range of the image, an image that can not be read any more is not something a command can recover from
+// blocks changed by a transaction that has not been written to the image yet are read from the journal
+void read_image(struct fs_image *image, uint64_t offset, void *buffer, size_t length)
 {
-    // check command line arguments
-    if (argc != 4)
+    if (offset + length > (uint64_t)image->size || image->device->read(image, offset, buffer, length) == -1)
     {
-        printf("ERROR: Incorrect command line arguments\n");
+        printf("ERROR: could not read the image at offset %lu\n", (unsigned long)offset);
         exit(1);
     }
+    journal_overlay(image, offset, buffer, length);
+}
 
-    // get the file and memory map
-    FILE *file = open_file(argv[1]);
-    off_t file_size;
-    unsigned char *file_memory = get_memory_map(file, &file_size);
-
-    struct superblock_t *superblock = (struct superblock_t *)file_memory;
-    size_t start_block = htonl(superblock->root_dir_start_block);
-    size_t block_size = htons(superblock->block_size);
+// writes a range of the image
+void write_image(struct fs_image *image, uint64_t offset, const void *buffer, size_t length)
+{
+    if (offset + length > (uint64_t)image->size || image->device->write(image, offset, buffer, length) == -1)
+    {
+        printf("ERROR: could not write the image at offset %lu\n", (unsigned long)offset);
+        exit(1);
+    }
+}
 
-    // locate the File
-    char file_path[strlen(argv[2]) + 1];
-    strcpy(file_path, argv[2]);
+// byte swaps count big endian FAT entries from src into dst in host byte order, src and dst can be the same
+void decode_fat_entries(uint32_t *dst, const uint32_t *src, size_t count)
+{
+    size_t i = 0;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#if defined(__x86_64__) || defined(__i386__)
+    // SSE2 has no byte shuffle so swap the 16 bit halves of each word and then the bytes in each half
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128i words = _mm_loadu_si128((const __m128i *)(src + i));
+        words = _mm_shufflehi_epi16(_mm_shufflelo_epi16(words, _MM_SHUFFLE(2, 3, 0, 1)), _MM_SHUFFLE(2, 3, 0, 1));
+        words = _mm_or_si128(_mm_slli_epi16(words, 8), _mm_srli_epi16(words, 8));
+        _mm_storeu_si128((__m128i *)(dst + i), words);
+    }
+#endif
+    for (; i < count; i++)
+    {
+        dst[i] = __builtin_bswap32(src[i]);
+    }
+#else
+    memmove(dst, src, count * sizeof(uint32_t));
+#endif
+}
 
-    // separate directory path and file name
-    char *file_name = strrchr(file_path, '/');
-    char *directory = NULL;
+// returns the byte offset of a FAT entry in the image
+uint64_t fat_entry_offset(struct fs_image *image, uint32_t entry_num)
+{
+    return (uint64_t)image->fat_start_block * image->block_size + (uint64_t)entry_num * FAT_ENTRY_SIZE;
+}
 
-    if (file_name != NULL)
+// reads the whole FAT from the image and decodes it into the cache
+void load_fat(struct fs_image *image)
+{
+    if (image->memory != NULL && !journal_has_blocks(image))
     {
-        *file_name = '\0';     // Null-terminate to separate directory and file name
-        file_name++;           // Move to the character after '/' so it is just the file name
-        directory = file_path; // Set directory to the beginning of the string
+        decode_fat_entries(image->fat, (uint32_t *)(image->memory + fat_entry_offset(image, 0)), image->fat_entry_count);
     }
     else
     {
-        file_name = file_path; // if path doesnt have a '/' file name is just the name
+        read_image(image, fat_entry_offset(image, 0), image->fat, image->fat_entry_count * FAT_ENTRY_SIZE);
+        decode_fat_entries(image->fat, image->fat, image->fat_entry_count);
     }
+    image->fat_dirty_first = 1;
+    image->fat_dirty_last = 0;
+}
 
-    if (directory != NULL)
+// This function reads the superblock of an image through its block device and decodes its FAT
+void decode_image(struct fs_image *image)
+{
+    if (image->size < sizeof(struct superblock_t))
     {
-        start_block = goto_sub_dir(file_memory, superblock, directory);
+        printf("ERROR: image is too small to hold a superblock\n");
+        exit(1);
     }
 
-    size_t offset = find_file_in_dir(file_memory, superblock, start_block, file_name, 3);
+    struct superblock_t superblock;
+    read_image(image, 0, &superblock, sizeof(superblock));
+    image->block_size = htons(superblock.block_size);
+    image->block_count = htonl(superblock.file_system_block_count);
+    image->fat_start_block = htonl(superblock.fat_start_block);
+    image->fat_block_count = htonl(superblock.fat_block_count);
+    image->root_dir_start_block = htonl(superblock.root_dir_start_block);
+    image->root_dir_block_count = htonl(superblock.root_dir_block_count);
 
-    struct dir_entry_t *entry = (struct dir_entry_t *)(file_memory + offset);
-    uint32_t output_file_size = entry->size;
-    uint32_t cur_file_block = htonl(entry->starting_block);
+    size_t fat_end = (image->fat_start_block + (size_t)image->fat_block_count) * image->block_size;
+    if (image->block_size == 0 || fat_end > image->size)
+    {
+        printf("ERROR: superblock does not match the image size\n");
+        exit(1);
+    }
+    image->fat_entry_count = image->fat_block_count * image->block_size / FAT_ENTRY_SIZE;
 
-    // opens a file to write to
-    FILE *write_file = fopen(argv[3], "wb");
+    image->fat = malloc(image->fat_entry_count * sizeof(uint32_t));
+    if (image->fat == NULL)
+    {
+        printf("ERROR: could not allocate memory\n");
+        exit(1);
+    }
+    load_fat(image);
+}
 
-    if (write_file == NULL)
+struct skip_index *make_skip_index(uint32_t interval);
+void open_journal(struct fs_image *image, char *name);
+
+// This function opens an image with the block device picked by FATFS_IO, finishes any transaction its journal
+// holds and decodes its superblock and FAT
+struct fs_image *open_image(char *name, int writable)
+{
+    struct fs_image *image = calloc(1, sizeof(struct fs_image));
+    if (image == NULL)
     {
-        printf("ERROR: could not open file\n");
-        munmap(file_memory, file_size);
-        fclose(file);
+        printf("ERROR: could not allocate memory\n");
         exit(1);
     }
-    uint32_t bytes_written = 0;
-    uint32_t bytes_to_write = block_size;
-    // loops through each block of the file and writes its contents to the file
-    while (cur_file_block != LAST)
+    image->file = open_file(name, writable);
+    image->fd = fileno(image->file);
+    image->writable = writable;
+    image->device = choose_block_device();
+    image->device->open(image);
+    open_journal(image, name);
+    decode_image(image);
+    image->skip_index = make_skip_index(SKIP_INTERVAL);
+    return image;
+}
+
+void free_allocator(struct block_allocator *allocator);
+void free_dir_index(struct dir_index *index);
+void free_skip_index(struct skip_index *index);
+void clear_skip_index(struct skip_index *index);
+void clear_dir_index(struct fs_image *image);
+int pwrite_all(int fd, const unsigned char *buffer, size_t length, off_t offset);
+int read_all_at(int fd, unsigned char *buffer, size_t length, off_t offset);
+void commit_transaction(struct fs_image *image);
+void close_journal(struct fs_image *image);
+
+// This function commits anything left, closes the image and frees everything cached about it
+void close_image(struct fs_image *image)
+{
+    commit_transaction(image);
+    close_journal(image);
+    free_dir_index(image->dir_index);
+    free_skip_index(image->skip_index);
+    free_allocator(image->allocator);
+    free(image->fat);
+    image->device->close(image);
+    if (image->file != NULL)
     {
-        size_t writing_offset = cur_file_block * block_size;
-        if ((output_file_size - bytes_written) < block_size)
-        {
-            bytes_to_write = output_file_size - bytes_written;
-        }
-        else
-        {
-            bytes_to_write = block_size;
-        }
-        fwrite(file_memory + writing_offset, 1, bytes_to_write, write_file);
-        bytes_written += bytes_to_write;
-        cur_file_block = get_next_block(file_memory, superblock, cur_file_block);
+        fclose(image->file);
     }
-    // unmaps the memory and closes the files
-    fclose(write_file);
-    munmap(file_memory, file_size);
-    fclose(file);
+    free(image);
 }
 
-// part 4
-void diskput(int argc, char *argv[])
+// returns the current time in seconds
+double now_seconds(void)
 {
-    // I did not do part 4
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
 }
 
-int main(int argc, char *argv[])
+// returns the byte offset of the start of a block in the image
+uint64_t block_offset(struct fs_image *image, uint32_t block_num)
 {
-#if defined(PART1)
-    diskinfo(argc, argv);
-#elif defined(PART2)
-    disklist(argc, argv);
-#elif defined(PART3)
-    diskget(argc, argv);
-#elif defined(PART4)
-    diskput(argc, argv);
-#else
-#error "argc[1234] must be defined"
-#endif
-    return 0;
-}
\ No newline at end of file
+    return (uint64_t)block_num * image->block_size;
+}
+
+// This funtion returns the next block of a file or directory from a fat
+// a block past the end of the FAT can only come from a corrupt entry so it ends the chain there
+uint32_t get_next_block(struct fs_image *image, uint32_t entry_num)
+{
+    return entry_num < image->fat_entry_count ? image->fat[entry_num] : LAST;
+}
+
+// returns 1 if a block is inside the image and can be part of a chain
+int is_valid_block(struct fs_image *image, uint32_t block_num)
+{
+    return block_num < image->block_count && block_offset(image, block_num) + image->block_size <= (uint64_t)image->size;
+}
+
+// sets an entry of the decoded FAT, the image itself is only updated by flush_fat
+void set_fat_entry(struct fs_image *image, uint32_t entry_num, uint32_t value)
+{
+    image->fat[entry_num] = value;
+    if (image->fat_dirty_first > image->fat_dirty_last)
+    {
+        image->fat_dirty_first = entry_num;
+        image->fat_dirty_last = entry_num;
+    }
+    else if (entry_num < image->fat_dirty_first)
+    {
+        image->fat_dirty_first = entry_num;
+    }
+    else if (entry_num > image->fat_dirty_last)
+    {
+        image->fat_dirty_last = entry_num;
+    }
+}
+
+void write_metadata(struct fs_image *image, uint64_t offset, const void *buffer, size_t length);
+
+// This function writes the part of the FAT that changed back to the image (or the journal) with one write
+void flush_fat(struct fs_image *image)
+{
+    if (image->fat_dirty_first > image->fat_dirty_last)
+    {
+        return;
+    }
+    size_t count = image->fat_dirty_last - image->fat_dirty_first + 1;
+    uint32_t *encoded = malloc(count * sizeof(uint32_t));
+    if (encoded == NULL)
+    {
+        printf("ERROR: could not allocate memory\n");
+        exit(1);
+    }
+    decode_fat_entries(encoded, image->fat + image->fat_dirty_first, count); // swapping is the same both ways
+    write_metadata(image, fat_entry_offset(image, image->fat_dirty_first), encoded, count * sizeof(uint32_t));
+    free(encoded);
+    image->fat_dirty_first = 1;
+    image->fat_dirty_last = 0;
+}
+
+// Journal
+// Changes to the FAT, directories and superblock are not written to the image straight away. Inside a transaction
+// every block of metadata that changes is copied into the journal once and later changes to it go to that copy, so
+// putting many files into one directory writes each FAT and directory block once however many times it changed.
+// Reads of the image see the copies. File data is written straight to its new blocks since nothing points at them
+// until the transaction commits. Committing
+//   1. syncs the image so the file data is on disk before anything points at it
+//   2. writes every copy to <image>.journal with a checksum in one write and syncs it, the transaction has now
+//      happened
+//   3. writes the copies over their blocks in the image, one write for each run of neighbouring blocks, and syncs it
+//   4. empties the journal
+// so the image is synced twice per transaction instead of after every block or file. If the program stops between
+// 2 and 4 opening the image for writing again does 3 and 4 again, and opening it read only reads the blocks from
+// the journal. A journal that was only partly written fails its checksum and is thrown away, which leaves the image
+// as it was before the transaction. Outside of begin and commit in batch mode every command is its own transaction.
+// Only the thread running commands changes the journal so the worker threads of get -r, check and fatfsd read it
+// without a lock.
+#define JOURNAL_MAGIC "FATFSJNL"
+#define JOURNAL_MIN_SLOTS 64
+
+// the journal file is this header, the block numbers and then the blocks, all big endian like the image
+struct __attribute__((__packed__)) journal_header
+{
+    uint8_t magic[8];
+    uint32_t block_size;
+    uint32_t block_count;
+    uint64_t checksum; // of the block numbers and blocks after the header
+};
+
+struct journal_block
+{
+    uint32_t block; // LAST for an empty slot
+    unsigned char *data;
+};
+
+struct journal
+{
+    char *path;
+    int fd;           // the journal file, opened the first time a transaction commits
+    int in_transaction; // set between begin and commit
+    struct journal_block *slots; // the copied blocks in a hash table keyed by block number
+    size_t capacity;
+    size_t count;
+};
+
+// FNV-1a over a range of bytes, carrying on from hash
+uint64_t journal_checksum(uint64_t hash, const unsigned char *data, size_t length)
+{
+    for (size_t i = 0; i < length; i++)
+    {
+        hash = (hash ^ data[i]) * 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+size_t journal_slot_of(uint32_t block, size_t capacity)
+{
+    return (block * 2654435761u) & (capacity - 1);
+}
+
+// returns 1 if any block read from the image has to be looked for in the journal first
+int journal_has_blocks(struct fs_image *image)
+{
+    return image->journal != NULL && image->journal->count > 0;
+}
+
+// returns the copy of a block in the journal or NULL if the block has not changed
+unsigned char *journal_find_block(struct fs_image *image, uint32_t block)
+{
+    struct journal *journal = image->journal;
+    if (!journal_has_blocks(image))
+    {
+        return NULL;
+    }
+    for (size_t slot = journal_slot_of(block, journal->capacity); journal->slots[slot].block != LAST;
+         slot = (slot + 1) & (journal->capacity - 1))
+    {
+        if (journal->slots[slot].block == block)
+        {
+            return journal->slots[slot].data;
+        }
+    }
+    return NULL;
+}
+
+// adds a block to the hash table of a journal, which must have room for it
+void journal_insert(struct journal *journal, uint32_t block, unsigned char *data)
+{
+    size_t slot = journal_slot_of(block, journal->capacity);
+    while (journal->slots[slot].block != LAST)
+    {
+        slot = (slot + 1) & (journal->capacity - 1);
+    }
+    journal->slots[slot].block = block;
+    journal->slots[slot].data = data;
+    journal->count++;
+}
+
+// makes an empty hash table for a journal with room for capacity slots
+void journal_reset_slots(struct journal *journal, size_t capacity)
+{
+    journal->slots = malloc(capacity * sizeof(struct journal_block));
+    if (journal->slots == NULL)
+    {
+        printf("ERROR: could not allocate memory\n");
+        exit(1);
+    }
+    for (size_t i = 0; i < capacity; i++)
+    {
+        journal->slots[i].block = LAST;
+    }
+    journal->capacity = capacity;
+    journal->count = 0;
+}
+
+// This function returns the copy of a block in the journal, copying the block from the image the first time it is
+// changed in a transaction. The table doubles once it is 3/4 full
+unsigned char *journal_get_block(struct fs_image *image, uint32_t block)
+{
+    struct journal *journal = image->journal;
+    unsigned char *data = journal_find_block(image, block);
+    if (data != NULL)
+    {
+        return data;
+    }
+    if ((journal->count + 1) * 4 > journal->capacity * 3)
+    {
+        struct journal_block *old_slots = journal->slots;
+        size_t old_capacity = journal->capacity;
+        journal_reset_slots(journal, old_capacity * 2);
+        for (size_t i = 0; i < old_capacity; i++)
+        {
+            if (old_slots[i].block != LAST)
+            {
+                journal_insert(journal, old_slots[i].block, old_slots[i].data);
+            }
+        }
+        free(old_slots);
+    }
+    data = malloc(image->block_size);
+    if (data == NULL)
+    {
+        printf("ERROR: could not allocate memory\n");
+        exit(1);
+    }
+    read_image(image, block_offset(image, block), data, image->block_size);
+    journal_insert(journal, block, data);
+    return data;
+}
+
+// copies the blocks in the journal that are part of a range of the image over what was read from the image
+void journal_overlay(struct fs_image *image, uint64_t offset, void *buffer, size_t length)
+{
+    if (!journal_has_blocks(image) || length == 0)
+    {
+        return;
+    }
+    uint64_t first = offset / image->block_size;
+    uint64_t last = (offset + length - 1) / image->block_size;
+    for (uint64_t block = first; block <= last; block++)
+    {
+        unsigned char *data = journal_find_block(image, block);
+        if (data != NULL)
+        {
+            uint64_t start = block_offset(image, block) > offset ? block_offset(image, block) : offset;
+            uint64_t end = block_offset(image, block) + image->block_size < offset + length ? block_offset(image, block) + image->block_size : offset + length;
+            memcpy((unsigned char *)buffer + (start - offset), data + (start - block_offset(image, block)), end - start);
+        }
+    }
+}
+
+// writes a range of the FAT, a directory or the superblock, into the journal if the image has one
+void write_metadata(struct fs_image *image, uint64_t offset, const void *buffer, size_t length)
+{
+    if (image->journal == NULL)
+    {
+        write_image(image, offset, buffer, length);
+        return;
+    }
+    if (offset + length > (uint64_t)image->size)
+    {
+        printf("ERROR: could not write the image at offset %lu\n", (unsigned long)offset);
+        exit(1);
+    }
+    const unsigned char *bytes = buffer;
+    while (length > 0)
+    {
+        uint32_t block = offset / image->block_size;
+        size_t start = offset - block_offset(image, block);
+        size_t part = image->block_size - start < length ? image->block_size - start : length;
+        memcpy(journal_get_block(image, block) + start, bytes, part);
+        bytes += part;
+        offset += part;
+        length -= part;
+    }
+}
+
+int compare_journal_blocks(const void *a, const void *b)
+{
+    uint32_t block_a = ((const struct journal_block *)a)->block;
+    uint32_t block_b = ((const struct journal_block *)b)->block;
+    return block_a < block_b ? -1 : block_a > block_b;
+}
+
+// returns the blocks in the journal sorted by block number
+struct journal_block *sorted_journal_blocks(struct journal *journal)
+{
+    struct journal_block *blocks = malloc((journal->count + 1) * sizeof(struct journal_block));
+    if (blocks == NULL)
+    {
+        printf("ERROR: could not allocate memory\n");
+        exit(1);
+    }
+    size_t count = 0;
+    for (size_t i = 0; i < journal->capacity; i++)
+    {
+        if (journal->slots[i].block != LAST)
+        {
+            blocks[count++] = journal->slots[i];
+        }
+    }
+    qsort(blocks, count, sizeof(struct journal_block), compare_journal_blocks);
+    return blocks;
+}
+
+// forgets every block in the journal
+void journal_clear(struct journal *journal)
+{
+    for (size_t i = 0; i < journal->capacity; i++)
+    {
+        if (journal->slots[i].block != LAST)
+        {
+            free(journal->slots[i].data);
+            journal->slots[i].block = LAST;
+        }
+    }
+    journal->count = 0;
+}
+
+// This function does steps 3 and 4 of a commit: the blocks in the journal are written to the image, the image is
+// synced and the journal file is emptied
+void apply_journal(struct fs_image *image)
+{
+    struct journal *journal = image->journal;
+    struct journal_block *blocks = sorted_journal_blocks(journal);
+    size_t count = journal->count;
+    unsigned char *run = malloc(count * image->block_size);
+    if (run == NULL)
+    {
+        printf("ERROR: could not allocate memory\n");
+        exit(1);
+    }
+    journal->count = 0; // so the writes below are not read back from the journal
+    for (size_t i = 0; i < count;)
+    {
+        size_t length = 1;
+        memcpy(run, blocks[i].data, image->block_size);
+        while (i + length < count && blocks[i + length].block == blocks[i].block + length)
+        {
+            memcpy(run + length * image->block_size, blocks[i + length].data, image->block_size);
+            length++;
+        }
+        write_image(image, block_offset(image, blocks[i].block), run, length * image->block_size);
+        i += length;
+    }
+    free(run);
+    free(blocks);
+    journal->count = count;
+    journal_clear(journal);
+    if (image->device->sync(image) == -1 || ftruncate(journal->fd, 0) == -1 || fdatasync(journal->fd) == -1)
+    {
+        printf("ERROR: could not write the journal\n");
+        exit(1);
+    }
+}
+
+// This function opens the journal of an image and loads a transaction that was committed to it but not written to
+// the image yet, which is then finished if the image is writable. A journal that is not whole is thrown away
+void open_journal(struct fs_image *image, char *name)
+{
+    struct journal *journal = calloc(1, sizeof(struct journal));
+    journal->path = malloc(strlen(name) + sizeof(".journal"));
+    if (journal == NULL || journal->path == NULL)
+    {
+        printf("ERROR: could not allocate memory\n");
+        exit(1);
+    }
+    sprintf(journal->path, "%s.journal", name);
+    journal_reset_slots(journal, JOURNAL_MIN_SLOTS);
+    image->journal = journal;
+    journal->fd = open(journal->path, image->writable ? O_RDWR : O_RDONLY);
+    struct stat journal_stat;
+    if (journal->fd == -1 || fstat(journal->fd, &journal_stat) == -1 || journal_stat.st_size == 0)
+    {
+        return;
+    }
+
+    unsigned char *contents = malloc(journal_stat.st_size);
+    struct journal_header *header = (struct journal_header *)contents;
+    if (contents == NULL)
+    {
+        printf("ERROR: could not allocate memory\n");
+        exit(1);
+    }
+    int whole = 0;
+    if (journal_stat.st_size >= (off_t)sizeof(struct journal_header) && read_all_at(journal->fd, contents, journal_stat.st_size, 0) == 0 &&
+        memcmp(header->magic, JOURNAL_MAGIC, sizeof(header->magic)) == 0)
+    {
+        uint64_t block_size = htonl(header->block_size);
+        uint64_t block_count = htonl(header->block_count);
+        uint64_t body_size = block_count * (sizeof(uint32_t) + block_size);
+        whole = block_size > 0 && sizeof(struct journal_header) + body_size == (uint64_t)journal_stat.st_size &&
+                journal_checksum(0xCBF29CE484222325ULL, contents + sizeof(struct journal_header), body_size) == be64toh(header->checksum);
+        uint32_t *numbers = (uint32_t *)(contents + sizeof(struct journal_header));
+        unsigned char *data = (unsigned char *)(numbers + block_count);
+        for (uint64_t i = 0; whole && i < block_count; i++)
+        {
+            whole = ((uint64_t)htonl(numbers[i]) + 1) * block_size <= (uint64_t)image->size;
+        }
+        // the blocks are loaded before the superblock is decoded so block_size is taken from the journal
+        image->block_size = block_size;
+        size_t capacity = JOURNAL_MIN_SLOTS;
+        while (whole && capacity * 3 < block_count * 4)
+        {
+            capacity *= 2;
+        }
+        free(journal->slots);
+        journal_reset_slots(journal, capacity);
+        for (uint64_t i = 0; whole && i < block_count; i++)
+        {
+            unsigned char *copy = malloc(block_size);
+            if (copy == NULL)
+            {
+                printf("ERROR: could not allocate memory\n");
+                exit(1);
+            }
+            memcpy(copy, data + i * block_size, block_size);
+            journal_insert(journal, htonl(numbers[i]), copy);
+        }
+    }
+    free(contents);
+    if (whole && image->writable)
+    {
+        printf("Recovered a transaction of %zu blocks from %s\n", journal->count, journal->path);
+        apply_journal(image);
+    }
+    else if (!whole && image->writable && (ftruncate(journal->fd, 0) == -1 || fdatasync(journal->fd) == -1))
+    {
+        printf("ERROR: could not write the journal\n");
+        exit(1);
+    }
+}
+
+// This function commits the changes made since the last commit, doing nothing if nothing changed
+void commit_transaction(struct fs_image *image)
+{
+    flush_fat(image);
+    struct journal *journal = image->journal;
+    if (journal == NULL || !image->writable) // a read only image can only hold blocks loaded from its journal
+    {
+        return;
+    }
+    journal->in_transaction = 0;
+    if (journal->count == 0)
+    {
+        return;
+    }
+    if (journal->fd == -1)
+    {
+        journal->fd = open(journal->path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    }
+
+    // the header, block numbers and blocks are built in one buffer and written with one write
+    struct journal_block *blocks = sorted_journal_blocks(journal);
+    size_t body_size = journal->count * (sizeof(uint32_t) + image->block_size);
+    unsigned char *contents = malloc(sizeof(struct journal_header) + body_size);
+    if (contents == NULL)
+    {
+        printf("ERROR: could not allocate memory\n");
+        exit(1);
+    }
+    struct journal_header *header = (struct journal_header *)contents;
+    memcpy(header->magic, JOURNAL_MAGIC, sizeof(header->magic));
+    header->block_size = htonl(image->block_size);
+    header->block_count = htonl(journal->count);
+    uint32_t *numbers = (uint32_t *)(contents + sizeof(struct journal_header));
+    unsigned char *data = (unsigned char *)(numbers + journal->count);
+    for (size_t i = 0; i < journal->count; i++)
+    {
+        numbers[i] = htonl(blocks[i].block);
+        memcpy(data + i * image->block_size, blocks[i].data, image->block_size);
+    }
+    header->checksum = htobe64(journal_checksum(0xCBF29CE484222325ULL, contents + sizeof(struct journal_header), body_size));
+    free(blocks);
+
+    if (image->device->sync(image) == -1 || journal->fd == -1 ||
+        pwrite_all(journal->fd, contents, sizeof(struct journal_header) + body_size, 0) == -1 || fdatasync(journal->fd) == -1)
+    {
+        printf("ERROR: could not write the journal\n");
+        exit(1);
+    }
+    free(contents);
+    apply_journal(image);
+}
+
+// starts a transaction, the changes of every command until commit are written to the image together
+// returns 0 on success and -1 after printing an error
+int begin_transaction(struct fs_image *image)
+{
+    if (!image->writable || image->journal == NULL)
+    {
+        printf("ERROR: the image was not opened for writing\n");
+        return -1;
+    }
+    commit_transaction(image);
+    image->journal->in_transaction = 1;
+    return 0;
+}
+
+// returns 1 if begin has been run without a commit
+int in_transaction(struct fs_image *image)
+{
+    return image->journal != NULL && image->journal->in_transaction;
+}
+
+// This function throws away every change since the last commit. The file data that was written stays in blocks
+// that are free again and everything cached from the metadata that changed is read again from the image
+void abort_transaction(struct fs_image *image)
+{
+    if (image->journal != NULL)
+    {
+        journal_clear(image->journal);
+        image->journal->in_transaction = 0;
+    }
+    load_fat(image);
+    free_allocator(image->allocator);
+    image->allocator = NULL;
+    clear_dir_index(image);
+    clear_skip_index(image->skip_index);
+    struct superblock_t superblock;
+    read_image(image, 0, &superblock, sizeof(superblock));
+    image->root_dir_block_count = htonl(superblock.root_dir_block_count);
+}
+
+void free_journal(struct journal *journal)
+{
+    if (journal == NULL)
+    {
+        return;
+    }
+    journal_clear(journal);
+    if (journal->fd != -1)
+    {
+        close(journal->fd);
+    }
+    free(journal->slots);
+    free(journal->path);
+    free(journal);
+}
+
+// frees the journal of an image after its last commit, every change is in the image by then so the empty journal
+// file of a writable image is removed instead of being left next to it
+void close_journal(struct fs_image *image)
+{
+    if (image->writable && image->journal != NULL && image->journal->fd != -1)
+    {
+        unlink(image->journal->path);
+    }
+    free_journal(image->journal);
+}
+
+// Directory reading
+// The entries of a directory are read one block at a time, straight from the memory map if the image has one
+// or into a buffer through the block device otherwise
+struct dir_reader
+{
+    struct fs_image *image;
+    uint32_t block; // the block being read, LAST once the directory has ended
+    size_t index;   // the next entry to read in that block
+    uint32_t blocks_read;
+    size_t entries_per_block;
+    struct dir_entry_t *entries;
+    unsigned char *buffer;
+};
+
+// loads the block the reader is on, from the journal if it changed in the transaction that is not committed yet
+void load_dir_block(struct dir_reader *reader)
+{
+    struct fs_image *image = reader->image;
+    if (reader->block != LAST && (!is_valid_block(image, reader->block) || ++reader->blocks_read > image->block_count))
+    {
+        printf("ERROR: a directory chain is broken at block %u, run diskcheck\n", reader->block);
+        reader->block = LAST;
+    }
+    if (reader->block == LAST)
+    {
+        return;
+    }
+    unsigned char *journaled = journal_find_block(image, reader->block);
+    if (journaled != NULL)
+    {
+        reader->entries = (struct dir_entry_t *)journaled;
+    }
+    else if (image->memory != NULL)
+    {
+        reader->entries = (struct dir_entry_t *)(image->memory + block_offset(image, reader->block));
+    }
+    else
+    {
+        read_image(image, block_offset(image, reader->block), reader->buffer, image->block_size);
+        reader->entries = (struct dir_entry_t *)reader->buffer;
+    }
+}
+
+void start_dir_reader(struct dir_reader *reader, struct fs_image *image, uint32_t start_block)
+{
+    reader->image = image;
+    reader->block = start_block;
+    reader->index = 0;
+    reader->blocks_read = 0;
+    reader->entries_per_block = image->block_size / sizeof(struct dir_entry_t);
+    reader->buffer = image->memory == NULL ? malloc(image->block_size) : NULL;
+    load_dir_block(reader);
+}
+
+// This function returns the next entry of the directory whether it is in use or not, or NULL once there are no
+// more. offset is set to where the entry is in the image. The entry is only valid until the next call
+struct dir_entry_t *next_dir_entry(struct dir_reader *reader, uint64_t *offset)
+{
+    if (reader->block != LAST && reader->index == reader->entries_per_block)
+    {
+        reader->block = get_next_block(reader->image, reader->block);
+        reader->index = 0;
+        load_dir_block(reader);
+    }
+    if (reader->block == LAST || reader->entries_per_block == 0)
+    {
+        return NULL;
+    }
+    if (offset != NULL)
+    {
+        *offset = block_offset(reader->image, reader->block) + reader->index * sizeof(struct dir_entry_t);
+    }
+    return &reader->entries[reader->index++];
+}
+
+void end_dir_reader(struct dir_reader *reader)
+{
+    free(reader->buffer);
+}
+
+// Free space allocator
+// A bitmap with a bit set for every free block is built from the FAT the first time anything is allocated, so
+// finding free blocks skips 64 used blocks per word instead of reading every FAT entry. Searches start where the
+// last allocation ended (next fit) and look for one run of free blocks big enough for the whole request.
+struct block_allocator
+{
+    uint64_t *free_map;
+    uint32_t block_count; // number of blocks the bitmap covers
+    uint32_t free_count;
+    uint32_t cursor; // where the next search starts
+};
+
+// returns how many blocks can be used, which is only the blocks that have a FAT entry and are inside the image
+uint32_t usable_block_count(struct fs_image *image)
+{
+    size_t block_count = image->block_count;
+    if (block_count > image->fat_entry_count)
+    {
+        block_count = image->fat_entry_count;
+    }
+    if (block_count > image->size / image->block_size)
+    {
+        block_count = image->size / image->block_size;
+    }
+    return block_count;
+}
+
+// makes an allocator for block_count blocks with none of them free yet
+struct block_allocator *make_allocator(uint32_t block_count)
+{
+    struct block_allocator *allocator = malloc(sizeof(struct block_allocator));
+    if (allocator == NULL)
+    {
+        printf("ERROR: could not allocate memory\n");
+        exit(1);
+    }
+    allocator->block_count = block_count;
+    allocator->free_count = 0;
+    allocator->cursor = 0;
+    allocator->free_map = calloc((block_count + 63) / 64, sizeof(uint64_t));
+    if (allocator->free_map == NULL)
+    {
+        printf("ERROR: could not allocate memory\n");
+        exit(1);
+    }
+    return allocator;
+}
+
+// marks a block as free in an allocator
+void mark_block_free(struct block_allocator *allocator, uint32_t block)
+{
+    allocator->free_map[block / 64] |= 1ULL << (block % 64);
+    allocator->free_count++;
+}
+
+// builds the free block bitmap of an image from its decoded FAT
+struct block_allocator *get_allocator(struct fs_image *image)
+{
+    if (image->allocator != NULL)
+    {
+        return image->allocator;
+    }
+    struct block_allocator *allocator = make_allocator(usable_block_count(image));
+    for (uint32_t i = 0; i < allocator->block_count; i++)
+    {
+        if (image->fat[i] == FREE)
+        {
+            mark_block_free(allocator, i);
+        }
+    }
+    image->allocator = allocator;
+    return allocator;
+}
+
+void free_allocator(struct block_allocator *allocator)
+{
+    if (allocator != NULL)
+    {
+        free(allocator->free_map);
+        free(allocator);
+    }
+}
+
+// returns the first block at or after start whose free bit equals want_free or block_count if there is none
+uint32_t find_block_state(struct block_allocator *allocator, uint32_t start, int want_free)
+{
+    uint32_t word_count = (allocator->block_count + 63) / 64;
+    uint32_t word_index = start / 64;
+    if (word_index >= word_count)
+    {
+        return allocator->block_count;
+    }
+    uint64_t word = want_free ? allocator->free_map[word_index] : ~allocator->free_map[word_index];
+    word &= ~0ULL << (start % 64); // ignores the blocks before start
+    while (word == 0)
+    {
+        word_index++;
+        if (word_index >= word_count)
+        {
+            return allocator->block_count;
+        }
+        word = want_free ? allocator->free_map[word_index] : ~allocator->free_map[word_index];
+    }
+    uint32_t block = word_index * 64 + __builtin_ctzll(word);
+    return block < allocator->block_count ? block : allocator->block_count;
+}
+
+// marks count blocks starting at first as used and adds them to the list of blocks
+void take_blocks(struct block_allocator *allocator, uint32_t first, uint32_t count, uint32_t *blocks, uint32_t *taken)
+{
+    for (uint32_t block = first; block < first + count; block++)
+    {
+        allocator->free_map[block / 64] &= ~(1ULL << (block % 64));
+        blocks[(*taken)++] = block;
+    }
+    allocator->free_count -= count;
+    allocator->cursor = first + count < allocator->block_count ? first + count : 0;
+}
+
+// This function finds one contiguous run of count free blocks with a next fit search going around the image once
+// and marks them as used, putting their numbers in order in blocks. returns 0 on success and -1 if there is no run
+// that big
+int allocate_run(struct block_allocator *allocator, uint32_t count, uint32_t *blocks)
+{
+    if (count > allocator->free_count)
+    {
+        return -1;
+    }
+    uint32_t taken = 0;
+    if (count == 0)
+    {
+        return 0;
+    }
+    uint32_t start = allocator->cursor;
+    for (int pass = 0; pass < 2; pass++)
+    {
+        uint32_t end = pass == 0 ? allocator->block_count : start;
+        uint32_t run_start = find_block_state(allocator, pass == 0 ? start : 0, 1);
+        while (run_start < end)
+        {
+            uint32_t run_end = find_block_state(allocator, run_start, 0);
+            if (run_end - run_start >= count)
+            {
+                take_blocks(allocator, run_start, count, blocks, &taken);
+                return 0;
+            }
+            run_start = find_block_state(allocator, run_end, 1);
+        }
+    }
+    return -1;
+}
+
+// This function finds count free blocks and marks them as used, putting their numbers in order in blocks
+// one contiguous run is used if there is one big enough, otherwise runs are taken in order from the cursor
+// returns 0 on success and -1 if there are not enough free blocks
+int allocate_from(struct block_allocator *allocator, uint32_t count, uint32_t *blocks)
+{
+    if (count > allocator->free_count)
+    {
+        return -1;
+    }
+    if (allocate_run(allocator, count, blocks) == 0)
+    {
+        return 0;
+    }
+
+    // there is no run big enough so the file is split over runs starting at the cursor
+    uint32_t taken = 0;
+    uint32_t start = allocator->cursor;
+    uint32_t run_start = find_block_state(allocator, start, 1);
+    while (taken < count)
+    {
+        if (run_start >= allocator->block_count)
+        {
+            run_start = find_block_state(allocator, 0, 1);
+        }
+        uint32_t run_end = find_block_state(allocator, run_start, 0);
+        uint32_t length = run_end - run_start < count - taken ? run_end - run_start : count - taken;
+        take_blocks(allocator, run_start, length, blocks, &taken);
+        run_start = find_block_state(allocator, run_end, 1);
+    }
+    return 0;
+}
+
+// allocates blocks from the free space of an image, the FAT is not changed
+int allocate_blocks(struct fs_image *image, uint32_t count, uint32_t *blocks)
+{
+    return allocate_from(get_allocator(image), count, blocks);
+}
+
+// gives back blocks to the allocator, either ones from allocate_blocks that were never linked into the FAT or ones
+// whose FAT entries have been set to FREE and committed
+void release_blocks(struct fs_image *image, uint32_t *blocks, uint32_t count)
+{
+    struct block_allocator *allocator = get_allocator(image);
+    for (uint32_t i = 0; i < count; i++)
+    {
+        mark_block_free(allocator, blocks[i]);
+    }
+}
+
+// links a list of blocks together into a chain in the FAT
+void write_chain(struct fs_image *image, uint32_t *blocks, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; i++)
+    {
+        set_fat_entry(image, blocks[i], i + 1 < count ? blocks[i + 1] : LAST);
+    }
+}
+
+// The number of each type of entry in a FAT
+struct fat_counts
+{
+    size_t free;
+    size_t reserved;
+    size_t allocated;
+};
+
+// Each counting function takes the FAT as it is stored in the image (big endian) and compares the words
+// against FREE and RESERVED in that byte order so nothing has to be byte swapped
+typedef void (*fat_count_fn)(const uint32_t *fat, size_t count, struct fat_counts *counts);
+
+// counts the entries one at a time, this is also used for what is left over by the vector versions
+void count_fat_scalar(const uint32_t *fat, size_t count, struct fat_counts *counts)
+{
+    const uint32_t free_word = htonl(FREE);
+    const uint32_t reserved_word = htonl(RESERVED);
+    size_t free_count = 0;
+    size_t reserved_count = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        free_count += fat[i] == free_word;
+        reserved_count += fat[i] == reserved_word;
+    }
+    counts->free += free_count;
+    counts->reserved += reserved_count;
+    counts->allocated += count - free_count - reserved_count;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// the vector counters keep 32 bit counts per lane so they add them up at least every this many entries
+#define FAT_COUNT_CHUNK (1u << 20)
+
+// compares 4 entries at a time, a match is -1 in its lane so subtracting the compare result counts it
+__attribute__((target("sse2"))) void count_fat_sse2(const uint32_t *fat, size_t count, struct fat_counts *counts)
+{
+    const __m128i free_words = _mm_set1_epi32(htonl(FREE));
+    const __m128i reserved_words = _mm_set1_epi32(htonl(RESERVED));
+    size_t vector_end = count - count % 4;
+    size_t i = 0;
+    while (i < vector_end)
+    {
+        size_t chunk_start = i;
+        size_t chunk_end = vector_end - i > FAT_COUNT_CHUNK ? i + FAT_COUNT_CHUNK : vector_end;
+        __m128i free_sum = _mm_setzero_si128();
+        __m128i reserved_sum = _mm_setzero_si128();
+        for (; i < chunk_end; i += 4)
+        {
+            __m128i words = _mm_loadu_si128((const __m128i *)(fat + i));
+            free_sum = _mm_sub_epi32(free_sum, _mm_cmpeq_epi32(words, free_words));
+            reserved_sum = _mm_sub_epi32(reserved_sum, _mm_cmpeq_epi32(words, reserved_words));
+        }
+        uint32_t lanes[4];
+        _mm_storeu_si128((__m128i *)lanes, free_sum);
+        size_t free_count = (size_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+        _mm_storeu_si128((__m128i *)lanes, reserved_sum);
+        size_t reserved_count = (size_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+        counts->free += free_count;
+        counts->reserved += reserved_count;
+        counts->allocated += (chunk_end - chunk_start) - free_count - reserved_count;
+    }
+    count_fat_scalar(fat + vector_end, count - vector_end, counts);
+}
+
+// the same as count_fat_sse2 with 8 entries at a time
+__attribute__((target("avx2"))) void count_fat_avx2(const uint32_t *fat, size_t count, struct fat_counts *counts)
+{
+    const __m256i free_words = _mm256_set1_epi32(htonl(FREE));
+    const __m256i reserved_words = _mm256_set1_epi32(htonl(RESERVED));
+    size_t vector_end = count - count % 8;
+    size_t i = 0;
+    while (i < vector_end)
+    {
+        size_t chunk_start = i;
+        size_t chunk_end = vector_end - i > FAT_COUNT_CHUNK ? i + FAT_COUNT_CHUNK : vector_end;
+        __m256i free_sum = _mm256_setzero_si256();
+        __m256i reserved_sum = _mm256_setzero_si256();
+        for (; i < chunk_end; i += 8)
+        {
+            __m256i words = _mm256_loadu_si256((const __m256i *)(fat + i));
+            free_sum = _mm256_sub_epi32(free_sum, _mm256_cmpeq_epi32(words, free_words));
+            reserved_sum = _mm256_sub_epi32(reserved_sum, _mm256_cmpeq_epi32(words, reserved_words));
+        }
+        uint32_t lanes[8];
+        size_t free_count = 0;
+        size_t reserved_count = 0;
+        _mm256_storeu_si256((__m256i *)lanes, free_sum);
+        for (int lane = 0; lane < 8; lane++)
+        {
+            free_count += lanes[lane];
+        }
+        _mm256_storeu_si256((__m256i *)lanes, reserved_sum);
+        for (int lane = 0; lane < 8; lane++)
+        {
+            reserved_count += lanes[lane];
+        }
+        counts->free += free_count;
+        counts->reserved += reserved_count;
+        counts->allocated += (chunk_end - chunk_start) - free_count - reserved_count;
+    }
+    count_fat_scalar(fat + vector_end, count - vector_end, counts);
+}
+#endif
+
+// returns the fastest counting function the cpu running the program supports, this is checked once
+fat_count_fn select_fat_counter(void)
+{
+    static fat_count_fn counter = NULL;
+    if (counter == NULL)
+    {
+        counter = count_fat_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+        {
+            counter = count_fat_avx2;
+        }
+        else if (__builtin_cpu_supports("sse2"))
+        {
+            counter = count_fat_sse2;
+        }
+#endif
+    }
+    return counter;
+}
+
+// counts the free, reserved and allocated entries of a FAT stored in big endian
+struct fat_counts count_fat(const uint32_t *fat, size_t count)
+{
+    struct fat_counts counts = {0, 0, 0};
+    select_fat_counter()(fat, count, &counts);
+    return counts;
+}
+
+// A run of physically contiguous blocks in a chain
+struct extent
+{
+    uint32_t start_block;
+    uint32_t length;
+};
+
+// This function collapses the chain starting at start_block into runs of contiguous blocks
+// returns a malloced array of the runs and sets extent_count to how many there are, or NULL if the chain is broken
+struct extent *build_extents(struct fs_image *image, uint32_t start_block, size_t *extent_count)
+{
+    size_t count = 0;
+    size_t capacity = 8;
+    struct extent *extents = malloc(capacity * sizeof(struct extent));
+    if (extents == NULL)
+    {
+        printf("ERROR: could not allocate memory\n");
+        exit(1);
+    }
+
+    uint32_t cur_block = start_block;
+    uint32_t length = 0;
+    while (cur_block != LAST)
+    {
+        if (!is_valid_block(image, cur_block) || ++length > image->block_count)
+        {
+            printf("ERROR: the chain starting at block %u is broken, run diskcheck\n", start_block);
+            free(extents);
+            return NULL;
+        }
+        // extends the last run if this block directly follows it, otherwise starts a new one
+        if (count > 0 && extents[count - 1].start_block + extents[count - 1].length == cur_block)
+        {
+            extents[count - 1].length++;
+        }
+        else
+        {
+            if (count == capacity)
+            {
+                capacity *= 2;
+                extents = realloc(extents, capacity * sizeof(struct extent));
+                if (extents == NULL)
+                {
+                    printf("ERROR: could not allocate memory\n");
+                    exit(1);
+                }
+            }
+            extents[count].start_block = cur_block;
+            extents[count].length = 1;
+            count++;
+        }
+        cur_block = get_next_block(image, cur_block);
+    }
+    *extent_count = count;
+    return extents;
+}
+
+// writes all of a buffer to a file descriptor, returns 0 on success and -1 on an error
+int write_all(int fd, const unsigned char *buffer, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t written = write(fd, buffer, length);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        buffer += written;
+        length -= written;
+    }
+    return 0;
+}
+
+// reads length bytes from offset in a file descriptor, returns 0 on success and -1 on an error or end of file
+int read_all_at(int fd, unsigned char *buffer, size_t length, off_t offset)
+{
+    while (length > 0)
+    {
+        ssize_t result = pread(fd, buffer, length, offset);
+        if (result < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (result <= 0)
+        {
+            return -1;
+        }
+        buffer += result;
+        length -= result;
+        offset += result;
+    }
+    return 0;
+}
+
+#define COPY_BUFFER_SIZE (1 << 20)
+
+// writes length bytes of the image starting at offset to a file descriptor, straight from the memory map if there
+// is one or through a buffer read from the block device. returns 0 on success and -1 on an error
+int write_image_range(struct fs_image *image, uint64_t offset, uint64_t length, int out_fd)
+{
+    if (image->memory != NULL)
+    {
+        return write_all(out_fd, image->memory + offset, length);
+    }
+    unsigned char *buffer = malloc(length < COPY_BUFFER_SIZE ? length : COPY_BUFFER_SIZE);
+    if (buffer == NULL)
+    {
+        return -1;
+    }
+    int status = 0;
+    while (length > 0 && status == 0)
+    {
+        size_t part = length < COPY_BUFFER_SIZE ? length : COPY_BUFFER_SIZE;
+        read_image(image, offset, buffer, part);
+        status = write_all(out_fd, buffer, part);
+        offset += part;
+        length -= part;
+    }
+    free(buffer);
+    return status;
+}
+
+// This function copies the first size bytes of a list of extents to a file descriptor
+// each extent is copied with one copy_file_range straight from the image file and if the kernel, the file
+// systems or the block device can not do that it is written with write_image_range instead
+// returns 0 on success and -1 on an error
+int copy_extents(struct fs_image *image, struct extent *extents, size_t extent_count, uint64_t size, int out_fd)
+{
+    if (image->device->copy != NULL)
+    {
+        int status = image->device->copy(image, extents, extent_count, size, out_fd);
+        if (status != 1)
+        {
+            return status;
+        }
+    }
+    int use_copy_range = image->fd >= 0 && image->device->zero_copy;
+    uint64_t remaining = size;
+    for (size_t i = 0; i < extent_count && remaining > 0; i++)
+    {
+        uint64_t length = (uint64_t)extents[i].length * image->block_size;
+        if (length > remaining)
+        {
+            length = remaining;
+        }
+        off_t offset = (off_t)extents[i].start_block * image->block_size;
+        remaining -= length;
+
+        while (use_copy_range && length > 0)
+        {
+            ssize_t copied = copy_file_range(image->fd, &offset, out_fd, NULL, length, 0);
+            if (copied > 0)
+            {
+                length -= copied;
+            }
+            else if (copied < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            else if (copied < 0 && errno != ENOSYS && errno != EXDEV && errno != EINVAL && errno != EOPNOTSUPP && errno != EBADF)
+            {
+                return -1;
+            }
+            else
+            {
+                use_copy_range = 0; // not supported here, fall back to writing from the map
+            }
+        }
+        if (length > 0 && write_image_range(image, offset, length, out_fd) == -1)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// writes a list of buffers to a file descriptor with as few writev calls as possible
+// returns 0 on success and -1 on an error, the list is changed as it is written
+int writev_all(int fd, struct iovec *iov, int iov_count)
+{
+    while (iov_count > 0)
+    {
+        ssize_t written = writev(fd, iov, iov_count < IOV_MAX ? iov_count : IOV_MAX);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        // skips the buffers that were fully written and moves the start of the one that was partly written
+        while (iov_count > 0 && (size_t)written >= iov->iov_len)
+        {
+            written -= iov->iov_len;
+            iov++;
+            iov_count--;
+        }
+        if (iov_count > 0)
+        {
+            iov->iov_base = (unsigned char *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return 0;
+}
+
+// io_uring
+// The uring device is the mmap device except that files are extracted with io_uring. The extents of a file are cut
+// into chunks and a read of each chunk from the image is queued linked to a write of it to the output file, so the
+// write starts as soon as its read is done without a trip back to user space and up to URING_DEPTH chunks are in
+// flight at once. Each thread gets its own ring the first time it copies a file. The rings are set up with the raw
+// system calls since liburing is not always installed.
+#define URING_DEPTH 16
+#define URING_CHUNK_SIZE (128 * 1024)
+
+struct uring
+{
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+    unsigned char *buffers; // one URING_CHUNK_SIZE buffer for each chunk in flight
+};
+
+// one chunk being copied, a read and a linked write
+struct uring_chunk
+{
+    uint64_t image_offset;
+    uint64_t file_offset;
+    uint32_t length;
+    int pending; // completions still to come
+    int failed;  // set if the read or the write did not do the whole chunk
+};
+
+pthread_key_t uring_key;
+pthread_once_t uring_key_once = PTHREAD_ONCE_INIT;
+
+void free_uring(void *arg)
+{
+    struct uring *ring = arg;
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring != ring->sq_ring)
+    {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+    free(ring->buffers);
+    free(ring);
+}
+
+void make_uring_key(void)
+{
+    pthread_key_create(&uring_key, free_uring);
+}
+
+// This function returns the ring of the calling thread, setting it up the first time
+// returns NULL if io_uring is not available
+struct uring *get_uring(void)
+{
+    pthread_once(&uring_key_once, make_uring_key);
+    struct uring *ring = pthread_getspecific(uring_key);
+    if (ring != NULL)
+    {
+        return ring;
+    }
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = syscall(__NR_io_uring_setup, URING_DEPTH * 2, &params);
+    if (fd == -1)
+    {
+        return NULL;
+    }
+    ring = calloc(1, sizeof(struct uring));
+    if (ring == NULL)
+    {
+        printf("ERROR: could not allocate memory\n");
+        exit(1);
+    }
+    ring->fd = fd;
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        // both rings are in one mapping on newer kernels
+        if (ring->cq_ring_size > ring->sq_ring_size)
+        {
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    ring->cq_ring = ring->sq_ring;
+    if (ring->sq_ring != MAP_FAILED && !(params.features & IORING_FEAT_SINGLE_MMAP))
+    {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED)
+    {
+        close(fd);
+        free(ring);
+        return NULL;
+    }
+    unsigned char *sq = ring->sq_ring;
+    unsigned char *cq = ring->cq_ring;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    ring->buffers = alloc_aligned((size_t)URING_DEPTH * URING_CHUNK_SIZE);
+    pthread_setspecific(uring_key, ring);
+    return ring;
+}
+
+// opens the image like the mmap device and checks io_uring can be used, falling back to the mmap device if not
+void uring_device_open(struct fs_image *image)
+{
+    map_device_open(image);
+    if (get_uring() == NULL)
+    {
+        fprintf(stderr, "io_uring is not available, using mmap\n");
+        image->device = &block_devices[0];
+    }
+}
+
+// adds a request to the submission queue, the queue always has room since at most URING_DEPTH chunks are in flight
+void uring_queue(struct uring *ring, int opcode, int fd, void *buffer, uint32_t length, uint64_t offset, uint8_t flags, uint64_t user_data)
+{
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buffer;
+    sqe->len = length;
+    sqe->off = offset;
+    sqe->flags = flags;
+    sqe->user_data = user_data;
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+// This function submits the requests that were queued but not taken by the kernel yet and waits for at least one
+// request to finish. The kernel can take fewer than it was given, those stay in the submission queue and are counted
+// in unsubmitted so they are given again next time, and being interrupted is retried. returns 0 on success and -1 if
+// the ring itself is failing
+int uring_enter(struct uring *ring, unsigned *unsubmitted)
+{
+    while (1)
+    {
+        long submitted = syscall(__NR_io_uring_enter, ring->fd, *unsubmitted, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (submitted >= 0)
+        {
+            *unsubmitted -= submitted;
+            return 0;
+        }
+        if (errno == EAGAIN || errno == EBUSY)
+        {
+            return 0; // the kernel is out of room until completions are reaped, the requests are given again later
+        }
+        if (errno != EINTR)
+        {
+            return -1;
+        }
+    }
+}
+
+// writes all of a buffer at an offset of a file, returns 0 on success and -1 on an error
+int pwrite_all(int fd, const unsigned char *buffer, size_t length, off_t offset)
+{
+    while (length > 0)
+    {
+        ssize_t written = pwrite(fd, buffer, length, offset);
+        if (written < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (written <= 0)
+        {
+            return -1;
+        }
+        buffer += written;
+        length -= written;
+        offset += written;
+    }
+    return 0;
+}
+
+// This function copies the first size bytes of a list of extents to a regular file with io_uring, keeping up to
+// URING_DEPTH linked reads and writes in flight. A chunk whose read or write comes up short is copied again
+// without the ring. returns 0 on success, -1 on an error and 1 if the output is not a regular file
+int uring_copy_extents(struct fs_image *image, struct extent *extents, size_t extent_count, uint64_t size, int out_fd)
+{
+    struct stat out_stat;
+    struct uring *ring = get_uring();
+    if (ring == NULL || fstat(out_fd, &out_stat) == -1 || !S_ISREG(out_stat.st_mode))
+    {
+        return 1; // a pipe has to be written in order, which stream_extents already does without copying
+    }
+
+    struct uring_chunk chunks[URING_DEPTH];
+    int free_slots[URING_DEPTH];
+    int free_count = URING_DEPTH;
+    for (int i = 0; i < URING_DEPTH; i++)
+    {
+        free_slots[i] = i;
+    }
+    size_t extent = 0;
+    uint64_t extent_done = 0; // bytes of the current extent already queued
+    uint64_t file_offset = 0;
+    int in_flight = 0;
+    unsigned unsubmitted = 0; // requests in the submission queue the kernel has not taken yet
+    int status = 0;
+
+    while (status == 0 && (in_flight > 0 || (extent < extent_count && file_offset < size)))
+    {
+        // queues a linked read and write for as many chunks as there are free buffers
+        while (free_count > 0 && extent < extent_count && file_offset < size)
+        {
+            uint64_t extent_length = (uint64_t)extents[extent].length * image->block_size;
+            uint64_t length = extent_length - extent_done;
+            length = length > URING_CHUNK_SIZE ? URING_CHUNK_SIZE : length;
+            length = length > size - file_offset ? size - file_offset : length;
+            int slot = free_slots[--free_count];
+            struct uring_chunk *chunk = &chunks[slot];
+            chunk->image_offset = block_offset(image, extents[extent].start_block) + extent_done;
+            chunk->file_offset = file_offset;
+            chunk->length = length;
+            chunk->pending = 2;
+            chunk->failed = 0;
+            unsigned char *buffer = ring->buffers + (size_t)slot * URING_CHUNK_SIZE;
+            uring_queue(ring, IORING_OP_READ, image->fd, buffer, length, chunk->image_offset, IOSQE_IO_LINK, (uint64_t)slot * 2);
+            uring_queue(ring, IORING_OP_WRITE, out_fd, buffer, length, chunk->file_offset, 0, (uint64_t)slot * 2 + 1);
+            unsubmitted += 2;
+            in_flight++;
+            file_offset += length;
+            extent_done += length;
+            if (extent_done == extent_length)
+            {
+                extent++;
+                extent_done = 0;
+            }
+        }
+
+        // submits what is queued and waits for at least one request to finish
+        if (uring_enter(ring, &unsubmitted) == -1)
+        {
+            return -1; // nothing can be in flight if the ring itself is failing
+        }
+
+        unsigned head = *ring->cq_head;
+        unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++)
+        {
+            struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+            int slot = cqe->user_data / 2;
+            struct uring_chunk *chunk = &chunks[slot];
+            // a short read cancels the linked write so both have to come back whole
+            if (cqe->res != (int)chunk->length)
+            {
+                chunk->failed = 1;
+            }
+            if (--chunk->pending > 0)
+            {
+                continue;
+            }
+            if (chunk->failed)
+            {
+                unsigned char *buffer = ring->buffers + (size_t)slot * URING_CHUNK_SIZE;
+                if (read_all_at(image->fd, buffer, chunk->length, chunk->image_offset) == -1 ||
+                    pwrite_all(out_fd, buffer, chunk->length, chunk->file_offset) == -1)
+                {
+                    status = -1;
+                }
+            }
+            free_slots[free_count++] = slot;
+            in_flight--;
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    // an error stops queueing but whatever is still in flight is using the buffers so it has to finish first
+    while (in_flight > 0)
+    {
+        if (uring_enter(ring, &unsubmitted) == -1)
+        {
+            return -1;
+        }
+        unsigned head = *ring->cq_head;
+        unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++)
+        {
+            struct uring_chunk *chunk = &chunks[ring->cqes[head & *ring->cq_mask].user_data / 2];
+            in_flight -= --chunk->pending == 0;
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+    return status;
+}
+
+// This function streams the first size bytes of a list of extents to a file descriptor without copying them
+// into a buffer first. A pipe gets each extent spliced straight from the image file's pages, a regular file
+// gets copy_file_range through copy_extents and anything else gets the extents from the memory map in
+// batches of writev. returns 0 on success and -1 on an error
+int stream_extents(struct fs_image *image, struct extent *extents, size_t extent_count, uint64_t size, int out_fd)
+{
+    struct stat out_stat;
+    if (fstat(out_fd, &out_stat) == -1)
+    {
+        return -1;
+    }
+    if (S_ISREG(out_stat.st_mode))
+    {
+        return copy_extents(image, extents, extent_count, size, out_fd);
+    }
+
+    size_t first = 0;        // the first extent that has not been fully written yet
+    uint64_t done_bytes = 0; // bytes of that extent that were already spliced
+    uint64_t remaining = size;
+    if (S_ISFIFO(out_stat.st_mode) && image->fd >= 0 && image->device->zero_copy)
+    {
+        for (; first < extent_count && remaining > 0; first++)
+        {
+            uint64_t length = (uint64_t)extents[first].length * image->block_size;
+            length = length > remaining ? remaining : length;
+            done_bytes = 0;
+            while (done_bytes < length)
+            {
+                loff_t offset = (loff_t)extents[first].start_block * image->block_size + done_bytes;
+                ssize_t moved = splice(image->fd, &offset, out_fd, NULL, length - done_bytes, SPLICE_F_MORE);
+                if (moved > 0)
+                {
+                    done_bytes += moved;
+                }
+                else if (moved < 0 && errno == EINTR)
+                {
+                    continue;
+                }
+                else if (moved < 0 && errno != EINVAL && errno != ENOSYS)
+                {
+                    return -1;
+                }
+                else
+                {
+                    break; // splice is not supported here so the rest is written from the map
+                }
+            }
+            if (done_bytes < length)
+            {
+                break;
+            }
+            remaining -= length;
+            done_bytes = 0;
+        }
+    }
+
+    // without a memory map whatever is left is read through the block device
+    if (image->memory == NULL)
+    {
+        for (size_t i = first; i < extent_count && remaining > 0; i++)
+        {
+            uint64_t length = (uint64_t)extents[i].length * image->block_size;
+            length = length > remaining ? remaining : length;
+            remaining -= length;
+            size_t skip = i == first ? done_bytes : 0;
+            if (write_image_range(image, block_offset(image, extents[i].start_block) + skip, length - skip, out_fd) == -1)
+            {
+                return -1;
+            }
+        }
+        return 0;
+    }
+
+    // writes whatever is left from the memory map in batches of up to IOV_MAX extents
+    struct iovec iov[IOV_MAX];
+    int iov_count = 0;
+    for (size_t i = first; i < extent_count && remaining > 0; i++)
+    {
+        uint64_t length = (uint64_t)extents[i].length * image->block_size;
+        length = length > remaining ? remaining : length;
+        remaining -= length;
+        size_t skip = i == first ? done_bytes : 0;
+        iov[iov_count].iov_base = image->memory + block_offset(image, extents[i].start_block) + skip;
+        iov[iov_count].iov_len = length - skip;
+        iov_count++;
+        if (iov_count == IOV_MAX)
+        {
+            if (writev_all(out_fd, iov, iov_count) == -1)
+            {
+                return -1;
+            }
+            iov_count = 0;
+        }
+    }
+    return writev_all(out_fd, iov, iov_count);
+}
+
+// Directory index
+// When an image serves many lookups (like in batch mode) each directory is hashed the first time it is searched
+// so later lookups in it do not have to scan every entry. Slots are keyed by the start block of the directory and
+// a hash of the file name and hold the offset of the entry in the image, an offset of 0 marks an empty slot since
+// the superblock is always there.
+struct dir_index_slot
+{
+    uint32_t dir_block;
+    uint32_t hash;
+    size_t offset;
+};
+
+struct dir_index
+{
+    struct dir_index_slot *slots;
+    size_t capacity; // always a power of 2
+    size_t used;
+    uint32_t *dirs; // set of the directories that have been indexed, LAST marks an empty slot
+    size_t dir_capacity;
+    size_t dir_count;
+    pthread_mutex_t mutex; // lookups can add directories so threads sharing an image take turns
+};
+
+// FNV-1a hash of a file name, stops at the end of the name field even if there is no null
+uint32_t hash_name(const char *name)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < sizeof(((struct dir_entry_t *)0)->filename) && name[i] != '\0'; i++)
+    {
+        hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+    }
+    return hash;
+}
+
+// mixes a directory block and name hash into a slot number
+size_t dir_index_slot_of(uint32_t dir_block, uint32_t hash, size_t capacity)
+{
+    uint64_t key = ((uint64_t)dir_block << 32 | hash) * 0x9E3779B97F4A7C15ULL;
+    return (key >> 32) & (capacity - 1);
+}
+
+// turns on directory indexing for an image
+void enable_dir_index(struct fs_image *image)
+{
+    if (image->dir_index != NULL)
+    {
+        return;
+    }
+    struct dir_index *index = malloc(sizeof(struct dir_index));
+    if (index == NULL)
+    {
+        printf("ERROR: could not allocate memory\n");
+        exit(1);
+    }
+    index->capacity = 1024;
+    index->used = 0;
+    index->slots = calloc(index->capacity, sizeof(struct dir_index_slot));
+    index->dir_capacity = 64;
+    index->dir_count = 0;
+    index->dirs = malloc(index->dir_capacity * sizeof(uint32_t));
+    if (index->slots == NULL || index->dirs == NULL)
+    {
+        printf("ERROR: could not allocate memory\n");
+        exit(1);
+    }
+    memset(index->dirs, 0xFF, index->dir_capacity * sizeof(uint32_t));
+    pthread_mutex_init(&index->mutex, NULL);
+    image->dir_index = index;
+}
+
+void free_dir_index(struct dir_index *index)
+{
+    if (index != NULL)
+    {
+        pthread_mutex_destroy(&index->mutex);
+        free(index->slots);
+        free(index->dirs);
+        free(index);
+    }
+}
+
+// forgets everything that was indexed, for when directories are moved around in the image
+void clear_dir_index(struct fs_image *image)
+{
+    struct dir_index *index = image->dir_index;
+    if (index != NULL)
+    {
+        pthread_mutex_lock(&index->mutex);
+        memset(index->slots, 0, index->capacity * sizeof(struct dir_index_slot));
+        memset(index->dirs, 0xFF, index->dir_capacity * sizeof(uint32_t));
+        index->used = 0;
+        index->dir_count = 0;
+        pthread_mutex_unlock(&index->mutex);
+    }
+}
+
+// returns 1 if a directory has been indexed, adding it to the set if add is set
+int dir_index_has_dir(struct dir_index *index, uint32_t dir_block, int add)
+{
+    if (add && (index->dir_count + 1) * 2 > index->dir_capacity)
+    {
+        // grows the set and puts every directory back in
+        uint32_t *old_dirs = index->dirs;
+        size_t old_capacity = index->dir_capacity;
+        index->dir_capacity *= 2;
+        index->dirs = malloc(index->dir_capacity * sizeof(uint32_t));
+        if (index->dirs == NULL)
+        {
+            printf("ERROR: could not allocate memory\n");
+            exit(1);
+        }
+        memset(index->dirs, 0xFF, index->dir_capacity * sizeof(uint32_t));
+        index->dir_count = 0;
+        for (size_t i = 0; i < old_capacity; i++)
+        {
+            if (old_dirs[i] != LAST)
+            {
+                dir_index_has_dir(index, old_dirs[i], 1);
+            }
+        }
+        free(old_dirs);
+    }
+    size_t slot = dir_index_slot_of(dir_block, 0, index->dir_capacity);
+    while (index->dirs[slot] != LAST)
+    {
+        if (index->dirs[slot] == dir_block)
+        {
+            return 1;
+        }
+        slot = (slot + 1) & (index->dir_capacity - 1);
+    }
+    if (add)
+    {
+        index->dirs[slot] = dir_block;
+        index->dir_count++;
+    }
+    return 0;
+}
+
+// adds one directory entry found at offset in the image to the index
+void dir_index_insert(struct fs_image *image, uint32_t dir_block, struct dir_entry_t *entry, uint64_t offset)
+{
+    struct dir_index *index = image->dir_index;
+    if ((index->used + 1) * 10 > index->capacity * 7)
+    {
+        // grows the table and puts every slot back in
+        struct dir_index_slot *old_slots = index->slots;
+        size_t old_capacity = index->capacity;
+        index->capacity *= 2;
+        index->slots = calloc(index->capacity, sizeof(struct dir_index_slot));
+        if (index->slots == NULL)
+        {
+            printf("ERROR: could not allocate memory\n");
+            exit(1);
+        }
+        for (size_t i = 0; i < old_capacity; i++)
+        {
+            if (old_slots[i].offset != 0)
+            {
+                size_t slot = dir_index_slot_of(old_slots[i].dir_block, old_slots[i].hash, index->capacity);
+                while (index->slots[slot].offset != 0)
+                {
+                    slot = (slot + 1) & (index->capacity - 1);
+                }
+                index->slots[slot] = old_slots[i];
+            }
+        }
+        free(old_slots);
+    }
+    uint32_t hash = hash_name((char *)entry->filename);
+    size_t slot = dir_index_slot_of(dir_block, hash, index->capacity);
+    while (index->slots[slot].offset != 0)
+    {
+        slot = (slot + 1) & (index->capacity - 1);
+    }
+    index->slots[slot].dir_block = dir_block;
+    index->slots[slot].hash = hash;
+    index->slots[slot].offset = offset;
+    index->used++;
+}
+
+// adds every used entry of a directory to the index
+void dir_index_add_dir(struct fs_image *image, uint32_t dir_block)
+{
+    dir_index_has_dir(image->dir_index, dir_block, 1);
+    struct dir_reader reader;
+    start_dir_reader(&reader, image, dir_block);
+    struct dir_entry_t *entry;
+    uint64_t offset;
+    while ((entry = next_dir_entry(&reader, &offset)) != NULL)
+    {
+        if (entry->status & 1)
+        {
+            dir_index_insert(image, dir_block, entry, offset);
+        }
+    }
+    end_dir_reader(&reader);
+}
+
+// records a new entry written to a directory so the index stays correct, does nothing if the directory
+// has not been indexed yet since it will be read in full the first time it is searched
+void dir_index_note_entry(struct fs_image *image, uint32_t dir_block, struct dir_entry_t *entry, uint64_t offset)
+{
+    if (image->dir_index == NULL)
+    {
+        return;
+    }
+    pthread_mutex_lock(&image->dir_index->mutex);
+    if (dir_index_has_dir(image->dir_index, dir_block, 0))
+    {
+        dir_index_insert(image, dir_block, entry, offset);
+    }
+    pthread_mutex_unlock(&image->dir_index->mutex);
+}
+
+// looks up an entry through the index, indexing the directory first if this is the first time it is searched
+// copies the entry into found and returns its offset in the image or 0 if there is none
+uint64_t dir_index_lookup(struct fs_image *image, uint32_t dir_block, char *name, int file_type, struct dir_entry_t *found)
+{
+    struct dir_index *index = image->dir_index;
+    pthread_mutex_lock(&index->mutex);
+    if (!dir_index_has_dir(index, dir_block, 0))
+    {
+        dir_index_add_dir(image, dir_block);
+    }
+    uint32_t hash = hash_name(name);
+    size_t slot = dir_index_slot_of(dir_block, hash, index->capacity);
+    while (index->slots[slot].offset != 0)
+    {
+        struct dir_index_slot *cur = &index->slots[slot];
+        if (cur->dir_block == dir_block && cur->hash == hash)
+        {
+            read_image(image, cur->offset, found, sizeof(struct dir_entry_t));
+            if (found->status == file_type && strncmp((char *)(found->filename), name, sizeof(found->filename)) == 0)
+            {
+                uint64_t offset = cur->offset;
+                pthread_mutex_unlock(&index->mutex);
+                return offset;
+            }
+        }
+        slot = (slot + 1) & (index->capacity - 1);
+    }
+    pthread_mutex_unlock(&index->mutex);
+    return 0;
+}
+
+// looks up the entry with the given name and type in a directory
+// copies the entry into found and returns its offset in the image or 0 if there is none
+uint64_t lookup_entry(struct fs_image *image, uint32_t start_block, char *name, int file_type, struct dir_entry_t *found)
+{
+    if (image->dir_index != NULL)
+    {
+        return dir_index_lookup(image, start_block, name, file_type, found);
+    }
+
+    // loops through each entry of the directory until its chain in the FAT ends
+    struct dir_reader reader;
+    start_dir_reader(&reader, image, start_block);
+    struct dir_entry_t *entry;
+    uint64_t offset = 0;
+    while ((entry = next_dir_entry(&reader, &offset)) != NULL)
+    {
+        if (entry->status == file_type && strncmp((char *)(entry->filename), name, sizeof(entry->filename)) == 0)
+        {
+            *found = *entry;
+            break;
+        }
+    }
+    end_dir_reader(&reader);
+    return entry != NULL ? offset : 0;
+}
+
+// returns the offset into the image of an entry given a specific file or directory name and copies the entry
+// into found, prints an error and returns -1 if it is not in the directory
+size_t find_file_in_dir(struct fs_image *image, uint32_t start_block, char *name, int file_type, struct dir_entry_t *found)
+{
+    if (file_type != 3 && file_type != 5)
+    {
+        printf("ERROR: incorrect file type given\n");
+        return -1;
+    }
+    uint64_t offset = lookup_entry(image, start_block, name, file_type, found);
+    if (offset == 0)
+    {
+        printf("ERROR: File '%s' not found.\n", name);
+        return -1;
+    }
+    return offset;
+}
+
+// This function returns the block number of the sub given sub directory
+// prints an error and returns LAST if one of the directories in the path does not exist
+uint32_t goto_sub_dir(struct fs_image *image, char *subdir_path)
+{
+    uint32_t cur_block = image->root_dir_start_block;
+
+    // Parses the strings of the directory path given
+    char path[strlen(subdir_path) + 1];
+    strcpy(path, subdir_path);
+
+    char *saveptr;
+    char *token = strtok_r(path, "/", &saveptr);
+    // loops through each directory in the given path
+    while (token != NULL)
+    {
+        struct dir_entry_t entry;
+        if (lookup_entry(image, cur_block, token, 5, &entry) == 0)
+        {
+            printf("ERROR: Subdirectory '%s' not found.\n", token);
+            return LAST;
+        }
+        // Move to the next subdirectory
+        cur_block = htonl(entry.starting_block);
+        token = strtok_r(NULL, "/", &saveptr);
+    }
+    // return the block of the start of the next directory
+    return cur_block;
+}
+
+// splits a path into the directory part and the file name, path is modified
+// the directory is set to NULL if the path has no '/' in it
+char *split_path(char *path, char **directory)
+{
+    char *file_name = strrchr(path, '/');
+    *directory = NULL;
+    if (file_name != NULL)
+    {
+        *file_name = '\0'; // Null-terminate to separate directory and file name
+        file_name++;       // Move to the character after '/' so it is just the file name
+        *directory = path; // Set directory to the beginning of the string
+    }
+    else
+    {
+        file_name = path; // if path doesnt have a '/' file name is just the name
+    }
+    return file_name;
+}
+
+// copies the entry of a file given its full path in the image into entry
+// returns the offset of the entry in the image or 0 if it could not be found
+uint64_t find_file_by_path(struct fs_image *image, char *file_path, struct dir_entry_t *entry)
+{
+    char path[strlen(file_path) + 1];
+    strcpy(path, file_path);
+    char *directory;
+    char *file_name = split_path(path, &directory);
+
+    uint32_t start_block = image->root_dir_start_block;
+    if (directory != NULL)
+    {
+        start_block = goto_sub_dir(image, directory);
+        if (start_block == LAST)
+        {
+            return 0;
+        }
+    }
+    size_t offset = find_file_in_dir(image, start_block, file_name, 3, entry);
+    if (offset == (size_t)-1)
+    {
+        return 0;
+    }
+    return offset;
+}
+
+// part 1
+int diskinfo(struct fs_image *image, int argc, char *argv[])
+{
+    // check command line arguments
+    if (argc != 0)
+    {
+        printf("ERROR: Incorrect command line arguments\n");
+        return 1;
+    }
+
+    // print superblock information
+    printf("Super block information\n");
+    printf("Block size: %zu\n", image->block_size);
+    printf("Block count: %u\n", image->block_count);
+    printf("FAT starts: %u\n", image->fat_start_block);
+    printf("FAT blocks: %u\n", image->fat_block_count);
+    printf("Root directory starts: %u\n", image->root_dir_start_block);
+    printf("Root directory blocks: %u\n", image->root_dir_block_count);
+
+    // calculate FAT information straight from the map, or from a copy of the FAT read through the block device
+    // if it is not mapped or part of it is in the journal
+    struct fat_counts counts;
+    if (image->memory != NULL && !journal_has_blocks(image))
+    {
+        counts = count_fat((uint32_t *)(image->memory + fat_entry_offset(image, 0)), image->fat_entry_count);
+    }
+    else
+    {
+        uint32_t *fat = malloc(image->fat_entry_count * FAT_ENTRY_SIZE);
+        if (fat == NULL)
+        {
+            printf("ERROR: could not allocate memory\n");
+            exit(1);
+        }
+        read_image(image, fat_entry_offset(image, 0), fat, image->fat_entry_count * FAT_ENTRY_SIZE);
+        counts = count_fat(fat, image->fat_entry_count);
+        free(fat);
+    }
+
+    // Print FAT informations
+    printf("FAT information\n");
+    printf("Free blocks: %zu\n", counts.free);
+    printf("Reserved blocks: %zu\n", counts.reserved);
+    printf("Allocated blocks: %zu\n", counts.allocated);
+    return 0;
+}
+
+// Formatted listings
+// The json and csv listings are built in one large buffer that is written out with a single write once it is
+// full or the listing is done, instead of going through printf for every entry
+enum list_format
+{
+    LIST_TEXT,
+    LIST_JSON,
+    LIST_CSV
+};
+
+#define OUTPUT_BUFFER_FLUSH_SIZE (1 << 20)
+
+struct output_buffer
+{
+    char *data;
+    size_t length;
+    size_t capacity;
+    int fd;
+    int failed; // set if a write to fd failed
+};
+
+// writes out everything in the buffer, a buffer without a file descriptor keeps everything in memory instead
+void output_flush(struct output_buffer *out)
+{
+    if (out->fd < 0)
+    {
+        return;
+    }
+    if (out->length > 0 && write_all(out->fd, (unsigned char *)out->data, out->length) == -1)
+    {
+        out->failed = 1;
+    }
+    out->length = 0;
+}
+
+// makes sure there is room for length more bytes in the buffer
+void output_reserve(struct output_buffer *out, size_t length)
+{
+    if (out->length + length <= out->capacity)
+    {
+        return;
+    }
+    while (out->length + length > out->capacity)
+    {
+        out->capacity = out->capacity == 0 ? OUTPUT_BUFFER_FLUSH_SIZE + 4096 : out->capacity * 2;
+    }
+    out->data = realloc(out->data, out->capacity);
+    if (out->data == NULL)
+    {
+        printf("ERROR: could not allocate memory\n");
+        exit(1);
+    }
+}
+
+void output_bytes(struct output_buffer *out, const char *bytes, size_t length)
+{
+    output_reserve(out, length);
+    memcpy(out->data + out->length, bytes, length);
+    out->length += length;
+}
+
+void output_string(struct output_buffer *out, const char *string)
+{
+    output_bytes(out, string, strlen(string));
+}
+
+// writes a number in decimal, padded with zeros to at least width digits
+void output_uint(struct output_buffer *out, uint32_t value, int width)
+{
+    char digits[10];
+    int count = 0;
+    do
+    {
+        digits[count++] = '0' + value % 10;
+        value /= 10;
+    } while (value > 0);
+    output_reserve(out, count > width ? count : width);
+    for (int i = count; i < width; i++)
+    {
+        out->data[out->length++] = '0';
+    }
+    while (count > 0)
+    {
+        out->data[out->length++] = digits[--count];
+    }
+}
+
+// writes an entry time as YYYY-MM-DD HH:MM:SS
+void output_time(struct output_buffer *out, struct dir_entry_timedate_t *time)
+{
+    output_uint(out, htons(time->year), 4);
+    output_bytes(out, "-", 1);
+    output_uint(out, time->month, 2);
+    output_bytes(out, "-", 1);
+    output_uint(out, time->day, 2);
+    output_bytes(out, " ", 1);
+    output_uint(out, time->hour, 2);
+    output_bytes(out, ":", 1);
+    output_uint(out, time->minute, 2);
+    output_bytes(out, ":", 1);
+    output_uint(out, time->second, 2);
+}
+
+// writes a file name surrounded by quotes, escaping it for json or csv
+void output_quoted_name(struct output_buffer *out, struct dir_entry_t *entry, enum list_format format)
+{
+    output_reserve(out, sizeof(entry->filename) * 6 + 3); // room for every byte escaped, the quotes and a null
+    out->data[out->length++] = '"';
+    for (size_t i = 0; i < sizeof(entry->filename) && entry->filename[i] != '\0'; i++)
+    {
+        unsigned char c = entry->filename[i];
+        if (format == LIST_CSV)
+        {
+            if (c == '"')
+            {
+                out->data[out->length++] = '"'; // csv escapes a quote by doubling it
+            }
+            out->data[out->length++] = c;
+        }
+        else if (c == '"' || c == '\\')
+        {
+            out->data[out->length++] = '\\';
+            out->data[out->length++] = c;
+        }
+        else if (c < 0x20)
+        {
+            out->length += sprintf(out->data + out->length, "\\u%04x", c);
+        }
+        else
+        {
+            out->data[out->length++] = c;
+        }
+    }
+    out->data[out->length++] = '"';
+}
+
+// adds one file or directory entry to the listing as a json object on its own line, as a csv row or as the text
+// line disklist prints, which is also what fatfsd sends back for LIST
+void output_dir_entry(struct output_buffer *out, struct dir_entry_t *entry, enum list_format format)
+{
+    if (entry->status != 3 && entry->status != 5)
+    {
+        return;
+    }
+    char *type = entry->status == 3 ? "F" : "D";
+    if (format == LIST_TEXT)
+    {
+        struct dir_entry_timedate_t time = entry->create_time;
+        output_reserve(out, 128);
+        out->length += sprintf(out->data + out->length, "%s %10u %30.31s %u/%.2u/%.2u %u:%.2u:%.2u\n", type, htonl(entry->size),
+                               entry->filename, htons(time.year), time.month, time.day, time.hour, time.minute, time.second);
+    }
+    else if (format == LIST_JSON)
+    {
+        output_string(out, "{\"type\":\"");
+        output_string(out, type);
+        output_string(out, "\",\"name\":");
+        output_quoted_name(out, entry, format);
+        output_string(out, ",\"size\":");
+        output_uint(out, htonl(entry->size), 1);
+        output_string(out, ",\"starting_block\":");
+        output_uint(out, htonl(entry->starting_block), 1);
+        output_string(out, ",\"block_count\":");
+        output_uint(out, htonl(entry->block_count), 1);
+        output_string(out, ",\"create_time\":\"");
+        output_time(out, &entry->create_time);
+        output_string(out, "\",\"modify_time\":\"");
+        output_time(out, &entry->modify_time);
+        output_string(out, "\"}\n");
+    }
+    else
+    {
+        output_string(out, type);
+        output_bytes(out, ",", 1);
+        output_quoted_name(out, entry, format);
+        output_bytes(out, ",", 1);
+        output_uint(out, htonl(entry->size), 1);
+        output_bytes(out, ",", 1);
+        output_uint(out, htonl(entry->starting_block), 1);
+        output_bytes(out, ",", 1);
+        output_uint(out, htonl(entry->block_count), 1);
+        output_bytes(out, ",", 1);
+        output_time(out, &entry->create_time);
+        output_bytes(out, ",", 1);
+        output_time(out, &entry->modify_time);
+        output_bytes(out, "\n", 1);
+    }
+    if (out->length >= OUTPUT_BUFFER_FLUSH_SIZE)
+    {
+        output_flush(out);
+    }
+}
+
+// adds the listing of a directory in the given format to an output buffer
+void list_dir_to(struct fs_image *image, uint32_t dir_block, enum list_format format, struct output_buffer *out)
+{
+    struct dir_reader reader;
+    struct dir_entry_t *entry;
+    start_dir_reader(&reader, image, dir_block);
+    if (format == LIST_CSV)
+    {
+        output_string(out, "type,name,size,starting_block,block_count,create_time,modify_time\n");
+    }
+    while ((entry = next_dir_entry(&reader, NULL)) != NULL)
+    {
+        output_dir_entry(out, entry, format);
+    }
+    end_dir_reader(&reader);
+}
+
+// This function writes the listing of a directory to a file descriptor in the given format.
+// returns 0 on success and -1 if the output could not be written
+int list_dir(struct fs_image *image, uint32_t dir_block, enum list_format format, int out_fd)
+{
+    if (out_fd == STDOUT_FILENO)
+    {
+        fflush(stdout); // so the listing comes out in order with everything printed before it
+    }
+    struct output_buffer out = {NULL, 0, 0, out_fd, 0};
+    list_dir_to(image, dir_block, format, &out);
+    output_flush(&out);
+    free(out.data);
+    return out.failed ? -1 : 0;
+}
+
+// part 2
+int disklist(struct fs_image *image, int argc, char *argv[])
+{
+    // -f picks the output format
+    enum list_format format = LIST_TEXT;
+    if (argc >= 2 && strcmp(argv[0], "-f") == 0)
+    {
+        if (strcmp(argv[1], "json") == 0)
+        {
+            format = LIST_JSON;
+        }
+        else if (strcmp(argv[1], "csv") == 0)
+        {
+            format = LIST_CSV;
+        }
+        else if (strcmp(argv[1], "text") != 0)
+        {
+            printf("ERROR: unknown format '%s'\n", argv[1]);
+            return 1;
+        }
+        argc -= 2;
+        argv += 2;
+    }
+
+    // check command line arguments
+    if (argc > 1)
+    {
+        printf("ERROR: Incorrect command line arguments\n");
+        return 1;
+    }
+
+    uint32_t cur_block = image->root_dir_start_block;
+
+    // sets the directory block
+    if (argc == 1)
+    {
+        cur_block = goto_sub_dir(image, argv[0]);
+        if (cur_block == LAST)
+        {
+            return 1;
+        }
+    }
+
+    // the formatted listings skip stdio so whatever was printed before has to come out first
+    fflush(stdout);
+    if (list_dir(image, cur_block, format, STDOUT_FILENO) == -1)
+    {
+        fprintf(stderr, "ERROR: could not write the listing\n");
+        return 1;
+    }
+    return 0;
+}
+
+// This function copies a file in the image starting at start_block to a new local file
+// an output path of "-" streams the file to stdout instead
+// returns 0 on success and -1 after printing an error
+int extract_file(struct fs_image *image, uint32_t start_block, uint32_t size, char *output_path)
+{
+    if (strcmp(output_path, "-") == 0)
+    {
+        fflush(stdout); // anything already printed has to come out before the file
+        size_t extent_count;
+        struct extent *extents = build_extents(image, start_block, &extent_count);
+        if (extents == NULL)
+        {
+            return -1;
+        }
+        int status = stream_extents(image, extents, extent_count, size, STDOUT_FILENO);
+        free(extents);
+        if (status == -1)
+        {
+            fprintf(stderr, "ERROR: could not write to stdout\n");
+        }
+        return status;
+    }
+
+    // opens a file to write to
+    int write_fd = open(output_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (write_fd == -1)
+    {
+        printf("ERROR: could not open file '%s'\n", output_path);
+        return -1;
+    }
+
+    // the blocks of the file are grouped into contiguous runs so each run is copied with one call
+    size_t extent_count;
+    struct extent *extents = build_extents(image, start_block, &extent_count);
+    if (extents == NULL)
+    {
+        close(write_fd);
+        return -1;
+    }
+    int status = copy_extents(image, extents, extent_count, size, write_fd);
+    free(extents);
+    if (status == -1)
+    {
+        printf("ERROR: could not write file '%s'\n", output_path);
+    }
+    // closes the file that was written to
+    close(write_fd);
+    return status;
+}
+
+// Thread pool
+// A fixed number of worker threads take jobs off a shared queue, the queue is guarded by one mutex with one
+// condition variable to wake workers when a job is added and one to wake the thread waiting for all jobs to finish
+struct pool_job
+{
+    void (*run)(void *arg);
+    void *arg;
+    struct pool_job *next;
+};
+
+struct thread_pool
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t job_ready, all_done;
+    struct pool_job *head, *tail;
+    int unfinished; // jobs that are queued or running
+    int stopping;
+    int thread_count;
+    pthread_t *threads;
+};
+
+// this is the function each worker thread runs
+void *pool_worker(void *void_pool)
+{
+    struct thread_pool *pool = void_pool;
+    pthread_mutex_lock(&pool->mutex);
+    while (1)
+    {
+        while (pool->head == NULL && !pool->stopping)
+        {
+            pthread_cond_wait(&pool->job_ready, &pool->mutex);
+        }
+        if (pool->head == NULL) // stopping and nothing left to do
+        {
+            break;
+        }
+        struct pool_job *job = pool->head;
+        pool->head = job->next;
+        if (pool->head == NULL)
+        {
+            pool->tail = NULL;
+        }
+        pthread_mutex_unlock(&pool->mutex);
+
+        job->run(job->arg);
+        free(job);
+
+        pthread_mutex_lock(&pool->mutex);
+        pool->unfinished--;
+        if (pool->unfinished == 0)
+        {
+            pthread_cond_broadcast(&pool->all_done);
+        }
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    return NULL;
+}
+
+// starts a pool with the given number of worker threads
+struct thread_pool *pool_create(int thread_count)
+{
+    struct thread_pool *pool = calloc(1, sizeof(struct thread_pool));
+    pool->threads = malloc(thread_count * sizeof(pthread_t));
+    if (pool == NULL || pool->threads == NULL)
+    {
+        printf("ERROR: could not allocate memory\n");
+        exit(1);
+    }
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->job_ready, NULL);
+    pthread_cond_init(&pool->all_done, NULL);
+    pool->thread_count = thread_count;
+    for (int i = 0; i < thread_count; i++)
+    {
+        int error_check = pthread_create(&pool->threads[i], NULL, pool_worker, pool);
+        if (error_check)
+        {
+            printf("ERROR: return code from pthread_create() is %d\n", error_check);
+            exit(1);
+        }
+    }
+    return pool;
+}
+
+// adds a job to the queue of a pool
+void pool_submit(struct thread_pool *pool, void (*run)(void *arg), void *arg)
+{
+    struct pool_job *job = malloc(sizeof(struct pool_job));
+    if (job == NULL)
+    {
+        printf("ERROR: could not allocate memory\n");
+        exit(1);
+    }
+    job->run = run;
+    job->arg = arg;
+    job->next = NULL;
+    pthread_mutex_lock(&pool->mutex);
+    if (pool->tail == NULL)
+    {
+        pool->head = job;
+    }
+    else
+    {
+        pool->tail->next = job;
+    }
+    pool->tail = job;
+    pool->unfinished++;
+    pthread_cond_signal(&pool->job_ready);
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+// waits until every job that was submitted has finished
+void pool_wait(struct thread_pool *pool)
+{
+    pthread_mutex_lock(&pool->mutex);
+    while (pool->unfinished > 0)
+    {
+        pthread_cond_wait(&pool->all_done, &pool->mutex);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+// finishes the jobs left in the queue and then stops the workers and frees the pool
+void pool_destroy(struct thread_pool *pool)
+{
+    pthread_mutex_lock(&pool->mutex);
+    pool->stopping = 1;
+    pthread_cond_broadcast(&pool->job_ready);
+    pthread_mutex_unlock(&pool->mutex);
+    for (int i = 0; i < pool->thread_count; i++)
+    {
+        pthread_join(pool->threads[i], NULL);
+    }
+    pthread_mutex_destroy(&pool->mutex);
+    pthread_cond_destroy(&pool->job_ready);
+    pthread_cond_destroy(&pool->all_done);
+    free(pool->threads);
+    free(pool);
+}
+
+// returns the number of cpus, used as the default number of worker threads
+int default_thread_count(void)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 ? cpus : 1;
+}
+
+// returns 1 if a directory entry name can be used as a local file name
+int is_safe_name(char *name)
+{
+    return name[0] != '\0' && strcmp(name, ".") != 0 && strcmp(name, "..") != 0 && strchr(name, '/') == NULL;
+}
+
+// Visited directories
+// Walks down the tree mark the start block of every directory they go into, so a corrupt entry that points back at
+// a directory above it is reported as a loop instead of being followed until the stack runs out
+struct visited_dirs
+{
+    uint64_t *bits;
+    uint32_t block_count;
+};
+
+struct visited_dirs *make_visited_dirs(struct fs_image *image)
+{
+    struct visited_dirs *visited = malloc(sizeof(struct visited_dirs));
+    if (visited == NULL)
+    {
+        printf("ERROR: could not allocate memory\n");
+        exit(1);
+    }
+    visited->block_count = image->fat_entry_count;
+    visited->bits = calloc((visited->block_count + 63) / 64, sizeof(uint64_t));
+    if (visited->bits == NULL)
+    {
+        printf("ERROR: could not allocate memory\n");
+        exit(1);
+    }
+    return visited;
+}
+
+// marks a directory as visited, returns 0 the first time and -1 if it was visited before. a block past the FAT ends
+// the directory straight away so it can not loop
+int visit_dir(struct visited_dirs *visited, uint32_t start_block)
+{
+    if (start_block >= visited->block_count)
+    {
+        return 0;
+    }
+    uint64_t bit = 1ULL << (start_block % 64);
+    if (visited->bits[start_block / 64] & bit)
+    {
+        return -1;
+    }
+    visited->bits[start_block / 64] |= bit;
+    return 0;
+}
+
+void free_visited_dirs(struct visited_dirs *visited)
+{
+    free(visited->bits);
+    free(visited);
+}
+
+// Recursive extraction
+// The directory tree is walked by the calling thread, which creates each local directory and hands every file to
+// the pool so the copies run in parallel
+struct extract_totals
+{
+    size_t files;
+    uint64_t bytes;
+    size_t failures;
+};
+
+struct extract_job
+{
+    struct fs_image *image;
+    uint32_t start_block;
+    uint32_t size;
+    char *output_path;
+    struct extract_totals *totals;
+};
+
+// the job each worker runs to copy one file
+void run_extract_job(void *void_job)
+{
+    struct extract_job *job = void_job;
+    if (extract_file(job->image, job->start_block, job->size, job->output_path) == 0)
+    {
+        __atomic_fetch_add(&job->totals->files, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&job->totals->bytes, job->size, __ATOMIC_RELAXED);
+    }
+    else
+    {
+        __atomic_fetch_add(&job->totals->failures, 1, __ATOMIC_RELAXED);
+    }
+    free(job->output_path);
+    free(job);
+}
+
+// This function makes a local directory for a directory in the image and queues a copy of every file in it,
+// then does the same for each of its subdirectories
+void extract_dir(struct fs_image *image, uint32_t dir_block, char *output_dir, struct thread_pool *pool,
+                 struct extract_totals *totals, struct visited_dirs *visited)
+{
+    if (visit_dir(visited, dir_block) == -1)
+    {
+        printf("ERROR: directory '%s' loops back to a directory above it\n", output_dir);
+        __atomic_fetch_add(&totals->failures, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    if (mkdir(output_dir, 0755) == -1 && errno != EEXIST)
+    {
+        printf("ERROR: could not make directory '%s'\n", output_dir);
+        __atomic_fetch_add(&totals->failures, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    struct dir_reader reader;
+    start_dir_reader(&reader, image, dir_block);
+    struct dir_entry_t *entry;
+    while ((entry = next_dir_entry(&reader, NULL)) != NULL)
+    {
+        char name[sizeof(entry->filename) + 1];
+        memcpy(name, entry->filename, sizeof(entry->filename));
+        name[sizeof(entry->filename)] = '\0';
+        if ((entry->status != 3 && entry->status != 5) || !is_safe_name(name))
+        {
+            continue;
+        }
+        char *output_path = malloc(strlen(output_dir) + strlen(name) + 2);
+        if (output_path == NULL)
+        {
+            printf("ERROR: could not allocate memory\n");
+            exit(1);
+        }
+        sprintf(output_path, "%s/%s", output_dir, name);
+        if (entry->status == 5)
+        {
+            extract_dir(image, htonl(entry->starting_block), output_path, pool, totals, visited);
+            free(output_path);
+            continue;
+        }
+        struct extract_job *job = malloc(sizeof(struct extract_job));
+        if (job == NULL)
+        {
+            printf("ERROR: could not allocate memory\n");
+            exit(1);
+        }
+        job->image = image;
+        job->start_block = htonl(entry->starting_block);
+        job->size = htonl(entry->size);
+        job->output_path = output_path;
+        job->totals = totals;
+        pool_submit(pool, run_extract_job, job);
+    }
+    end_dir_reader(&reader);
+}
+
+// get -r [-j workers] <directory in image> <local directory>
+// copies a whole directory tree out of the image using a pool of worker threads and reports the throughput
+int extract_tree(struct fs_image *image, int thread_count, char *image_dir, char *output_dir)
+{
+    uint32_t dir_block = goto_sub_dir(image, image_dir);
+    if (dir_block == LAST)
+    {
+        return 1;
+    }
+    struct extract_totals totals = {0, 0, 0};
+    double start = now_seconds();
+    struct thread_pool *pool = pool_create(thread_count);
+    struct visited_dirs *visited = make_visited_dirs(image);
+    extract_dir(image, dir_block, output_dir, pool, &totals, visited);
+    pool_wait(pool);
+    pool_destroy(pool);
+    free_visited_dirs(visited);
+    double time = now_seconds() - start;
+    if (time <= 0)
+    {
+        time = 1e-9;
+    }
+
+    printf("Extracted %zu files (%.2f MB) with %d workers in %.3f s: %.1f files/s, %.2f MB/s\n", totals.files,
+           totals.bytes / 1e6, thread_count, time, totals.files / time, totals.bytes / 1e6 / time);
+    if (totals.failures > 0)
+    {
+        printf("ERROR: %zu files or directories could not be extracted\n", totals.failures);
+        return 1;
+    }
+    return 0;
+}
+
+// Content addressed extraction
+// get -s <store> walks a directory tree like get -r, but instead of copying the tree it keeps one copy of every
+// different file in the store named by the hash of its contents and writes a manifest of the path, size and hash of
+// each file. The extents of each file are hashed straight from the memory map (or from a buffer read through the
+// block device) and the file is only written if the store does not have its hash yet, in which case its blocks are
+// still in the page cache from hashing. So extracting an image that has mostly not changed since last time reads
+// it once and writes almost nothing. The hash is XXH64, which keeps four independent lanes going over each 32 byte
+// stripe so the multiplies of the lanes overlap in the cpu.
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+
+struct xxh64_state
+{
+    uint64_t lanes[4];
+    uint64_t total_length;
+    unsigned char stripe[32]; // the start of a stripe that was cut off by the end of the last update
+    size_t stripe_length;
+};
+
+uint64_t rotate_left(uint64_t value, int bits)
+{
+    return (value << bits) | (value >> (64 - bits));
+}
+
+// reads a little endian word from anywhere
+uint64_t read_le64(const unsigned char *bytes)
+{
+    uint64_t value;
+    memcpy(&value, bytes, sizeof(value));
+    return le64toh(value);
+}
+
+uint32_t read_le32(const unsigned char *bytes)
+{
+    uint32_t value;
+    memcpy(&value, bytes, sizeof(value));
+    return le32toh(value);
+}
+
+uint64_t xxh64_round(uint64_t lane, uint64_t input)
+{
+    return rotate_left(lane + input * XXH_PRIME64_2, 31) * XXH_PRIME64_1;
+}
+
+uint64_t xxh64_merge(uint64_t hash, uint64_t lane)
+{
+    return (hash ^ xxh64_round(0, lane)) * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+void xxh64_start(struct xxh64_state *state)
+{
+    memset(state, 0, sizeof(struct xxh64_state));
+    state->lanes[0] = XXH_PRIME64_1 + XXH_PRIME64_2;
+    state->lanes[1] = XXH_PRIME64_2;
+    state->lanes[2] = 0;
+    state->lanes[3] = -XXH_PRIME64_1;
+}
+
+// runs the four lanes over one 32 byte stripe
+void xxh64_stripe(struct xxh64_state *state, const unsigned char *stripe)
+{
+    state->lanes[0] = xxh64_round(state->lanes[0], read_le64(stripe));
+    state->lanes[1] = xxh64_round(state->lanes[1], read_le64(stripe + 8));
+    state->lanes[2] = xxh64_round(state->lanes[2], read_le64(stripe + 16));
+    state->lanes[3] = xxh64_round(state->lanes[3], read_le64(stripe + 24));
+}
+
+// adds bytes to a hash, the bytes can be given in pieces of any size
+void xxh64_update(struct xxh64_state *state, const unsigned char *data, size_t length)
+{
+    state->total_length += length;
+    if (state->stripe_length + length < sizeof(state->stripe))
+    {
+        memcpy(state->stripe + state->stripe_length, data, length);
+        state->stripe_length += length;
+        return;
+    }
+    if (state->stripe_length > 0)
+    {
+        size_t fill = sizeof(state->stripe) - state->stripe_length;
+        memcpy(state->stripe + state->stripe_length, data, fill);
+        xxh64_stripe(state, state->stripe);
+        data += fill;
+        length -= fill;
+        state->stripe_length = 0;
+    }
+    for (; length >= sizeof(state->stripe); data += sizeof(state->stripe), length -= sizeof(state->stripe))
+    {
+        xxh64_stripe(state, data);
+    }
+    memcpy(state->stripe, data, length);
+    state->stripe_length = length;
+}
+
+// returns the hash of everything added
+uint64_t xxh64_digest(struct xxh64_state *state)
+{
+    uint64_t hash;
+    if (state->total_length >= sizeof(state->stripe))
+    {
+        hash = rotate_left(state->lanes[0], 1) + rotate_left(state->lanes[1], 7) + rotate_left(state->lanes[2], 12) +
+               rotate_left(state->lanes[3], 18);
+        for (int i = 0; i < 4; i++)
+        {
+            hash = xxh64_merge(hash, state->lanes[i]);
+        }
+    }
+    else
+    {
+        hash = state->lanes[2] + XXH_PRIME64_5;
+    }
+    hash += state->total_length;
+
+    const unsigned char *rest = state->stripe;
+    size_t length = state->stripe_length;
+    for (; length >= 8; rest += 8, length -= 8)
+    {
+        hash = rotate_left(hash ^ xxh64_round(0, read_le64(rest)), 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+    }
+    if (length >= 4)
+    {
+        hash = rotate_left(hash ^ (read_le32(rest) * XXH_PRIME64_1), 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        rest += 4;
+        length -= 4;
+    }
+    for (; length > 0; rest++, length--)
+    {
+        hash = rotate_left(hash ^ (*rest * XXH_PRIME64_5), 11) * XXH_PRIME64_1;
+    }
+    hash ^= hash >> 33;
+    hash *= XXH_PRIME64_2;
+    hash ^= hash >> 29;
+    hash *= XXH_PRIME64_3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+// This function hashes the first size bytes of a list of extents, returns 0 on success and -1 if the image could not
+// be read
+int hash_extents(struct fs_image *image, struct extent *extents, size_t extent_count, uint64_t size, uint64_t *hash)
+{
+    struct xxh64_state state;
+    xxh64_start(&state);
+    unsigned char *buffer = image->memory == NULL ? malloc(COPY_BUFFER_SIZE) : NULL;
+    for (size_t i = 0; i < extent_count && size > 0; i++)
+    {
+        uint64_t offset = block_offset(image, extents[i].start_block);
+        uint64_t length = (uint64_t)extents[i].length * image->block_size;
+        length = length > size ? size : length;
+        size -= length;
+        if (image->memory != NULL)
+        {
+            xxh64_update(&state, image->memory + offset, length);
+            continue;
+        }
+        for (uint64_t done = 0; done < length;)
+        {
+            size_t part = length - done > COPY_BUFFER_SIZE ? COPY_BUFFER_SIZE : length - done;
+            read_image(image, offset + done, buffer, part);
+            xxh64_update(&state, buffer, part);
+            done += part;
+        }
+    }
+    free(buffer);
+    *hash = xxh64_digest(&state);
+    return size == 0 ? 0 : -1;
+}
+
+struct store_job
+{
+    struct fs_image *image;
+    uint32_t start_block;
+    uint32_t size;
+    char *path; // where the file is in the image
+    char *store;
+    uint64_t hash;
+    int status; // 0 once it is written to the store, 1 if the store already had it and -1 if it failed
+};
+
+// the job each worker runs to hash one file and add it to the store if it is new. files in the store are named
+// <store>/<first 2 hex digits>/<16 hex digits> and are written to a temporary file that is synced before it is
+// renamed to that name, so a name in the store only ever points at a whole file and can be trusted without reading
+// it back. A stored file of the wrong size is from something else and is written over
+void run_store_job(void *void_job)
+{
+    struct store_job *job = void_job;
+    job->status = -1;
+    size_t extent_count;
+    struct extent *extents = build_extents(job->image, job->start_block, &extent_count);
+    if (extents == NULL || hash_extents(job->image, extents, extent_count, job->size, &job->hash) == -1)
+    {
+        printf("ERROR: the chain of '%s' is broken\n", job->path);
+        free(extents);
+        return;
+    }
+    size_t store_length = strlen(job->store);
+    char stored_path[store_length + 32];
+    sprintf(stored_path, "%s/%02x", job->store, (unsigned)(job->hash >> 56));
+    struct stat stored_stat;
+    char *name = stored_path + strlen(stored_path);
+    sprintf(name, "/%016lx", (unsigned long)job->hash);
+    if (stat(stored_path, &stored_stat) == 0 && stored_stat.st_size == job->size)
+    {
+        job->status = 1;
+        free(extents);
+        return;
+    }
+
+    *name = '\0';
+    char temp_path[store_length + 32];
+    sprintf(temp_path, "%s/.tmp-XXXXXX", stored_path);
+    int fd = mkdir(stored_path, 0755) == -1 && errno != EEXIST ? -1 : mkstemp(temp_path);
+    sprintf(name, "/%016lx", (unsigned long)job->hash);
+    int written = fd != -1 && copy_extents(job->image, extents, extent_count, job->size, fd) == 0 && fsync(fd) == 0;
+    if (fd != -1 && close(fd) == -1)
+    {
+        written = 0;
+    }
+    if (!written || rename(temp_path, stored_path) == -1)
+    {
+        printf("ERROR: could not add '%s' to the store\n", job->path);
+        unlink(temp_path);
+    }
+    else
+    {
+        job->status = 0;
+    }
+    free(extents);
+}
+
+// the jobs of one run, kept in the order the tree was walked so the manifest is written in that order
+struct store_run
+{
+    struct thread_pool *pool;
+    char *store;
+    struct store_job **jobs;
+    size_t job_count;
+    size_t job_capacity;
+    struct visited_dirs *visited;
+    size_t loops; // directories that point back at a directory above them and were not walked again
+};
+
+// This function queues a job for every file in a directory and then does the same for each of its subdirectories
+void store_dir(struct fs_image *image, uint32_t dir_block, char *path, struct store_run *run)
+{
+    if (visit_dir(run->visited, dir_block) == -1)
+    {
+        printf("ERROR: directory '%s' loops back to a directory above it\n", path);
+        run->loops++;
+        return;
+    }
+    struct dir_reader reader;
+    start_dir_reader(&reader, image, dir_block);
+    struct dir_entry_t *entry;
+    while ((entry = next_dir_entry(&reader, NULL)) != NULL)
+    {
+        char name[sizeof(entry->filename) + 1];
+        memcpy(name, entry->filename, sizeof(entry->filename));
+        name[sizeof(entry->filename)] = '\0';
+        if ((entry->status != 3 && entry->status != 5) || !is_safe_name(name))
+        {
+            continue;
+        }
+        char *child = malloc(strlen(path) + strlen(name) + 2);
+        if (child == NULL)
+        {
+            printf("ERROR: could not allocate memory\n");
+            exit(1);
+        }
+        sprintf(child, "%s/%s", path, name);
+        if (entry->status == 5)
+        {
+            store_dir(image, htonl(entry->starting_block), child, run);
+            free(child);
+            continue;
+        }
+        struct store_job *job = calloc(1, sizeof(struct store_job));
+        if (run->job_count == run->job_capacity)
+        {
+            run->job_capacity = run->job_capacity == 0 ? 256 : run->job_capacity * 2;
+            run->jobs = realloc(run->jobs, run->job_capacity * sizeof(struct store_job *));
+        }
+        if (job == NULL || run->jobs == NULL)
+        {
+            printf("ERROR: could not allocate memory\n");
+            exit(1);
+        }
+        job->image = image;
+        job->start_block = htonl(entry->starting_block);
+        job->size = htonl(entry->size);
+        job->path = child;
+        job->store = run->store;
+        run->jobs[run->job_count++] = job;
+        pool_submit(run->pool, run_store_job, job);
+    }
+    end_dir_reader(&reader);
+}
+
+// get -s <store> [-j workers] <directory in image> <manifest>
+// adds every file under a directory of the image to a content addressed store, writing a manifest line of
+// "<hash> <size> <path>" for each, and reports how much was new
+int store_tree(struct fs_image *image, int thread_count, char *image_dir, char *store, char *manifest_path)
+{
+    uint32_t dir_block = goto_sub_dir(image, image_dir);
+    if (dir_block == LAST)
+    {
+        return 1;
+    }
+    if (mkdir(store, 0755) == -1 && errno != EEXIST)
+    {
+        printf("ERROR: could not make directory '%s'\n", store);
+        return 1;
+    }
+    FILE *manifest = fopen(manifest_path, "w");
+    if (manifest == NULL)
+    {
+        printf("ERROR: could not open file '%s'\n", manifest_path);
+        return 1;
+    }
+
+    double start = now_seconds();
+    struct store_run run = {pool_create(thread_count), store, NULL, 0, 0, make_visited_dirs(image), 0};
+    // manifest paths start with / and have no / on the end
+    char prefix[strlen(image_dir) + 2];
+    sprintf(prefix, "%s%s", image_dir[0] == '/' ? "" : "/", image_dir);
+    for (size_t end = strlen(prefix); end > 0 && prefix[end - 1] == '/'; end--)
+    {
+        prefix[end - 1] = '\0';
+    }
+    store_dir(image, dir_block, prefix, &run);
+    pool_wait(run.pool);
+    pool_destroy(run.pool);
+    free_visited_dirs(run.visited);
+    double time = now_seconds() - start;
+    time = time > 0 ? time : 1e-9;
+
+    size_t counts[3] = {0, 0, 0}; // failed, written, already stored
+    uint64_t bytes = 0, written_bytes = 0;
+    for (size_t i = 0; i < run.job_count; i++)
+    {
+        struct store_job *job = run.jobs[i];
+        counts[job->status + 1]++;
+        if (job->status != -1)
+        {
+            fprintf(manifest, "%016lx %u %s\n", (unsigned long)job->hash, job->size, job->path);
+            bytes += job->size;
+            written_bytes += job->status == 0 ? job->size : 0;
+        }
+        free(job->path);
+        free(job);
+    }
+    free(run.jobs);
+    int status = fclose(manifest) == 0 ? 0 : 1;
+    printf("Hashed %zu files (%.2f MB) with %d workers in %.3f s: %.2f MB/s, %zu new files (%.2f MB) written, %zu already stored\n",
+           counts[1] + counts[2], bytes / 1e6, thread_count, time, bytes / 1e6 / time, counts[1], written_bytes / 1e6, counts[2]);
+    if (counts[0] > 0 || status != 0)
+    {
+        printf("ERROR: %zu files could not be stored\n", counts[0]);
+        return 1;
+    }
+    return run.loops > 0;
+}
+
+// part 3
+int diskget(struct fs_image *image, int argc, char *argv[])
+{
+    // -r copies a whole directory, -s adds a whole directory to a store instead, -j sets how many files are copied
+    // at once
+    int recursive = 0;
+    char *store = NULL;
+    int thread_count = default_thread_count();
+    while (argc > 0 && argv[0][0] == '-' && argv[0][1] != '\0')
+    {
+        if (strcmp(argv[0], "-r") == 0)
+        {
+            recursive = 1;
+        }
+        else if (strcmp(argv[0], "-s") == 0 && argc > 1)
+        {
+            store = argv[1];
+            argc--;
+            argv++;
+        }
+        else if (strcmp(argv[0], "-j") == 0 && argc > 1 && atoi(argv[1]) > 0)
+        {
+            thread_count = atoi(argv[1]);
+            argc--;
+            argv++;
+        }
+        else
+        {
+            printf("ERROR: Incorrect command line arguments\n");
+            return 1;
+        }
+        argc--;
+        argv++;
+    }
+
+    // check command line arguments
+    if (argc != 2)
+    {
+        printf("ERROR: Incorrect command line arguments\n");
+        return 1;
+    }
+
+    if (store != NULL)
+    {
+        return store_tree(image, thread_count, argv[0], store, argv[1]);
+    }
+    if (recursive)
+    {
+        if (strcmp(argv[1], "-") == 0)
+        {
+            printf("ERROR: a directory can not be written to stdout\n");
+            return 1;
+        }
+        return extract_tree(image, thread_count, argv[0], argv[1]);
+    }
+
+    // locate the File
+    struct dir_entry_t entry;
+    if (find_file_by_path(image, argv[0], &entry) == 0)
+    {
+        return 1;
+    }
+    return extract_file(image, htonl(entry.starting_block), htonl(entry.size), argv[1]) == -1;
+}
+
+// Disk usage and fragmentation
+// Every chain is walked once through the decoded FAT, counting the runs of contiguous blocks as it goes
+struct usage_totals
+{
+    size_t files;
+    size_t directories;
+    size_t fragmented_files; // files made of more than one run
+    uint64_t bytes;
+    uint64_t blocks;
+    uint64_t extents;
+    size_t loops; // directories that point back at a directory above them and were not walked again
+};
+
+// counts the blocks and runs of contiguous blocks in a chain
+void count_extents(struct fs_image *image, uint32_t start_block, uint64_t *block_count, uint64_t *extent_count)
+{
+    uint64_t blocks = 0;
+    uint64_t extents = 0;
+    uint32_t previous = LAST;
+    for (uint32_t cur_block = start_block; cur_block != LAST && blocks < image->block_count; cur_block = get_next_block(image, cur_block))
+    {
+        if (previous == LAST || cur_block != previous + 1)
+        {
+            extents++;
+        }
+        previous = cur_block;
+        blocks++;
+    }
+    *block_count = blocks;
+    *extent_count = extents;
+}
+
+// adds the totals of a subdirectory to the totals of its parent
+void add_usage(struct usage_totals *totals, struct usage_totals *other)
+{
+    totals->files += other->files;
+    totals->directories += other->directories;
+    totals->fragmented_files += other->fragmented_files;
+    totals->bytes += other->bytes;
+    totals->blocks += other->blocks;
+    totals->extents += other->extents;
+    totals->loops += other->loops;
+}
+
+// prints the totals line of a directory
+void print_usage(char *label, char *path, struct usage_totals *totals)
+{
+    printf("%s %s: %zu files, %zu directories, %lu bytes, %lu blocks, %lu extents, %zu fragmented files, average run %.2f blocks\n",
+           label, path, totals->files, totals->directories, (unsigned long)totals->bytes, (unsigned long)totals->blocks,
+           (unsigned long)totals->extents, totals->fragmented_files,
+           totals->extents > 0 ? (double)totals->blocks / totals->extents : 0.0);
+}
+
+// This function prints the blocks and runs of every file in a directory, then does the same for each of its
+// subdirectories and prints the totals of the whole directory last
+void stat_dir(struct fs_image *image, uint32_t dir_block, char *path, int quiet, struct usage_totals *totals,
+              struct visited_dirs *visited)
+{
+    memset(totals, 0, sizeof(struct usage_totals));
+    if (visit_dir(visited, dir_block) == -1)
+    {
+        printf("ERROR: directory '%s' loops back to a directory above it\n", path);
+        totals->loops = 1;
+        return;
+    }
+    struct dir_reader reader;
+    start_dir_reader(&reader, image, dir_block);
+    struct dir_entry_t *entry;
+    while ((entry = next_dir_entry(&reader, NULL)) != NULL)
+    {
+        if (entry->status != 3 && entry->status != 5)
+        {
+            continue;
+        }
+        char name[sizeof(entry->filename) + 1];
+        memcpy(name, entry->filename, sizeof(entry->filename));
+        name[sizeof(entry->filename)] = '\0';
+        char entry_path[strlen(path) + strlen(name) + 2];
+        sprintf(entry_path, "%s%s%s", path, strcmp(path, "/") == 0 ? "" : "/", name);
+
+        if (entry->status == 5)
+        {
+            struct usage_totals subdir;
+            stat_dir(image, htonl(entry->starting_block), entry_path, quiet, &subdir, visited);
+            add_usage(totals, &subdir);
+            totals->directories++;
+            continue;
+        }
+        uint64_t blocks, extents;
+        count_extents(image, htonl(entry->starting_block), &blocks, &extents);
+        totals->files++;
+        totals->bytes += htonl(entry->size);
+        totals->blocks += blocks;
+        totals->extents += extents;
+        totals->fragmented_files += extents > 1;
+        if (!quiet)
+        {
+            printf("F %10lu %8lu %8lu %8.2f %s\n", (unsigned long)htonl(entry->size), (unsigned long)blocks,
+                   (unsigned long)extents, extents > 0 ? (double)blocks / extents : 0.0, entry_path);
+        }
+    }
+    end_dir_reader(&reader);
+    print_usage("D", path, totals);
+}
+
+// diskstat [-q] [directory]
+// reports how many runs of contiguous blocks each file is split into and the totals for each directory, -q only
+// prints the directory totals
+int diskstat(struct fs_image *image, int argc, char *argv[])
+{
+    int quiet = 0;
+    if (argc > 0 && strcmp(argv[0], "-q") == 0)
+    {
+        quiet = 1;
+        argc--;
+        argv++;
+    }
+    if (argc > 1)
+    {
+        printf("ERROR: Incorrect command line arguments\n");
+        return 1;
+    }
+    char *path = argc == 1 ? argv[0] : "/";
+    uint32_t dir_block = goto_sub_dir(image, path);
+    if (dir_block == LAST)
+    {
+        return 1;
+    }
+
+    if (!quiet)
+    {
+        printf("T %10s %8s %8s %8s %s\n", "size", "blocks", "extents", "avg run", "path");
+    }
+    struct usage_totals totals;
+    struct visited_dirs *visited = make_visited_dirs(image);
+    stat_dir(image, dir_block, path, quiet, &totals, visited);
+    free_visited_dirs(visited);
+    printf("Fragmented files: %zu of %zu (%.1f%%)\n", totals.fragmented_files, totals.files,
+           totals.files > 0 ? 100.0 * totals.fragmented_files / totals.files : 0.0);
+    printf("Average extents per file: %.2f\n", totals.files > 0 ? (double)totals.extents / totals.files : 0.0);
+    return totals.loops > 0;
+}
+
+// Defragmenter
+// The whole tree is walked first to check that no chain is broken or shared before anything is moved. Each chain
+// that is split into more than one run is then moved on its own to a run of blocks that is free in the FAT: its blocks are copied there first, then the new chain, the old blocks set to FREE and the
+// entry pointing at it are written through the journal and committed together, so stopping at any point leaves
+// every chain either where it was or where it was moved to. The old blocks are only given back to the allocator
+// once that commit is done so the next chain can not be copied over them before then. A chain with no free run
+// big enough is left where it is. Only the chain being moved is held in memory so images bigger than memory can be
+// defragmented, and a new image is made by streaming a copy of the image to it and defragmenting the copy. Blocks
+// that are not in a file or subdirectory (the superblock, FAT, root directory and anything else that is allocated
+// but not reachable) stay where they are.
+#define DEFRAG_COPY_BLOCKS 256 // blocks copied per read and write when a chain is moved
+struct defrag_chain
+{
+    uint32_t length;
+    size_t first; // where the blocks of the chain start in the block lists
+    int is_file;
+};
+
+struct defrag_plan
+{
+    struct defrag_chain *chains;
+    size_t chain_count;
+    size_t chain_capacity;
+    uint32_t *old_blocks; // the blocks of every chain one after another in chain order
+    uint32_t *new_blocks; // where the chain being moved goes
+    size_t block_total;
+    uint32_t *seen; // for each block in the image 0 once it is in a chain and LAST before
+    uint32_t usable_blocks;
+};
+
+// This function adds the chains of every entry in a directory to the plan and then the chains inside each
+// subdirectory, returns -1 if a chain leaves the image or runs into a block that is already in another chain
+int defrag_collect(struct fs_image *image, struct defrag_plan *plan, uint32_t dir_block)
+{
+    struct dir_reader reader;
+    start_dir_reader(&reader, image, dir_block);
+    struct dir_entry_t *entry;
+    uint64_t offset;
+    while ((entry = next_dir_entry(&reader, &offset)) != NULL)
+    {
+        if (entry->status != 3 && entry->status != 5)
+        {
+            continue;
+        }
+        if (plan->chain_count == plan->chain_capacity)
+        {
+            plan->chain_capacity = plan->chain_capacity == 0 ? 64 : plan->chain_capacity * 2;
+            plan->chains = realloc(plan->chains, plan->chain_capacity * sizeof(struct defrag_chain));
+            if (plan->chains == NULL)
+            {
+                printf("ERROR: could not allocate memory\n");
+                exit(1);
+            }
+        }
+        struct defrag_chain *chain = &plan->chains[plan->chain_count++];
+        chain->first = plan->block_total;
+        chain->length = 0;
+        chain->is_file = entry->status == 3;
+        for (uint32_t block = htonl(entry->starting_block); block != LAST; block = get_next_block(image, block))
+        {
+            if (block >= plan->usable_blocks || plan->seen[block] != LAST)
+            {
+                printf("ERROR: the chain of '%.31s' is broken or shared with another file\n", entry->filename);
+                end_dir_reader(&reader);
+                return -1;
+            }
+            plan->seen[block] = 0;
+            plan->old_blocks[plan->block_total++] = block;
+            chain->length++;
+        }
+        if (entry->status == 5 && defrag_collect(image, plan, htonl(entry->starting_block)) == -1)
+        {
+            end_dir_reader(&reader);
+            return -1;
+        }
+    }
+    end_dir_reader(&reader);
+    return 0;
+}
+
+// counts the runs of contiguous blocks in a list of blocks
+uint64_t count_runs(uint32_t *blocks, uint32_t length)
+{
+    uint64_t runs = 0;
+    for (uint32_t i = 0; i < length; i++)
+    {
+        runs += i == 0 || blocks[i] != blocks[i - 1] + 1;
+    }
+    return runs;
+}
+
+// prints how many runs the files and directories are split into
+void print_defrag_counts(char *label, struct defrag_plan *plan, uint32_t *blocks)
+{
+    uint64_t file_extents = 0, dir_extents = 0;
+    size_t files = 0, fragmented = 0;
+    for (size_t i = 0; i < plan->chain_count; i++)
+    {
+        struct defrag_chain *chain = &plan->chains[i];
+        uint64_t runs = count_runs(blocks + chain->first, chain->length);
+        if (chain->is_file)
+        {
+            files++;
+            file_extents += runs;
+            fragmented += runs > 1;
+        }
+        else
+        {
+            dir_extents += runs;
+        }
+    }
+    printf("%s: %zu files in %lu extents (%zu fragmented), %zu directories in %lu extents\n", label, files,
+           (unsigned long)file_extents, fragmented, plan->chain_count - files, (unsigned long)dir_extents);
+}
+
+// This function streams the image to a new file a chunk at a time, returns 0 on success and 1 after printing an error
+int defrag_copy_image(struct fs_image *image, char *output_path)
+{
+    size_t chunk_size = (size_t)DEFRAG_COPY_BLOCKS * image->block_size;
+    unsigned char *buffer = malloc(chunk_size);
+    if (buffer == NULL)
+    {
+        printf("ERROR: could not allocate memory\n");
+        exit(1);
+    }
+    int out_fd = open(output_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int status = out_fd == -1;
+    for (uint64_t offset = 0; status == 0 && offset < (uint64_t)image->size; offset += chunk_size)
+    {
+        size_t length = (uint64_t)image->size - offset < chunk_size ? (uint64_t)image->size - offset : chunk_size;
+        read_image(image, offset, buffer, length);
+        status = write_all(out_fd, buffer, length) == -1;
+    }
+    if (status != 0 || fsync(out_fd) == -1)
+    {
+        printf("ERROR: could not write '%s'\n", output_path);
+        status = 1;
+    }
+    if (out_fd != -1)
+    {
+        close(out_fd);
+    }
+    free(buffer);
+    return status;
+}
+
+// This function moves one chain to a free run of blocks and commits the new chain and entry, old_blocks holds the
+// chain as it is and new_blocks gets where it moved to. returns 1 if it was moved, 0 if it was already contiguous
+// and -1 if there was no free run big enough, nothing is moved out of the way to make one
+int defrag_move_chain(struct fs_image *image, struct dir_entry_t *entry, uint64_t entry_offset, uint32_t *old_blocks,
+                      uint32_t length, uint32_t *new_blocks, unsigned char *buffer)
+{
+    if (count_runs(old_blocks, length) <= 1)
+    {
+        return 0;
+    }
+    if (allocate_run(get_allocator(image), length, new_blocks) == -1)
+    {
+        printf("There is no free run of %u blocks for '%.31s', it is left where it is\n", length, entry->filename);
+        return -1;
+    }
+
+    // the new blocks are free in the FAT that is on disk so writing them first changes nothing that can be seen
+    for (uint32_t i = 0; i < length; i += DEFRAG_COPY_BLOCKS)
+    {
+        uint32_t count = length - i < DEFRAG_COPY_BLOCKS ? length - i : DEFRAG_COPY_BLOCKS;
+        for (uint32_t j = 0; j < count; j++)
+        {
+            read_image(image, block_offset(image, old_blocks[i + j]), buffer + (size_t)j * image->block_size, image->block_size);
+        }
+        write_image(image, block_offset(image, new_blocks[i]), buffer, (size_t)count * image->block_size);
+    }
+
+    for (uint32_t i = 0; i < length; i++)
+    {
+        set_fat_entry(image, old_blocks[i], FREE);
+    }
+    write_chain(image, new_blocks, length);
+    entry->starting_block = htonl(new_blocks[0]);
+    write_metadata(image, entry_offset, entry, sizeof(struct dir_entry_t));
+    commit_transaction(image);
+    release_blocks(image, old_blocks, length);
+    return 1;
+}
+
+// This function moves the chain of every entry in a directory that is split up and then does the same inside each
+// subdirectory, which has already been moved by then. moved is increased by the number of chains moved and skipped
+// by the number left split up since no free run was big enough
+void defrag_dir(struct fs_image *image, uint32_t dir_block, uint32_t *old_blocks, uint32_t *new_blocks,
+                unsigned char *buffer, size_t *moved, size_t *skipped)
+{
+    struct dir_reader reader;
+    start_dir_reader(&reader, image, dir_block);
+    struct dir_entry_t *entry;
+    uint64_t offset;
+    while ((entry = next_dir_entry(&reader, &offset)) != NULL)
+    {
+        if (entry->status != 3 && entry->status != 5)
+        {
+            continue;
+        }
+        // the tree was checked by defrag_collect so every chain ends and fits in old_blocks
+        struct dir_entry_t moving = *entry;
+        uint32_t length = 0;
+        for (uint32_t block = htonl(moving.starting_block); block != LAST; block = get_next_block(image, block))
+        {
+            old_blocks[length++] = block;
+        }
+        int result = defrag_move_chain(image, &moving, offset, old_blocks, length, new_blocks, buffer);
+        *moved += result == 1;
+        *skipped += result == -1;
+        if (moving.status == 5)
+        {
+            defrag_dir(image, htonl(moving.starting_block), old_blocks, new_blocks, buffer, moved, skipped);
+        }
+    }
+    end_dir_reader(&reader);
+}
+
+// diskdefrag [new image]
+// moves the blocks of every file and directory that fits in a free run so each one is a single contiguous run,
+// either rewriting the image in place or writing the result to a new image and leaving the original alone. Free
+// space is not compacted, so a chain with no free run big enough stays split up
+int diskdefrag(struct fs_image *image, int argc, char *argv[])
+{
+    if (argc > 1)
+    {
+        printf("ERROR: Incorrect command line arguments\n");
+        return 1;
+    }
+    if (argc == 0 && !image->writable)
+    {
+        printf("ERROR: the image was not opened for writing\n");
+        return 1;
+    }
+    if (in_transaction(image))
+    {
+        printf("ERROR: defrag can not be run inside a transaction\n");
+        return 1;
+    }
+
+    struct defrag_plan plan;
+    memset(&plan, 0, sizeof(plan));
+    plan.usable_blocks = usable_block_count(image);
+    plan.seen = malloc(plan.usable_blocks * sizeof(uint32_t));
+    plan.old_blocks = malloc(plan.usable_blocks * sizeof(uint32_t));
+    plan.new_blocks = malloc(plan.usable_blocks * sizeof(uint32_t));
+    if (plan.seen == NULL || plan.old_blocks == NULL || plan.new_blocks == NULL)
+    {
+        printf("ERROR: could not allocate memory\n");
+        exit(1);
+    }
+    memset(plan.seen, 0xFF, plan.usable_blocks * sizeof(uint32_t));
+
+    int status;
+    if (defrag_collect(image, &plan, image->root_dir_start_block) == -1)
+    {
+        status = 1;
+    }
+    else if (argc == 1)
+    {
+        // the copy is defragmented in place, a journal left next to it from before would be replayed over it
+        status = defrag_copy_image(image, argv[0]);
+        if (status == 0)
+        {
+            char *journal_path = malloc(strlen(argv[0]) + sizeof(".journal"));
+            if (journal_path == NULL)
+            {
+                printf("ERROR: could not allocate memory\n");
+                exit(1);
+            }
+            sprintf(journal_path, "%s.journal", argv[0]);
+            unlink(journal_path);
+            struct fs_image *copy = open_image(argv[0], 1);
+            status = diskdefrag(copy, 0, NULL);
+            close_image(copy);
+            unlink(journal_path);
+            free(journal_path);
+        }
+    }
+    else
+    {
+        // the moves are committed as they go so anything left from a batch is committed first
+        commit_transaction(image);
+        unsigned char *buffer = malloc((size_t)DEFRAG_COPY_BLOCKS * image->block_size);
+        if (buffer == NULL)
+        {
+            printf("ERROR: could not allocate memory\n");
+            exit(1);
+        }
+        size_t moved = 0;
+        size_t skipped = 0;
+        print_defrag_counts("Before", &plan, plan.old_blocks);
+        defrag_dir(image, image->root_dir_start_block, plan.old_blocks, plan.new_blocks, buffer, &moved, &skipped);
+        free(buffer);
+        printf("Moved %zu chains, %zu left split up since there was no free run big enough for them\n", moved, skipped);
+
+        // everything that was cached about the old layout has to be rebuilt, then the tree is walked again to count
+        // the runs it is in now
+        clear_dir_index(image);
+        clear_skip_index(image->skip_index);
+        plan.chain_count = 0;
+        plan.block_total = 0;
+        memset(plan.seen, 0xFF, plan.usable_blocks * sizeof(uint32_t));
+        status = defrag_collect(image, &plan, image->root_dir_start_block) == -1;
+        if (status == 0)
+        {
+            print_defrag_counts("After", &plan, plan.old_blocks);
+        }
+    }
+    free(plan.chains);
+    free(plan.seen);
+    free(plan.old_blocks);
+    free(plan.new_blocks);
+    return status;
+}
+
+// Integrity check
+// Every chain reachable from the root directory is walked once. owners has a slot for every block holding the
+// number of the chain that went through it, claimed with a compare and swap so directories can be checked by
+// several threads at once: a block already claimed by the same chain means the chain loops and one claimed by
+// another chain means the two are cross linked. Once every directory is done any block that is allocated in the FAT
+// but was never claimed is an orphan. The blocks before the root directory are the superblock and FAT and are
+// not looked at.
+struct check_state
+{
+    struct fs_image *image;
+    struct thread_pool *pool;
+    uint32_t *owners;
+    uint32_t next_chain;
+    size_t files, directories, blocks, errors; // updated atomically
+};
+
+struct check_job
+{
+    struct check_state *state;
+    uint32_t dir_block;
+    char *path;
+};
+
+void check_error(struct check_state *state, const char *format, ...) __attribute__((format(printf, 2, 3)));
+void check_error(struct check_state *state, const char *format, ...)
+{
+    char line[512];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    printf("%s\n", line); // one printf per line so lines from different threads are not mixed
+    __atomic_fetch_add(&state->errors, 1, __ATOMIC_RELAXED);
+}
+
+// This function walks one chain claiming its blocks, sets length to how many blocks it has
+// returns 0 if the chain ends at LAST without problems and -1 after printing what is wrong with it otherwise
+int check_chain(struct check_state *state, char *path, uint32_t start_block, uint32_t *length)
+{
+    struct fs_image *image = state->image;
+    uint32_t chain = __atomic_add_fetch(&state->next_chain, 1, __ATOMIC_RELAXED);
+    *length = 0;
+    for (uint32_t block = start_block; block != LAST; block = image->fat[block])
+    {
+        if (block < image->root_dir_start_block || !is_valid_block(image, block) || block >= image->fat_entry_count)
+        {
+            check_error(state, "'%s': chain points to block %u which is outside the data blocks", path, block);
+            return -1;
+        }
+        uint32_t owner = 0;
+        if (!__atomic_compare_exchange_n(&state->owners[block], &owner, chain, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        {
+            check_error(state, owner == chain ? "'%s': chain loops back to block %u" : "'%s': block %u is cross linked with another chain", path, block);
+            return -1;
+        }
+        (*length)++;
+        __atomic_fetch_add(&state->blocks, 1, __ATOMIC_RELAXED);
+        if (image->fat[block] == FREE || image->fat[block] == RESERVED)
+        {
+            check_error(state, "'%s': block %u is in the chain but marked %s in the FAT", path, block, image->fat[block] == FREE ? "free" : "reserved");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void run_check_job(void *arg);
+
+// This function checks every entry of a directory, queueing a job for each subdirectory whose chain is sound
+void check_dir(struct check_state *state, uint32_t dir_block, char *path)
+{
+    struct fs_image *image = state->image;
+    struct dir_reader reader;
+    start_dir_reader(&reader, image, dir_block);
+    struct dir_entry_t *entry;
+    while ((entry = next_dir_entry(&reader, NULL)) != NULL)
+    {
+        if ((entry->status & 1) == 0)
+        {
+            continue;
+        }
+        char name[sizeof(entry->filename) + 1];
+        memcpy(name, entry->filename, sizeof(entry->filename));
+        name[sizeof(entry->filename)] = '\0';
+        char *entry_path = malloc(strlen(path) + strlen(name) + 2);
+        if (entry_path == NULL)
+        {
+            printf("ERROR: could not allocate memory\n");
+            exit(1);
+        }
+        sprintf(entry_path, "%s%s%s", path, strcmp(path, "/") == 0 ? "" : "/", name);
+        if (entry->status != 3 && entry->status != 5)
+        {
+            check_error(state, "'%s': entry has unknown status %u", entry_path, entry->status);
+            free(entry_path);
+            continue;
+        }
+
+        uint32_t length;
+        uint32_t block_count = htonl(entry->block_count);
+        uint64_t size = htonl(entry->size);
+        int sound = check_chain(state, entry_path, htonl(entry->starting_block), &length) == 0;
+        if (sound && length != block_count)
+        {
+            check_error(state, "'%s': block count is %u but the chain has %u blocks", entry_path, block_count, length);
+        }
+        if (entry->status == 3)
+        {
+            __atomic_fetch_add(&state->files, 1, __ATOMIC_RELAXED);
+            if ((size + image->block_size - 1) / image->block_size != block_count)
+            {
+                check_error(state, "'%s': size %lu does not fit in %u blocks", entry_path, (unsigned long)size, block_count);
+            }
+            free(entry_path);
+            continue;
+        }
+        __atomic_fetch_add(&state->directories, 1, __ATOMIC_RELAXED);
+        if (size != (uint64_t)block_count * image->block_size)
+        {
+            check_error(state, "'%s': directory size %lu is not %u blocks", entry_path, (unsigned long)size, block_count);
+        }
+        if (!sound)
+        {
+            free(entry_path); // the entries of a broken directory can not be trusted
+            continue;
+        }
+        struct check_job *job = malloc(sizeof(struct check_job));
+        if (job == NULL)
+        {
+            printf("ERROR: could not allocate memory\n");
+            exit(1);
+        }
+        job->state = state;
+        job->dir_block = htonl(entry->starting_block);
+        job->path = entry_path;
+        pool_submit(state->pool, run_check_job, job);
+    }
+    end_dir_reader(&reader);
+}
+
+void run_check_job(void *arg)
+{
+    struct check_job *job = arg;
+    check_dir(job->state, job->dir_block, job->path);
+    free(job->path);
+    free(job);
+}
+
+// diskcheck [-j workers]
+// checks that every chain ends at LAST, that no block is in two chains or allocated without being in one and that
+// the sizes and block counts of the entries match their chains, returns 1 if anything is wrong
+int diskcheck(struct fs_image *image, int argc, char *argv[])
+{
+    int thread_count = default_thread_count();
+    if (argc == 2 && strcmp(argv[0], "-j") == 0 && atoi(argv[1]) > 0)
+    {
+        thread_count = atoi(argv[1]);
+    }
+    else if (argc != 0)
+    {
+        printf("ERROR: Incorrect command line arguments\n");
+        return 1;
+    }
+
+    double start = now_seconds();
+    struct check_state state;
+    memset(&state, 0, sizeof(state));
+    state.image = image;
+    if (image->block_count > image->fat_entry_count || (uint64_t)image->block_count * image->block_size > (uint64_t)image->size)
+    {
+        check_error(&state, "superblock: %u blocks do not fit in the FAT or the image", image->block_count);
+    }
+    state.owners = calloc(image->fat_entry_count, sizeof(uint32_t));
+    if (state.owners == NULL)
+    {
+        printf("ERROR: could not allocate memory\n");
+        exit(1);
+    }
+
+    uint32_t root_length;
+    if (check_chain(&state, "/", image->root_dir_start_block, &root_length) == 0)
+    {
+        if (root_length != image->root_dir_block_count)
+        {
+            check_error(&state, "'/': superblock says %u blocks but the chain has %u", image->root_dir_block_count, root_length);
+        }
+        state.pool = pool_create(thread_count);
+        check_dir(&state, image->root_dir_start_block, "/");
+        pool_wait(state.pool);
+        pool_destroy(state.pool);
+    }
+
+    // only the blocks the FAT says are in use can be orphans
+    size_t orphans = 0;
+    uint32_t last_block = image->block_count < image->fat_entry_count ? image->block_count : image->fat_entry_count;
+    for (uint32_t block = image->root_dir_start_block; block < last_block; block++)
+    {
+        if (image->fat[block] != FREE && image->fat[block] != RESERVED && state.owners[block] == 0)
+        {
+            if (orphans < 10)
+            {
+                printf("block %u is allocated but not in any file or directory\n", block);
+            }
+            orphans++;
+        }
+    }
+    if (orphans > 0)
+    {
+        check_error(&state, "%zu orphaned blocks", orphans);
+    }
+    free(state.owners);
+
+    printf("Checked %zu files and %zu directories (%zu blocks) with %d workers in %.3f s: %zu errors\n", state.files,
+           state.directories + 1, state.blocks, thread_count, now_seconds() - start, state.errors);
+    return state.errors > 0;
+}
+
+// fills in a directory entry time from a host time
+void set_entry_time(struct dir_entry_timedate_t *entry_time, time_t host_time)
+{
+    struct tm local;
+    localtime_r(&host_time, &local);
+    entry_time->year = htons(local.tm_year + 1900);
+    entry_time->month = local.tm_mon + 1;
+    entry_time->day = local.tm_mday;
+    entry_time->hour = local.tm_hour;
+    entry_time->minute = local.tm_min;
+    entry_time->second = local.tm_sec;
+}
+
+// This function returns the offset of an unused entry in a directory, adding a block to the end of the directory
+// if all of its entries are used. dir_entry is the entry of the directory in its parent and dir_entry_offset is
+// where it is in the image, or NULL and 0 for the root. returns 0 if the directory is full and there are no free
+// blocks left
+uint64_t get_free_dir_entry(struct fs_image *image, uint32_t start_block, struct dir_entry_t *dir_entry, uint64_t dir_entry_offset)
+{
+    struct dir_reader reader;
+    start_dir_reader(&reader, image, start_block);
+    struct dir_entry_t *entry;
+    uint64_t offset = 0;
+    while ((entry = next_dir_entry(&reader, &offset)) != NULL)
+    {
+        if ((entry->status & 1) == 0) // the first bit is set if an entry is in use
+        {
+            end_dir_reader(&reader);
+            return offset;
+        }
+    }
+    end_dir_reader(&reader);
+    uint32_t last_block = offset / image->block_size; // the last entry read is in the last block of the directory
+
+    // every entry is in use so the directory gets one more block
+    uint32_t new_block;
+    if (allocate_blocks(image, 1, &new_block) == -1)
+    {
+        return 0;
+    }
+    unsigned char *zeros = calloc(1, image->block_size);
+    if (zeros == NULL)
+    {
+        printf("ERROR: could not allocate memory\n");
+        exit(1);
+    }
+    write_image(image, block_offset(image, new_block), zeros, image->block_size);
+    free(zeros);
+    set_fat_entry(image, last_block, new_block);
+    set_fat_entry(image, new_block, LAST);
+    if (dir_entry == NULL)
+    {
+        image->root_dir_block_count++;
+        uint32_t root_dir_block_count = htonl(image->root_dir_block_count);
+        write_metadata(image, offsetof(struct superblock_t, root_dir_block_count), &root_dir_block_count, sizeof(uint32_t));
+    }
+    else
+    {
+        dir_entry->block_count = htonl(htonl(dir_entry->block_count) + 1);
+        dir_entry->size = htonl(htonl(dir_entry->size) + image->block_size);
+        write_metadata(image, dir_entry_offset, dir_entry, sizeof(struct dir_entry_t));
+    }
+    return block_offset(image, new_block);
+}
+
+// part 4
+int diskput(struct fs_image *image, int argc, char *argv[])
+{
+    // check command line arguments
+    if (argc != 2)
+    {
+        printf("ERROR: Incorrect command line arguments\n");
+        return 1;
+    }
+    if (!image->writable)
+    {
+        printf("ERROR: the image was not opened for writing\n");
+        return 1;
+    }
+
+    // opens the file being copied in
+    int read_fd = open(argv[0], O_RDONLY);
+    struct stat file_stat;
+    if (read_fd == -1 || fstat(read_fd, &file_stat) == -1 || !S_ISREG(file_stat.st_mode))
+    {
+        printf("File not found.\n");
+        if (read_fd != -1)
+        {
+            close(read_fd);
+        }
+        return 1;
+    }
+    if (file_stat.st_size > UINT32_MAX)
+    {
+        printf("ERROR: file is too big for the image\n");
+        close(read_fd);
+        return 1;
+    }
+
+    // separate directory path and file name and find the directory
+    char path[strlen(argv[1]) + 1];
+    strcpy(path, argv[1]);
+    char *directory;
+    char *file_name = split_path(path, &directory);
+    if (strlen(file_name) == 0 || strlen(file_name) >= sizeof(((struct dir_entry_t *)0)->filename))
+    {
+        printf("ERROR: file name must be between 1 and 30 characters\n");
+        close(read_fd);
+        return 1;
+    }
+    uint32_t dir_block = image->root_dir_start_block;
+    struct dir_entry_t dir_entry;
+    uint64_t dir_entry_offset = 0;
+    if (directory != NULL)
+    {
+        // the entry of the directory is needed in case the directory has to grow
+        char *parent;
+        char *dir_name = split_path(directory, &parent);
+        uint32_t parent_block = parent == NULL ? image->root_dir_start_block : goto_sub_dir(image, parent);
+        if (parent_block != LAST && strlen(dir_name) > 0)
+        {
+            dir_entry_offset = lookup_entry(image, parent_block, dir_name, 5, &dir_entry);
+            if (dir_entry_offset == 0)
+            {
+                printf("ERROR: Subdirectory '%s' not found.\n", dir_name);
+            }
+        }
+        if (parent_block == LAST || (strlen(dir_name) > 0 && dir_entry_offset == 0))
+        {
+            close(read_fd);
+            return 1;
+        }
+        dir_block = dir_entry_offset == 0 ? parent_block : htonl(dir_entry.starting_block);
+    }
+    struct dir_entry_t entry;
+    if (lookup_entry(image, dir_block, file_name, 3, &entry) != 0 || lookup_entry(image, dir_block, file_name, 5, &entry) != 0)
+    {
+        printf("ERROR: '%s' already exists.\n", file_name);
+        close(read_fd);
+        return 1;
+    }
+
+    // allocates the blocks for the file, contiguous if there is a free run big enough
+    uint32_t size = file_stat.st_size;
+    uint32_t block_count = (size + image->block_size - 1) / image->block_size;
+    uint32_t *blocks = malloc((block_count + 1) * sizeof(uint32_t));
+    if (blocks == NULL)
+    {
+        printf("ERROR: could not allocate memory\n");
+        exit(1);
+    }
+    if (allocate_blocks(image, block_count, blocks) == -1)
+    {
+        printf("ERROR: not enough free space in the image\n");
+        free(blocks);
+        close(read_fd);
+        return 1;
+    }
+
+    // reads the file straight into its blocks with one read for each contiguous run, or when the image is not
+    // memory mapped into a buffer that is written through the block device a piece of a run at a time
+    unsigned char *buffer = image->memory == NULL ? malloc(COPY_BUFFER_SIZE) : NULL;
+    uint32_t bytes_read = 0;
+    int failed = 0;
+    for (uint32_t i = 0; i < block_count && !failed;)
+    {
+        uint32_t run = 1;
+        while (i + run < block_count && blocks[i + run] == blocks[i] + run)
+        {
+            run++;
+        }
+        uint64_t offset = block_offset(image, blocks[i]);
+        uint64_t run_end = offset + (uint64_t)run * image->block_size;
+        while (offset < run_end && !failed)
+        {
+            size_t length = buffer != NULL && run_end - offset > COPY_BUFFER_SIZE ? COPY_BUFFER_SIZE : run_end - offset;
+            unsigned char *destination = buffer != NULL ? buffer : image->memory + offset;
+            size_t data_length = length > size - bytes_read ? size - bytes_read : length;
+            memset(destination + data_length, 0, length - data_length); // zeros the end of the last block
+            if (read_all_at(read_fd, destination, data_length, bytes_read) == -1)
+            {
+                failed = 1;
+            }
+            else if (buffer != NULL)
+            {
+                write_image(image, offset, buffer, length);
+            }
+            bytes_read += data_length;
+            offset += length;
+        }
+        i += run;
+    }
+    free(buffer);
+    close(read_fd);
+    if (failed)
+    {
+        printf("ERROR: could not read file\n");
+        release_blocks(image, blocks, block_count);
+        free(blocks);
+        return 1;
+    }
+
+    // links the blocks together and adds the directory entry last so the file only appears once it is complete
+    uint64_t entry_offset = get_free_dir_entry(image, dir_block, dir_entry_offset == 0 ? NULL : &dir_entry, dir_entry_offset);
+    if (entry_offset == 0)
+    {
+        printf("ERROR: not enough free space in the image\n");
+        release_blocks(image, blocks, block_count);
+        free(blocks);
+        return 1;
+    }
+    write_chain(image, blocks, block_count);
+    flush_fat(image);
+    memset(&entry, 0, sizeof(struct dir_entry_t));
+    entry.starting_block = htonl(block_count > 0 ? blocks[0] : LAST);
+    entry.block_count = htonl(block_count);
+    entry.size = htonl(size);
+    set_entry_time(&entry.create_time, time(NULL));
+    set_entry_time(&entry.modify_time, file_stat.st_mtime);
+    strcpy((char *)entry.filename, file_name);
+    memset(entry.unused, 0xFF, sizeof(entry.unused));
+    entry.status = 3;
+    write_metadata(image, entry_offset, &entry, sizeof(struct dir_entry_t));
+    dir_index_note_entry(image, dir_block, &entry, entry_offset);
+    free(blocks);
+    return 0;
+}
+
+// Image builder
+// mkimage reads the whole host directory tree first so the size of the image is known before anything is
+// written. Every directory is followed by the files in it, each file is one contiguous run and the blocks are
+// given out in the same order the tree is written in, so the image is written front to back: the superblock and
+// FAT with one write, then each directory block and file in turn with file data copied by copy_file_range.
+#define MKIMAGE_ROOT_DIR_BLOCKS 8
+
+struct mk_node
+{
+    char name[31];
+    int is_dir;
+    uint64_t size;
+    time_t modify_time;
+    char *host_path;
+    uint32_t start_block;
+    uint32_t block_count;
+    struct mk_node *children;
+    size_t child_count;
+};
+
+int compare_mk_nodes(const void *a, const void *b)
+{
+    return strcmp(((const struct mk_node *)a)->name, ((const struct mk_node *)b)->name);
+}
+
+// This function reads the entries of a host directory into node and then each of its subdirectories
+// returns 0 on success and -1 after printing an error
+int mk_scan(struct mk_node *node)
+{
+    DIR *dir = opendir(node->host_path);
+    if (dir == NULL)
+    {
+        printf("ERROR: could not open directory '%s'\n", node->host_path);
+        return -1;
+    }
+    size_t capacity = 0;
+    struct dirent *dirent;
+    while ((dirent = readdir(dir)) != NULL)
+    {
+        if (!is_safe_name(dirent->d_name))
+        {
+            continue;
+        }
+        char *path = malloc(strlen(node->host_path) + strlen(dirent->d_name) + 2);
+        if (path == NULL)
+        {
+            printf("ERROR: could not allocate memory\n");
+            exit(1);
+        }
+        sprintf(path, "%s/%s", node->host_path, dirent->d_name);
+        struct stat host_stat;
+        if (lstat(path, &host_stat) == -1 || (!S_ISREG(host_stat.st_mode) && !S_ISDIR(host_stat.st_mode)))
+        {
+            printf("Skipping '%s', it is not a file or directory\n", path);
+            free(path);
+            continue;
+        }
+        if (strlen(dirent->d_name) > 30 || (S_ISREG(host_stat.st_mode) && host_stat.st_size > UINT32_MAX))
+        {
+            printf("ERROR: '%s' has a name longer than 30 characters or is too big for the image\n", path);
+            free(path);
+            closedir(dir);
+            return -1;
+        }
+        if (node->child_count == capacity)
+        {
+            capacity = capacity == 0 ? 16 : capacity * 2;
+            node->children = realloc(node->children, capacity * sizeof(struct mk_node));
+            if (node->children == NULL)
+            {
+                printf("ERROR: could not allocate memory\n");
+                exit(1);
+            }
+        }
+        struct mk_node *child = &node->children[node->child_count++];
+        memset(child, 0, sizeof(struct mk_node));
+        strcpy(child->name, dirent->d_name);
+        child->is_dir = S_ISDIR(host_stat.st_mode);
+        child->size = child->is_dir ? 0 : host_stat.st_size;
+        child->modify_time = host_stat.st_mtime;
+        child->host_path = path;
+    }
+    closedir(dir);
+    // sorted so the same tree always makes the same image
+    qsort(node->children, node->child_count, sizeof(struct mk_node), compare_mk_nodes);
+    for (size_t i = 0; i < node->child_count; i++)
+    {
+        if (node->children[i].is_dir && mk_scan(&node->children[i]) == -1)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// This function gives out the blocks of a directory, then of the files in it and then of each subdirectory,
+// next_block is where the next run starts. adds up the files and directories and bytes of file data in totals
+void mk_layout(struct mk_node *node, size_t block_size, uint32_t min_blocks, uint64_t *next_block, uint64_t *totals)
+{
+    size_t entries_per_block = block_size / sizeof(struct dir_entry_t);
+    uint64_t blocks = (node->child_count + entries_per_block - 1) / entries_per_block;
+    node->block_count = blocks < min_blocks ? min_blocks : blocks;
+    node->size = (uint64_t)node->block_count * block_size;
+    node->start_block = *next_block;
+    *next_block += node->block_count;
+    totals[1]++;
+    for (size_t i = 0; i < node->child_count; i++)
+    {
+        struct mk_node *child = &node->children[i];
+        if (!child->is_dir)
+        {
+            child->block_count = (child->size + block_size - 1) / block_size;
+            child->start_block = child->block_count > 0 ? *next_block : LAST;
+            *next_block += child->block_count;
+            totals[0]++;
+            totals[2] += child->size;
+        }
+    }
+    for (size_t i = 0; i < node->child_count; i++)
+    {
+        if (node->children[i].is_dir)
+        {
+            mk_layout(&node->children[i], block_size, 1, next_block, totals);
+        }
+    }
+}
+
+// links the blocks of a node into one chain
+void mk_chain(uint32_t *fat, struct mk_node *node)
+{
+    for (uint32_t i = 0; i < node->block_count; i++)
+    {
+        fat[node->start_block + i] = htonl(i + 1 < node->block_count ? node->start_block + i + 1 : LAST);
+    }
+}
+
+// copies a host file to its blocks in the image, returns 0 on success and -1 after printing an error
+int mk_copy_file(struct mk_node *node, int out_fd, size_t block_size, unsigned char *buffer)
+{
+    int in_fd = open(node->host_path, O_RDONLY);
+    if (in_fd == -1)
+    {
+        printf("ERROR: could not open '%s'\n", node->host_path);
+        return -1;
+    }
+    loff_t out_offset = (loff_t)node->start_block * block_size;
+    uint64_t remaining = node->size;
+    int use_copy_range = 1;
+    while (remaining > 0)
+    {
+        ssize_t copied;
+        if (use_copy_range)
+        {
+            copied = copy_file_range(in_fd, NULL, out_fd, &out_offset, remaining, 0);
+            if (copied == -1 && errno != EINTR)
+            {
+                use_copy_range = 0; // not supported between these file systems, copied through the buffer instead
+                continue;
+            }
+        }
+        else
+        {
+            copied = read(in_fd, buffer, remaining < COPY_BUFFER_SIZE ? remaining : COPY_BUFFER_SIZE);
+            if (copied > 0)
+            {
+                if (pwrite_all(out_fd, buffer, copied, out_offset) == -1)
+                {
+                    break;
+                }
+                out_offset += copied;
+            }
+            else if (copied == -1 && errno != EINTR)
+            {
+                break;
+            }
+        }
+        if (copied == 0)
+        {
+            break; // the file got shorter since it was scanned
+        }
+        if (copied > 0)
+        {
+            remaining -= copied;
+        }
+    }
+    close(in_fd);
+    if (remaining > 0)
+    {
+        printf("ERROR: could not copy '%s'\n", node->host_path);
+        return -1;
+    }
+    return 0;
+}
+
+// This function writes the blocks of a directory and the files in it, then each subdirectory, in the same order
+// mk_layout gave them out. returns 0 on success and -1 after printing an error
+int mk_write(struct mk_node *node, int out_fd, size_t block_size, unsigned char *buffer)
+{
+    size_t dir_size = (size_t)node->block_count * block_size;
+    struct dir_entry_t *entries = calloc(1, dir_size);
+    if (entries == NULL)
+    {
+        printf("ERROR: could not allocate memory\n");
+        exit(1);
+    }
+    time_t now = time(NULL);
+    for (size_t i = 0; i < node->child_count; i++)
+    {
+        struct mk_node *child = &node->children[i];
+        struct dir_entry_t *entry = &entries[i];
+        entry->status = child->is_dir ? 5 : 3;
+        entry->starting_block = htonl(child->start_block);
+        entry->block_count = htonl(child->block_count);
+        entry->size = htonl(child->size);
+        set_entry_time(&entry->create_time, now);
+        set_entry_time(&entry->modify_time, child->modify_time);
+        strcpy((char *)entry->filename, child->name);
+        memset(entry->unused, 0xFF, sizeof(entry->unused));
+    }
+    int status = pwrite_all(out_fd, (unsigned char *)entries, dir_size, (off_t)node->start_block * block_size);
+    free(entries);
+    if (status == -1)
+    {
+        printf("ERROR: could not write the image\n");
+        return -1;
+    }
+    for (size_t i = 0; i < node->child_count; i++)
+    {
+        if (!node->children[i].is_dir && mk_copy_file(&node->children[i], out_fd, block_size, buffer) == -1)
+        {
+            return -1;
+        }
+    }
+    for (size_t i = 0; i < node->child_count; i++)
+    {
+        if (node->children[i].is_dir && mk_write(&node->children[i], out_fd, block_size, buffer) == -1)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// adds every node to the FAT
+void mk_fill_fat(uint32_t *fat, struct mk_node *node)
+{
+    mk_chain(fat, node);
+    for (size_t i = 0; i < node->child_count; i++)
+    {
+        if (node->children[i].is_dir)
+        {
+            mk_fill_fat(fat, &node->children[i]);
+        }
+        else
+        {
+            mk_chain(fat, &node->children[i]);
+        }
+    }
+}
+
+void free_mk_node(struct mk_node *node)
+{
+    for (size_t i = 0; i < node->child_count; i++)
+    {
+        free_mk_node(&node->children[i]);
+    }
+    free(node->children);
+    free(node->host_path);
+}
+
+// mkimage [-b block size] [-n block count] <host directory> <image>
+// makes a new image holding a copy of a host directory tree, by default with a tenth more blocks than the tree
+// needs free for later puts
+int mkimage(int argc, char *argv[])
+{
+    size_t block_size = 512;
+    uint64_t block_count = 0;
+    int arg = 1;
+    for (; arg + 1 < argc && argv[arg][0] == '-'; arg += 2)
+    {
+        if (strcmp(argv[arg], "-b") == 0)
+        {
+            block_size = strtoul(argv[arg + 1], NULL, 10);
+        }
+        else if (strcmp(argv[arg], "-n") == 0)
+        {
+            block_count = strtoull(argv[arg + 1], NULL, 10);
+        }
+        else
+        {
+            break;
+        }
+    }
+    if (argc - arg != 2)
+    {
+        printf("Usage: mkimage [-b block size] [-n block count] <host directory> <image>\n");
+        return 1;
+    }
+    if (block_size < 512 || block_size > 32768 || (block_size & (block_size - 1)) != 0)
+    {
+        printf("ERROR: block size must be a power of 2 from 512 to 32768\n");
+        return 1;
+    }
+
+    double start = now_seconds();
+    struct mk_node root;
+    memset(&root, 0, sizeof(root));
+    root.is_dir = 1;
+    root.host_path = strdup(argv[arg]);
+    if (mk_scan(&root) == -1)
+    {
+        free_mk_node(&root);
+        return 1;
+    }
+
+    // the FAT has to hold an entry for every block including its own, so its size is found by trying until it fits
+    uint64_t totals[3] = {0, 0, 0}; // files, directories, bytes
+    uint64_t data_blocks = 0;
+    mk_layout(&root, block_size, MKIMAGE_ROOT_DIR_BLOCKS, &data_blocks, totals);
+    uint64_t wanted = block_count;
+    uint64_t fat_blocks = 1;
+    while (1)
+    {
+        uint64_t needed = 1 + fat_blocks + data_blocks;
+        uint64_t total = wanted > 0 ? wanted : needed + data_blocks / 10 + 64;
+        uint64_t fat_needed = (total * FAT_ENTRY_SIZE + block_size - 1) / block_size;
+        if (fat_needed <= fat_blocks)
+        {
+            // without -n the image takes every block its FAT can describe, so no entry is left over
+            block_count = wanted > 0 ? total : fat_blocks * block_size / FAT_ENTRY_SIZE;
+            if (total < needed)
+            {
+                printf("ERROR: %lu blocks are needed for this tree\n", (unsigned long)needed);
+                free_mk_node(&root);
+                return 1;
+            }
+            break;
+        }
+        fat_blocks = fat_needed;
+    }
+    if (block_count > UINT32_MAX - 1)
+    {
+        printf("ERROR: the tree is too big for one image\n");
+        free_mk_node(&root);
+        return 1;
+    }
+    // the blocks were given out from 0, everything moves up past the superblock and FAT
+    uint64_t first_data_block = 1 + fat_blocks;
+    memset(totals, 0, sizeof(totals));
+    data_blocks = first_data_block;
+    mk_layout(&root, block_size, MKIMAGE_ROOT_DIR_BLOCKS, &data_blocks, totals);
+
+    // the superblock and FAT are built in one buffer and written with one write
+    size_t header_size = first_data_block * block_size;
+    unsigned char *header = calloc(1, header_size);
+    unsigned char *buffer = malloc(COPY_BUFFER_SIZE);
+    if (header == NULL || buffer == NULL)
+    {
+        printf("ERROR: could not allocate memory\n");
+        exit(1);
+    }
+    struct superblock_t *superblock = (struct superblock_t *)header;
+    memcpy(superblock->fs_id, "CSC360FS", sizeof(superblock->fs_id));
+    superblock->block_size = htons(block_size);
+    superblock->file_system_block_count = htonl(block_count);
+    superblock->fat_start_block = htonl(1);
+    superblock->fat_block_count = htonl(fat_blocks);
+    superblock->root_dir_start_block = htonl(root.start_block);
+    superblock->root_dir_block_count = htonl(root.block_count);
+    uint32_t *fat = (uint32_t *)(header + block_size);
+    for (uint64_t i = 0; i < first_data_block; i++)
+    {
+        fat[i] = htonl(RESERVED);
+    }
+    // entries past the last block only pad out the FAT's last block and must never be handed out
+    for (uint64_t i = block_count; i < fat_blocks * block_size / FAT_ENTRY_SIZE; i++)
+    {
+        fat[i] = htonl(RESERVED);
+    }
+    mk_fill_fat(fat, &root);
+
+    int out_fd = open(argv[arg + 1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int status = 0;
+    if (out_fd == -1 || ftruncate(out_fd, (off_t)block_count * block_size) == -1 || pwrite_all(out_fd, header, header_size, 0) == -1)
+    {
+        printf("ERROR: could not write '%s'\n", argv[arg + 1]);
+        status = 1;
+    }
+    else if (mk_write(&root, out_fd, block_size, buffer) == -1 || fsync(out_fd) == -1)
+    {
+        status = 1;
+    }
+    if (out_fd != -1)
+    {
+        close(out_fd);
+    }
+    free(header);
+    free(buffer);
+    free_mk_node(&root);
+    if (status == 0)
+    {
+        double time = now_seconds() - start;
+        printf("Wrote %lu files and %lu directories (%.2f MB) into %lu blocks of %zu bytes in %.3f s: %.2f MB/s\n",
+               (unsigned long)totals[0], (unsigned long)totals[1], totals[2] / (1024.0 * 1024.0), (unsigned long)block_count,
+               block_size, time, totals[2] / (1024.0 * 1024.0) / time);
+    }
+    return status;
+}
+
+// Random access reads
+// Reading from the middle of a file means following its chain from the start, one FAT lookup per block. The
+// first time a chain is read far enough into, it is walked once and every SKIP_INTERVAL-th block is kept in a
+// skip list, so later seeks start from the closest kept block and take at most SKIP_INTERVAL - 1 lookups.
+#define SKIP_BUCKETS 1024
+
+struct skip_list
+{
+    uint32_t start_block; // the chain this list is for
+    uint32_t count;
+    uint32_t *blocks; // blocks[i] is block number i * interval of the chain
+    struct skip_list *next;
+};
+
+struct skip_index
+{
+    pthread_mutex_t mutex;
+    uint32_t interval; // 0 turns the index off so every seek walks from the start
+    struct skip_list *buckets[SKIP_BUCKETS];
+};
+
+struct skip_index *make_skip_index(uint32_t interval)
+{
+    struct skip_index *index = calloc(1, sizeof(struct skip_index));
+    if (index == NULL)
+    {
+        printf("ERROR: could not allocate memory\n");
+        exit(1);
+    }
+    index->interval = interval;
+    pthread_mutex_init(&index->mutex, NULL);
+    return index;
+}
+
+// forgets every skip list, for when chains are moved around in the image
+void clear_skip_index(struct skip_index *index)
+{
+    if (index == NULL)
+    {
+        return;
+    }
+    pthread_mutex_lock(&index->mutex);
+    for (size_t i = 0; i < SKIP_BUCKETS; i++)
+    {
+        while (index->buckets[i] != NULL)
+        {
+            struct skip_list *list = index->buckets[i];
+            index->buckets[i] = list->next;
+            free(list->blocks);
+            free(list);
+        }
+    }
+    pthread_mutex_unlock(&index->mutex);
+}
+
+void free_skip_index(struct skip_index *index)
+{
+    if (index != NULL)
+    {
+        clear_skip_index(index);
+        pthread_mutex_destroy(&index->mutex);
+        free(index);
+    }
+}
+
+// This function returns the skip list of the chain starting at start_block, walking the chain to make it the
+// first time. A chain longer than the FAT must loop so the walk stops there
+struct skip_list *get_skip_list(struct fs_image *image, uint32_t start_block)
+{
+    struct skip_index *index = image->skip_index;
+    pthread_mutex_lock(&index->mutex);
+    struct skip_list **bucket = &index->buckets[start_block % SKIP_BUCKETS];
+    struct skip_list *list = *bucket;
+    while (list != NULL && list->start_block != start_block)
+    {
+        list = list->next;
+    }
+    if (list == NULL)
+    {
+        list = calloc(1, sizeof(struct skip_list));
+        if (list == NULL)
+        {
+            printf("ERROR: could not allocate memory\n");
+            exit(1);
+        }
+        size_t capacity = 16;
+        list->blocks = malloc(capacity * sizeof(uint32_t));
+        if (list->blocks == NULL)
+        {
+            printf("ERROR: could not allocate memory\n");
+            exit(1);
+        }
+        list->start_block = start_block;
+        uint32_t block = start_block;
+        for (size_t i = 0; block != LAST && block < image->fat_entry_count && i < image->fat_entry_count; i++)
+        {
+            if (i % index->interval == 0)
+            {
+                if (list->count == capacity)
+                {
+                    capacity *= 2;
+                    list->blocks = realloc(list->blocks, capacity * sizeof(uint32_t));
+                    if (list->blocks == NULL)
+                    {
+                        printf("ERROR: could not allocate memory\n");
+                        exit(1);
+                    }
+                }
+                list->blocks[list->count++] = block;
+            }
+            block = get_next_block(image, block);
+        }
+        list->next = *bucket;
+        *bucket = list;
+    }
+    pthread_mutex_unlock(&index->mutex);
+    return list;
+}
+
+// returns the block holding the block at block_index in the chain starting at start_block, or LAST if the chain
+// is not that long
+uint32_t seek_chain(struct fs_image *image, uint32_t start_block, uint32_t block_index)
+{
+    uint32_t block = start_block;
+    uint32_t i = 0;
+    uint32_t interval = image->skip_index->interval;
+    if (interval > 0 && block_index >= interval && block != LAST)
+    {
+        struct skip_list *list = get_skip_list(image, start_block);
+        if (block_index / interval >= list->count)
+        {
+            return LAST;
+        }
+        block = list->blocks[block_index / interval];
+        i = block_index / interval * interval;
+    }
+    for (; i < block_index && block != LAST; i++)
+    {
+        block = get_next_block(image, block);
+    }
+    return block;
+}
+
+// This function reads up to length bytes of the file whose chain starts at start_block into buffer, starting at
+// offset. the blocks before offset are skipped with seek_chain and each run of contiguous blocks after that is
+// read at once. returns how many bytes were read, which is less than length past the end of the file
+size_t read_chain_range(struct fs_image *image, uint32_t start_block, uint32_t size, uint64_t offset, void *buffer, size_t length)
+{
+    if (offset >= size)
+    {
+        return 0;
+    }
+    length = length > size - offset ? size - offset : length;
+    unsigned char *out = buffer;
+    uint32_t block = seek_chain(image, start_block, offset / image->block_size);
+    uint64_t skip = offset % image->block_size;
+    size_t done = 0;
+    while (done < length && block != LAST)
+    {
+        uint32_t run = 1;
+        uint32_t next = get_next_block(image, block);
+        while (next == block + run && (uint64_t)run * image->block_size - skip < length - done)
+        {
+            run++;
+            next = get_next_block(image, next);
+        }
+        uint64_t part = (uint64_t)run * image->block_size - skip;
+        part = part > length - done ? length - done : part;
+        read_image(image, block_offset(image, block) + skip, out + done, part);
+        done += part;
+        skip = 0;
+        block = next;
+    }
+    return done;
+}
+
+// This function writes length bytes of a file starting at offset to a file descriptor, the blocks before offset
+// are skipped with seek_chain and each run of contiguous blocks after that is written at once
+// returns 0 on success and -1 on an error or if the chain ends early
+int write_file_range(struct fs_image *image, uint32_t start_block, uint64_t offset, uint64_t length, int out_fd)
+{
+    uint32_t block = seek_chain(image, start_block, offset / image->block_size);
+    uint64_t skip = offset % image->block_size;
+    while (length > 0 && block != LAST)
+    {
+        uint32_t run = 1;
+        uint32_t next = get_next_block(image, block);
+        while (next == block + run && (uint64_t)run * image->block_size - skip < length)
+        {
+            run++;
+            next = get_next_block(image, next);
+        }
+        uint64_t part = (uint64_t)run * image->block_size - skip;
+        part = part > length ? length : part;
+        if (write_image_range(image, block_offset(image, block) + skip, part, out_fd) == -1)
+        {
+            return -1;
+        }
+        length -= part;
+        skip = 0;
+        block = next;
+    }
+    return length == 0 ? 0 : -1;
+}
+
+// This function finds the entry at a path without printing anything, the last part of the path can be a file or
+// a directory. returns the offset of the entry and copies it into entry, or returns 0 if there is none (the root
+// directory has no entry so it is 0 as well)
+uint64_t resolve_path(struct fs_image *image, char *path, struct dir_entry_t *entry)
+{
+    char copy[strlen(path) + 1];
+    strcpy(copy, path);
+    uint32_t dir_block = image->root_dir_start_block;
+    uint64_t offset = 0;
+    char *saveptr;
+    char *token = strtok_r(copy, "/", &saveptr);
+    while (token != NULL)
+    {
+        char *next = strtok_r(NULL, "/", &saveptr);
+        offset = lookup_entry(image, dir_block, token, 5, entry);
+        if (offset == 0 && next == NULL)
+        {
+            offset = lookup_entry(image, dir_block, token, 3, entry);
+        }
+        if (offset == 0)
+        {
+            return 0;
+        }
+        dir_block = htonl(entry->starting_block);
+        token = next;
+    }
+    return offset;
+}
+
+// returns 1 if a path is the root directory
+int is_root_path(char *path)
+{
+    return strspn(path, "/") == strlen(path);
+}
+
+// This function reads up to length bytes of the file at path into buffer starting at offset in the file
+// returns how many bytes were read, which is less than length at the end of the file, or -1 if there is no file
+ssize_t read_file(struct fs_image *image, char *path, uint64_t offset, void *buffer, size_t length)
+{
+    struct dir_entry_t entry;
+    if (resolve_path(image, path, &entry) == 0 || entry.status != 3)
+    {
+        return -1;
+    }
+    return read_chain_range(image, htonl(entry.starting_block), htonl(entry.size), offset, buffer, length);
+}
+
+// Server
+// fatfsd keeps one image open and answers requests from other programs over a unix domain socket so they do not
+// have to start a new process and map the image for every list or read. Each client gets its own thread, the
+// decoded FAT is shared between them and directory lookups go through the directory index, which keeps the offset
+// of every entry it has seen. With FATFS_IO=pread or direct the blocks read are kept in the block cache as well.
+// Requests are one line each and every reply starts with a line of "OK <length>" followed by length bytes or with
+// a line of "ERR <message>":
+//   LIST [-f text|json|csv] <directory>   the listing of a directory like disklist
+//   STAT <path>                           the entry of a file or directory as one json line
+//   READ <path> <offset> <length>         up to length bytes of a file starting at offset
+//   QUIT                                  closes the connection
+
+// sends a reply line, returns 0 on success and -1 if the client went away
+int send_reply(int fd, const char *format, ...) __attribute__((format(printf, 2, 3)));
+int send_reply(int fd, const char *format, ...)
+{
+    char line[256];
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    return write_all(fd, (unsigned char *)line, length < (int)sizeof(line) ? length : (int)sizeof(line) - 1);
+}
+
+// answers one request, returns -1 if the connection should be closed
+int serve_request(struct fs_image *image, int fd, int argc, char *argv[])
+{
+    struct dir_entry_t entry;
+    if (strcmp(argv[0], "QUIT") == 0)
+    {
+        return -1;
+    }
+    if (strcmp(argv[0], "LIST") == 0 && (argc == 2 || (argc == 4 && strcmp(argv[1], "-f") == 0)))
+    {
+        enum list_format format = LIST_TEXT;
+        if (argc == 4)
+        {
+            format = strcmp(argv[2], "json") == 0 ? LIST_JSON : strcmp(argv[2], "csv") == 0 ? LIST_CSV : LIST_TEXT;
+        }
+        char *path = argv[argc - 1];
+        uint32_t dir_block = image->root_dir_start_block;
+        if (!is_root_path(path))
+        {
+            if (resolve_path(image, path, &entry) == 0 || entry.status != 5)
+            {
+                return send_reply(fd, "ERR no directory '%s'\n", path);
+            }
+            dir_block = htonl(entry.starting_block);
+        }
+        struct output_buffer out = {NULL, 0, 0, -1, 0};
+        list_dir_to(image, dir_block, format, &out);
+        int status = send_reply(fd, "OK %zu\n", out.length);
+        if (status == 0)
+        {
+            status = write_all(fd, (unsigned char *)out.data, out.length);
+        }
+        free(out.data);
+        return status;
+    }
+    if (strcmp(argv[0], "STAT") == 0 && argc == 2)
+    {
+        if (resolve_path(image, argv[1], &entry) == 0)
+        {
+            return send_reply(fd, "ERR no file or directory '%s'\n", argv[1]);
+        }
+        struct output_buffer out = {NULL, 0, 0, -1, 0};
+        output_dir_entry(&out, &entry, LIST_JSON);
+        int status = send_reply(fd, "OK %zu\n", out.length);
+        if (status == 0)
+        {
+            status = write_all(fd, (unsigned char *)out.data, out.length);
+        }
+        free(out.data);
+        return status;
+    }
+    if (strcmp(argv[0], "READ") == 0 && argc == 4)
+    {
+        char *end_offset, *end_length;
+        unsigned long long offset = strtoull(argv[2], &end_offset, 10);
+        unsigned long long length = strtoull(argv[3], &end_length, 10);
+        if (*end_offset != '\0' || *end_length != '\0')
+        {
+            return send_reply(fd, "ERR offset and length must be numbers\n");
+        }
+        if (resolve_path(image, argv[1], &entry) == 0 || entry.status != 3)
+        {
+            return send_reply(fd, "ERR no file '%s'\n", argv[1]);
+        }
+        uint64_t size = htonl(entry.size);
+        uint64_t available = offset < size ? size - offset : 0;
+        length = length < available ? length : available;
+        if (send_reply(fd, "OK %llu\n", length) == -1)
+        {
+            return -1;
+        }
+        // the length was already promised so a broken chain has to close the connection
+        return write_file_range(image, htonl(entry.starting_block), offset, length, fd);
+    }
+    return send_reply(fd, "ERR unknown request '%s'\n", argv[0]);
+}
+
+struct client
+{
+    struct fs_image *image;
+    int fd;
+};
+
+// reads requests from one client until it quits or goes away
+void *serve_client(void *arg)
+{
+    struct client *client = arg;
+    FILE *input = fdopen(client->fd, "r");
+    char *line = NULL;
+    size_t line_size = 0;
+    while (input != NULL && getline(&line, &line_size, input) != -1)
+    {
+        char *args[MAX_COMMAND_ARGS];
+        int arg_count = 0;
+        char *saveptr;
+        char *token = strtok_r(line, " \t\r\n", &saveptr);
+        while (token != NULL && arg_count < MAX_COMMAND_ARGS)
+        {
+            args[arg_count++] = token;
+            token = strtok_r(NULL, " \t\r\n", &saveptr);
+        }
+        if (arg_count > 0 && serve_request(client->image, client->fd, arg_count, args) == -1)
+        {
+            break;
+        }
+    }
+    free(line);
+    if (input != NULL)
+    {
+        fclose(input);
+    }
+    else
+    {
+        close(client->fd);
+    }
+    free(client);
+    return NULL;
+}
+
+volatile sig_atomic_t server_stopping = 0;
+
+void stop_server(int signal_number)
+{
+    (void)signal_number;
+    server_stopping = 1;
+}
+
+// fatfsd <image> <socket path>
+// serves the image read only on the socket until it gets SIGINT or SIGTERM
+int fatfsd(int argc, char *argv[])
+{
+    if (argc != 3)
+    {
+        printf("Usage: fatfsd <image> <socket path>\n");
+        return 1;
+    }
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(argv[2]) >= sizeof(address.sun_path))
+    {
+        printf("ERROR: socket path is too long\n");
+        return 1;
+    }
+    strcpy(address.sun_path, argv[2]);
+
+    struct fs_image *image = open_image(argv[1], 0);
+    enable_dir_index(image);
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(argv[2]);
+    if (listen_fd == -1 || bind(listen_fd, (struct sockaddr *)&address, sizeof(address)) == -1 || listen(listen_fd, 64) == -1)
+    {
+        printf("ERROR: could not listen on '%s'\n", argv[2]);
+        close_image(image);
+        return 1;
+    }
+
+    // no SA_RESTART so accept returns when the server is told to stop, and a client going away mid reply is
+    // an error on the write instead of killing the server
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = stop_server;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+    printf("Serving %s on %s\n", argv[1], argv[2]);
+    fflush(stdout);
+
+    pthread_attr_t attributes;
+    pthread_attr_init(&attributes);
+    pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+    while (!server_stopping)
+    {
+        int client_fd = accept(listen_fd, NULL, NULL);
+        if (client_fd == -1)
+        {
+            if (errno != EINTR && errno != ECONNABORTED)
+            {
+                printf("ERROR: could not accept a connection\n");
+                break;
+            }
+            continue;
+        }
+        struct client *client = malloc(sizeof(struct client));
+        pthread_t thread;
+        if (client == NULL)
+        {
+            close(client_fd);
+            continue;
+        }
+        client->image = image;
+        client->fd = client_fd;
+        if (pthread_create(&thread, &attributes, serve_client, client) != 0)
+        {
+            close(client_fd);
+            free(client);
+        }
+    }
+    pthread_attr_destroy(&attributes);
+    close(listen_fd);
+    unlink(argv[2]);
+    // clients that are still connected may be using the image so it is left for the process exit to clean up
+    return 0;
+}
+
+// Benchmarks
+// These are run with ./fatbench <benchmark> [arguments] and print their results as a table
+
+// small deterministic random number generator so benchmark images are the same every run
+uint32_t bench_random(uint64_t *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return (uint32_t)(*state >> 32);
+}
+
+#define BENCH_ROOT_DIR_BLOCKS 8
+
+// builds an image in memory with a superblock, the FAT right after it and an empty root directory
+// if metadata_only is set the data blocks are not allocated, which is enough for benchmarks that only walk the FAT
+struct fs_image *make_memory_image(uint32_t block_count, size_t block_size, int metadata_only)
+{
+    uint32_t fat_blocks = ((size_t)block_count * FAT_ENTRY_SIZE + block_size - 1) / block_size;
+    uint32_t root_start = 1 + fat_blocks;
+    uint32_t data_start = root_start + BENCH_ROOT_DIR_BLOCKS;
+    if (data_start >= block_count)
+    {
+        printf("ERROR: image is too small\n");
+        exit(1);
+    }
+
+    struct fs_image *image = calloc(1, sizeof(struct fs_image));
+    image->fd = -1;
+    image->writable = 1;
+    image->device = &memory_device;
+    image->size = (off_t)(metadata_only ? data_start : block_count) * block_size;
+    image->memory = calloc(1, image->size);
+    if (image->memory == NULL)
+    {
+        printf("ERROR: could not allocate memory\n");
+        exit(1);
+    }
+
+    struct superblock_t *superblock = (struct superblock_t *)image->memory;
+    memcpy(superblock->fs_id, "CSC360FS", sizeof(superblock->fs_id));
+    superblock->block_size = htons(block_size);
+    superblock->file_system_block_count = htonl(block_count);
+    superblock->fat_start_block = htonl(1);
+    superblock->fat_block_count = htonl(fat_blocks);
+    superblock->root_dir_start_block = htonl(root_start);
+    superblock->root_dir_block_count = htonl(BENCH_ROOT_DIR_BLOCKS);
+    decode_image(image);
+
+    // the superblock and FAT are reserved and the root directory is one chain
+    for (uint32_t i = 0; i < root_start; i++)
+    {
+        set_fat_entry(image, i, RESERVED);
+    }
+    for (uint32_t i = root_start; i < data_start; i++)
+    {
+        set_fat_entry(image, i, i + 1 == data_start ? LAST : i + 1);
+    }
+    flush_fat(image);
+    image->skip_index = make_skip_index(SKIP_INTERVAL);
+    return image;
+}
+
+// the chain walk step fs.c used before the FAT was cached, kept so the benchmark can compare against it
+uint32_t get_next_block_mapped(unsigned char *base_file_memory, struct superblock_t *superblock, uint32_t entry_num)
+{
+    size_t start_of_fat = htonl(superblock->fat_start_block) * htons(superblock->block_size);
+    unsigned char *fat_pointer = base_file_memory + start_of_fat; // moves to start of FAT
+    fat_pointer += (uint32_t)(entry_num * sizeof(uint32_t));      // moves to entry of the fat correlating to the next entry
+    return htonl(*((uint32_t *)fat_pointer));
+}
+
+// times walking one chain through every data block of the image, laid out in order or shuffled
+void bench_chain_layout(uint32_t block_count, int shuffled)
+{
+    struct fs_image *image = make_memory_image(block_count, 512, 1);
+    uint32_t data_start = image->root_dir_start_block + image->root_dir_block_count;
+    uint32_t chain_length = block_count - data_start;
+
+    uint32_t *order = malloc(chain_length * sizeof(uint32_t));
+    for (uint32_t i = 0; i < chain_length; i++)
+    {
+        order[i] = data_start + i;
+    }
+    uint64_t seed = 0x9E3779B97F4A7C15ULL;
+    for (uint32_t i = chain_length - 1; shuffled && i > 0; i--)
+    {
+        uint32_t j = bench_random(&seed) % (i + 1);
+        uint32_t temp = order[i];
+        order[i] = order[j];
+        order[j] = temp;
+    }
+    uint32_t *fat_memory = (uint32_t *)(image->memory + fat_entry_offset(image, 0));
+    for (uint32_t i = 0; i < chain_length; i++)
+    {
+        fat_memory[order[i]] = htonl(i + 1 < chain_length ? order[i + 1] : LAST);
+    }
+
+    // decoding is the one time cost paid when an image is opened
+    double start = now_seconds();
+    decode_fat_entries(image->fat, fat_memory, image->fat_entry_count);
+    double decode_time = now_seconds() - start;
+
+    uint64_t checksum = 0;
+    start = now_seconds();
+    for (uint32_t block = order[0]; block != LAST; block = get_next_block_mapped(image->memory, (struct superblock_t *)image->memory, block))
+    {
+        checksum += block;
+    }
+    double mapped_time = now_seconds() - start;
+
+    start = now_seconds();
+    for (uint32_t block = order[0]; block != LAST; block = get_next_block(image, block))
+    {
+        checksum -= block;
+    }
+    double cached_time = now_seconds() - start;
+
+    printf("%-10s %12u %16.2f %16.2f %16.2f\n", shuffled ? "shuffled" : "sequential", chain_length,
+           mapped_time * 1e9 / chain_length, cached_time * 1e9 / chain_length, decode_time * 1e9 / image->fat_entry_count);
+    if (checksum != 0)
+    {
+        printf("ERROR: the mapped and cached walks visited different blocks\n");
+    }
+    free(order);
+    close_image(image);
+}
+
+// fatbench chain [block count] compares walking a chain through the memory map with walking the decoded FAT
+int bench_chain(int argc, char *argv[])
+{
+    uint32_t block_count = argc > 0 ? strtoul(argv[0], NULL, 10) : 1u << 22;
+    printf("%-10s %12s %16s %16s %16s\n", "layout", "blocks", "mapped ns/block", "cached ns/block", "decode ns/entry");
+    bench_chain_layout(block_count, 0);
+    bench_chain_layout(block_count, 1);
+    return 0;
+}
+
+// the loop diskinfo used before counting was vectorized, kept so the benchmark can compare against it
+void count_fat_htonl(const uint32_t *fat, size_t count, struct fat_counts *counts)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        uint32_t cur_entry = htonl(fat[i]);
+        if (cur_entry == FREE)
+        {
+            counts->free++;
+        }
+        else if (cur_entry == RESERVED)
+        {
+            counts->reserved++;
+        }
+        else
+        {
+            counts->allocated++;
+        }
+    }
+}
+
+// times one counting function over a FAT and prints its speed, returns the counts so they can be compared
+struct fat_counts bench_count_kernel(char *name, fat_count_fn counter, const uint32_t *fat, size_t count)
+{
+    struct fat_counts counts = {0, 0, 0};
+    double start = now_seconds();
+    counter(fat, count, &counts);
+    double time = now_seconds() - start;
+    printf("%-8s %12zu %12.3f %12.2f %12zu %12zu %12zu\n", name, count, time * 1e9 / count,
+           count * FAT_ENTRY_SIZE / time / 1e9, counts.free, counts.reserved, counts.allocated);
+    return counts;
+}
+
+// fatbench count [entry counts...] times each way of counting FAT entries over synthetic FATs
+// the FATs are mostly free with some reserved entries and chains of allocated blocks mixed in
+int bench_count(int argc, char *argv[])
+{
+    size_t default_sizes[] = {1000000, 10000000, 100000000};
+    size_t size_count = argc > 0 ? argc : 3;
+    printf("%-8s %12s %12s %12s %12s %12s %12s\n", "kernel", "entries", "ns/entry", "GB/s", "free", "reserved", "allocated");
+    for (size_t s = 0; s < size_count; s++)
+    {
+        size_t count = argc > 0 ? strtoul(argv[s], NULL, 10) : default_sizes[s];
+        uint32_t *fat = malloc(count * sizeof(uint32_t));
+        if (fat == NULL)
+        {
+            printf("ERROR: could not allocate memory\n");
+            return 1;
+        }
+        uint64_t seed = 0x9E3779B97F4A7C15ULL + count;
+        for (size_t i = 0; i < count; i++)
+        {
+            uint32_t roll = bench_random(&seed) % 100;
+            fat[i] = htonl(roll < 55 ? FREE : roll < 60 ? RESERVED : roll < 65 ? LAST : (uint32_t)(i + 1));
+        }
+
+        struct fat_counts expected = bench_count_kernel("htonl", count_fat_htonl, fat, count);
+        struct fat_counts results[3];
+        int kernel_count = 0;
+        results[kernel_count++] = bench_count_kernel("scalar", count_fat_scalar, fat, count);
+#if defined(__x86_64__) || defined(__i386__)
+        results[kernel_count++] = bench_count_kernel("sse2", count_fat_sse2, fat, count);
+        if (__builtin_cpu_supports("avx2"))
+        {
+            results[kernel_count++] = bench_count_kernel("avx2", count_fat_avx2, fat, count);
+        }
+#endif
+        for (int k = 0; k < kernel_count; k++)
+        {
+            if (memcmp(&results[k], &expected, sizeof(expected)) != 0)
+            {
+                printf("ERROR: counting kernels disagree\n");
+            }
+        }
+        free(fat);
+    }
+    return 0;
+}
+
+// This function adds a directory with entry_count files to an image made by make_memory_image and returns its
+// start block, the files all point at the same single block since only the listing is looked at
+uint32_t bench_make_dir(struct fs_image *image, uint32_t entry_count)
+{
+    size_t entries_per_block = image->block_size / sizeof(struct dir_entry_t);
+    uint32_t dir_blocks = (entry_count + entries_per_block - 1) / entries_per_block;
+    uint32_t *blocks = malloc((dir_blocks + 1) * sizeof(uint32_t));
+    if (blocks == NULL || allocate_blocks(image, dir_blocks + 1, blocks) == -1)
+    {
+        printf("ERROR: image is too small\n");
+        exit(1);
+    }
+    write_chain(image, blocks, dir_blocks);
+    set_fat_entry(image, blocks[dir_blocks], LAST);
+
+    uint64_t seed = entry_count;
+    for (uint32_t i = 0; i < entry_count; i++)
+    {
+        struct dir_entry_t *entry = (struct dir_entry_t *)(image->memory + block_offset(image, blocks[i / entries_per_block])) + i % entries_per_block;
+        entry->status = 3;
+        entry->starting_block = htonl(blocks[dir_blocks]);
+        entry->block_count = htonl(1);
+        entry->size = htonl(bench_random(&seed) % image->block_size);
+        set_entry_time(&entry->create_time, 1000000000 + i);
+        set_entry_time(&entry->modify_time, 1000000000 + 2 * i);
+        snprintf((char *)entry->filename, sizeof(entry->filename), "file%u.txt", i);
+        memset(entry->unused, 0xFF, sizeof(entry->unused));
+    }
+    uint32_t start = blocks[0];
+    free(blocks);
+    return start;
+}
+
+// fatbench list [entry count] times listing one large directory in each format, the output goes to /dev/null
+int bench_list(int argc, char *argv[])
+{
+    uint32_t entry_count = argc > 0 ? strtoul(argv[0], NULL, 10) : 100000;
+    size_t entries_per_block = 512 / sizeof(struct dir_entry_t);
+    struct fs_image *image = make_memory_image(entry_count / entries_per_block + 4096, 512, 0);
+    uint32_t dir_block = bench_make_dir(image, entry_count);
+    int null_fd = open("/dev/null", O_WRONLY);
+    if (null_fd == -1)
+    {
+        printf("ERROR: could not open /dev/null\n");
+        return 1;
+    }
+
+    char *names[] = {"text", "json", "csv"};
+    enum list_format formats[] = {LIST_TEXT, LIST_JSON, LIST_CSV};
+    printf("%-8s %12s %12s %16s\n", "format", "rows", "seconds", "rows/s");
+    for (int i = 0; i < 3; i++)
+    {
+        double start = now_seconds();
+        list_dir(image, dir_block, formats[i], null_fd);
+        double time = now_seconds() - start;
+        printf("%-8s %12u %12.4f %16.0f\n", names[i], entry_count, time, entry_count / time);
+    }
+    close(null_fd);
+    close_image(image);
+    return 0;
+}
+
+// fatbench read [file MB] [reads] times random 4 KiB reads of one large file with the chain walked from the start
+// every time and with skip lists of a few intervals. The walk does a tenth of the reads since it is so much slower
+int bench_read(int argc, char *argv[])
+{
+    uint32_t file_mb = argc > 0 ? strtoul(argv[0], NULL, 10) : 100;
+    uint32_t read_count = argc > 1 ? strtoul(argv[1], NULL, 10) : 20000;
+    uint32_t file_blocks = file_mb * (1024 * 1024 / 512);
+    struct fs_image *image = make_memory_image(file_blocks + file_blocks / 128 + 1024, 512, 0);
+    memset(image->memory + block_offset(image, image->root_dir_start_block), 0xA5,
+           image->size - block_offset(image, image->root_dir_start_block)); // faults every page in before timing
+    memset(image->memory + block_offset(image, image->root_dir_start_block), 0, BENCH_ROOT_DIR_BLOCKS * image->block_size);
+    uint32_t *blocks = malloc(file_blocks * sizeof(uint32_t));
+    if (file_blocks == 0 || blocks == NULL || allocate_blocks(image, file_blocks, blocks) == -1)
+    {
+        printf("ERROR: could not make the file\n");
+        return 1;
+    }
+    write_chain(image, blocks, file_blocks);
+    struct dir_entry_t *entry = (struct dir_entry_t *)(image->memory + block_offset(image, image->root_dir_start_block));
+    entry->status = 3;
+    entry->starting_block = htonl(blocks[0]);
+    entry->block_count = htonl(file_blocks);
+    entry->size = htonl(file_blocks * 512);
+    strcpy((char *)entry->filename, "big.bin");
+    free(blocks);
+
+    uint32_t intervals[] = {0, 16, 64, 256};
+    unsigned char buffer[4096];
+    printf("%-10s %10s %12s %12s %12s\n", "interval", "reads", "seconds", "us/read", "MB/s");
+    for (size_t i = 0; i < sizeof(intervals) / sizeof(intervals[0]); i++)
+    {
+        free_skip_index(image->skip_index);
+        image->skip_index = make_skip_index(intervals[i]);
+        uint32_t reads = intervals[i] == 0 ? (read_count + 9) / 10 : read_count;
+        uint64_t seed = 0x9E3779B97F4A7C15ULL;
+        uint64_t checksum = 0;
+        double start = now_seconds();
+        for (uint32_t j = 0; j < reads; j++)
+        {
+            uint64_t offset = ((uint64_t)bench_random(&seed) << 8 | bench_random(&seed) >> 24) % (file_blocks * 512ULL - sizeof(buffer));
+            checksum += read_file(image, "big.bin", offset, buffer, sizeof(buffer));
+        }
+        double time = now_seconds() - start;
+        char name[16];
+        snprintf(name, sizeof(name), intervals[i] == 0 ? "walk" : "%u", intervals[i]);
+        printf("%-10s %10u %12.4f %12.2f %12.1f\n", name, reads, time, time * 1e6 / reads, checksum / time / (1024 * 1024));
+    }
+    close_image(image);
+    return 0;
+}
+
+// fatbench put [files] [file KB] times putting small files into an image file with every put committed on its own
+// and with all of them in one transaction
+int bench_put(int argc, char *argv[])
+{
+    uint32_t file_count = argc > 0 ? strtoul(argv[0], NULL, 10) : 2000;
+    uint32_t file_kb = argc > 1 ? strtoul(argv[1], NULL, 10) : 1;
+    char source_path[] = "/tmp/fatbench-put-XXXXXX";
+    char image_path[] = "/tmp/fatbench-img-XXXXXX";
+    int source_fd = mkstemp(source_path);
+    int image_fd = mkstemp(image_path);
+    unsigned char *data = calloc(1, (size_t)file_kb * 1024 + 1);
+    if (source_fd == -1 || image_fd == -1 || data == NULL || write_all(source_fd, data, (size_t)file_kb * 1024) == -1)
+    {
+        printf("ERROR: could not make the files for the benchmark\n");
+        return 1;
+    }
+    close(source_fd);
+    free(data);
+
+    // every run starts from the same empty image, the root directory grows as files are added to it
+    uint32_t file_blocks = (file_kb * 1024 + 511) / 512;
+    struct fs_image *empty = make_memory_image(file_count * file_blocks + file_count / 8 + 1024, 512, 0);
+    off_t image_size = empty->size;
+    unsigned char *template = malloc(image_size);
+    if (template == NULL)
+    {
+        printf("ERROR: could not allocate memory\n");
+        exit(1);
+    }
+    memcpy(template, empty->memory, image_size);
+    close_image(empty);
+
+    char journal_path[sizeof(image_path) + sizeof(".journal")];
+    sprintf(journal_path, "%s.journal", image_path);
+    printf("%-14s %10s %12s %12s\n", "commit", "files", "seconds", "files/s");
+    for (int batched = 0; batched <= 1; batched++)
+    {
+        if (ftruncate(image_fd, 0) == -1 || pwrite_all(image_fd, template, image_size, 0) == -1)
+        {
+            printf("ERROR: could not write the image\n");
+            return 1;
+        }
+        struct fs_image *image = open_image(image_path, 1);
+        enable_dir_index(image);
+        double start = now_seconds();
+        if (batched)
+        {
+            begin_transaction(image);
+        }
+        int failures = 0;
+        for (uint32_t i = 0; i < file_count; i++)
+        {
+            char name[32];
+            snprintf(name, sizeof(name), "/f%u", i);
+            char *args[] = {source_path, name};
+            failures += diskput(image, 2, args) != 0;
+            if (!batched)
+            {
+                commit_transaction(image);
+            }
+        }
+        commit_transaction(image);
+        double time = now_seconds() - start;
+        close_image(image);
+        if (failures > 0)
+        {
+            printf("ERROR: %d puts failed\n", failures);
+        }
+        printf("%-14s %10u %12.4f %12.1f\n", batched ? "transaction" : "every put", file_count, time, file_count / time);
+    }
+    free(template);
+    close(image_fd);
+    unlink(source_path);
+    unlink(image_path);
+    unlink(journal_path);
+    return 0;
+}
+
+// Synthetic images
+// fatbench gen and fatbench suite build images of any size in memory: a tree of directories depth levels deep with
+// fan_out subdirectories in each, files_per_dir files in every directory sharing size_mb of data, and
+// fragment_percent of the files split into 2 to 8 pieces with a free block between each piece
+enum gen_option
+{
+    GEN_SIZE,
+    GEN_FAN_OUT,
+    GEN_DEPTH,
+    GEN_FILES,
+    GEN_FRAGMENT,
+    GEN_BLOCK_SIZE,
+    GEN_OPTION_COUNT
+};
+
+#define GEN_MAX_VALUES 8
+
+// each option can be given a comma separated list of values, the suite runs every combination of them
+struct gen_options
+{
+    uint32_t values[GEN_OPTION_COUNT][GEN_MAX_VALUES];
+    size_t counts[GEN_OPTION_COUNT];
+    uint32_t repeats;
+};
+
+struct gen_state
+{
+    struct fs_image *image;
+    uint32_t *params; // one value for each gen_option
+    uint64_t seed;
+    uint64_t average_size;
+    uint32_t files;
+    uint32_t directories;
+    unsigned char *pattern; // random bytes the file data is copied from
+};
+
+#define GEN_PATTERN_SIZE (64 * 1024)
+
+// This function reads -s size MB, -f fan out, -d depth, -n files per directory, -F fragmented percent, -b block size
+// and -r repeats. returns the index of the first argument that is not an option or -1 after printing an error
+int parse_gen_options(int argc, char *argv[], struct gen_options *options)
+{
+    const char *letters = "sfdnFb";
+    uint32_t defaults[GEN_OPTION_COUNT] = {64, 4, 3, 16, 0, 512};
+    for (int i = 0; i < GEN_OPTION_COUNT; i++)
+    {
+        options->values[i][0] = defaults[i];
+        options->counts[i] = 1;
+    }
+    options->repeats = 3;
+    int arg = 0;
+    for (; arg + 1 < argc && argv[arg][0] == '-' && strlen(argv[arg]) == 2; arg += 2)
+    {
+        if (argv[arg][1] == 'r')
+        {
+            options->repeats = strtoul(argv[arg + 1], NULL, 10);
+            continue;
+        }
+        const char *letter = strchr(letters, argv[arg][1]);
+        if (letter == NULL)
+        {
+            printf("ERROR: unknown option '%s'\n", argv[arg]);
+            return -1;
+        }
+        int option = letter - letters;
+        options->counts[option] = 0;
+        char *saveptr;
+        for (char *value = strtok_r(argv[arg + 1], ",", &saveptr); value != NULL && options->counts[option] < GEN_MAX_VALUES;
+             value = strtok_r(NULL, ",", &saveptr))
+        {
+            options->values[option][options->counts[option]++] = strtoul(value, NULL, 10);
+        }
+    }
+    for (int i = 0; i < GEN_OPTION_COUNT; i++)
+    {
+        int bad = options->counts[i] == 0;
+        for (size_t j = 0; j < options->counts[i]; j++)
+        {
+            uint32_t value = options->values[i][j];
+            bad |= (i == GEN_FRAGMENT && value > 100) || (i == GEN_BLOCK_SIZE && (value < 512 || value > 32768 || (value & (value - 1)) != 0));
+        }
+        if (bad)
+        {
+            printf("ERROR: bad value for -%c\n", letters[i]);
+            return -1;
+        }
+    }
+    if (options->repeats == 0)
+    {
+        options->repeats = 1;
+    }
+    return arg;
+}
+
+// adds an entry to a directory of a generated image, growing the directory if it is full
+void gen_add_entry(struct gen_state *state, uint32_t dir_block, struct dir_entry_t *dir_entry, uint64_t dir_entry_offset,
+                   struct dir_entry_t *entry)
+{
+    uint64_t offset = get_free_dir_entry(state->image, dir_block, dir_entry, dir_entry_offset);
+    if (offset == 0)
+    {
+        printf("ERROR: generated image is too small\n");
+        exit(1);
+    }
+    write_metadata(state->image, offset, entry, sizeof(struct dir_entry_t));
+}
+
+// fills in the parts of a generated entry every entry has
+void gen_fill_entry(struct dir_entry_t *entry, int status, const char *name, uint32_t start_block, uint32_t block_count, uint32_t size)
+{
+    memset(entry, 0, sizeof(struct dir_entry_t));
+    entry->status = status;
+    entry->starting_block = htonl(start_block);
+    entry->block_count = htonl(block_count);
+    entry->size = htonl(size);
+    set_entry_time(&entry->create_time, 1000000000);
+    set_entry_time(&entry->modify_time, 1000000000);
+    snprintf((char *)entry->filename, sizeof(entry->filename), "%s", name);
+    memset(entry->unused, 0xFF, sizeof(entry->unused));
+}
+
+// This function makes one file of a generated image and returns the block its chain starts at. A fragmented file is
+// allocated a piece at a time with a block taken between the pieces, which is given back once the file is done so
+// the next fit allocator leaves it free
+uint32_t gen_file(struct gen_state *state, uint32_t size)
+{
+    struct fs_image *image = state->image;
+    uint32_t block_count = (size + image->block_size - 1) / image->block_size;
+    uint32_t pieces = bench_random(&state->seed) % 100 < state->params[GEN_FRAGMENT] ? 2 + bench_random(&state->seed) % 7 : 1;
+    pieces = pieces > block_count ? block_count : pieces;
+    uint32_t *blocks = malloc((block_count + pieces) * sizeof(uint32_t));
+    if (blocks == NULL)
+    {
+        printf("ERROR: could not allocate memory\n");
+        exit(1);
+    }
+    uint32_t *gaps = blocks + block_count;
+    uint32_t done = 0;
+    for (uint32_t i = 0; i < pieces; i++)
+    {
+        uint32_t length = i + 1 == pieces ? block_count - done : block_count / pieces;
+        if (allocate_blocks(image, length, blocks + done) == -1 || (i + 1 < pieces && allocate_blocks(image, 1, gaps + i) == -1))
+        {
+            printf("ERROR: generated image is too small\n");
+            exit(1);
+        }
+        done += length;
+    }
+    write_chain(image, blocks, block_count);
+    release_blocks(image, gaps, pieces - 1);
+    for (uint32_t i = 0; i < block_count; i++)
+    {
+        size_t start = (bench_random(&state->seed) % (GEN_PATTERN_SIZE / image->block_size)) * image->block_size;
+        memcpy(image->memory + block_offset(image, blocks[i]), state->pattern + start, image->block_size);
+    }
+    uint32_t start_block = blocks[0];
+    free(blocks);
+    return start_block;
+}
+
+// This function fills a directory of a generated image with its files and then its subdirectories, down to depth
+// more levels. dir_entry is the entry of the directory in its parent or NULL for the root
+void gen_dir(struct gen_state *state, uint32_t dir_block, struct dir_entry_t *dir_entry, uint64_t dir_entry_offset, uint32_t depth)
+{
+    struct fs_image *image = state->image;
+    state->directories++;
+    for (uint32_t i = 0; i < state->params[GEN_FILES]; i++)
+    {
+        // sizes are spread from half to one and a half times the average
+        uint64_t size = state->average_size / 2 + (state->average_size > 0 ? bench_random(&state->seed) % (state->average_size + 1) : 0);
+        size = size == 0 ? 1 : size;
+        char name[31];
+        snprintf(name, sizeof(name), "f%u.bin", state->files++);
+        struct dir_entry_t entry;
+        gen_fill_entry(&entry, 3, name, gen_file(state, size), (size + image->block_size - 1) / image->block_size, size);
+        gen_add_entry(state, dir_block, dir_entry, dir_entry_offset, &entry);
+    }
+    for (uint32_t i = 0; depth > 0 && i < state->params[GEN_FAN_OUT]; i++)
+    {
+        uint32_t block;
+        if (allocate_blocks(image, 1, &block) == -1)
+        {
+            printf("ERROR: generated image is too small\n");
+            exit(1);
+        }
+        memset(image->memory + block_offset(image, block), 0, image->block_size);
+        set_fat_entry(image, block, LAST);
+        char name[31];
+        snprintf(name, sizeof(name), "d%u", state->directories);
+        struct dir_entry_t entry;
+        gen_fill_entry(&entry, 5, name, block, 1, image->block_size);
+        gen_add_entry(state, dir_block, dir_entry, dir_entry_offset, &entry);
+        uint64_t offset = lookup_entry(image, dir_block, name, 5, &entry);
+        gen_dir(state, block, &entry, offset, depth - 1);
+    }
+}
+
+// This function builds an image in memory from one value of each gen_option, sets files and directories to how many
+// it made. returns NULL after printing an error if the tree would be too big
+struct fs_image *gen_image(uint32_t *params, uint32_t *files, uint32_t *directories)
+{
+    uint64_t directory_count = 0;
+    uint64_t level = 1;
+    for (uint32_t i = 0; i <= params[GEN_DEPTH] && directory_count <= 1000000; i++)
+    {
+        directory_count += level;
+        level *= params[GEN_FAN_OUT];
+    }
+    uint64_t file_count = directory_count * params[GEN_FILES];
+    uint64_t data_bytes = (uint64_t)params[GEN_SIZE] * 1024 * 1024;
+    size_t block_size = params[GEN_BLOCK_SIZE];
+    size_t entries_per_block = block_size / sizeof(struct dir_entry_t);
+    // data, the last partial block of each file, the gaps and the directories, with an eighth more left free
+    uint64_t block_count = data_bytes / block_size + file_count * 2 + 9 * file_count / 8 +
+                           directory_count * (2 + params[GEN_FILES] / entries_per_block + params[GEN_FAN_OUT] / entries_per_block);
+    block_count += block_count / 8 + 1024;
+    if (directory_count > 1000000 || block_count > UINT32_MAX / 2 || block_count * block_size > (1ULL << 40))
+    {
+        printf("ERROR: the generated image would be too big\n");
+        return NULL;
+    }
+
+    struct gen_state state;
+    memset(&state, 0, sizeof(state));
+    state.image = make_memory_image(block_count, block_size, 0);
+    state.params = params;
+    state.seed = 0x2545F4914F6CDD1DULL;
+    state.average_size = file_count > 0 ? data_bytes / file_count : 0;
+    state.pattern = malloc(GEN_PATTERN_SIZE);
+    if (state.pattern == NULL)
+    {
+        printf("ERROR: could not allocate memory\n");
+        exit(1);
+    }
+    for (size_t i = 0; i < GEN_PATTERN_SIZE; i++)
+    {
+        state.pattern[i] = bench_random(&state.seed);
+    }
+    gen_dir(&state, state.image->root_dir_start_block, NULL, 0, params[GEN_DEPTH]);
+    flush_fat(state.image);
+    free(state.pattern);
+    *files = state.files;
+    *directories = state.directories;
+    return state.image;
+}
+
+// writes a generated image to a file, returns 0 on success and -1 after printing an error
+int save_image(struct fs_image *image, char *path)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1 || write_all(fd, image->memory, image->size) == -1)
+    {
+        printf("ERROR: could not write '%s'\n", path);
+        if (fd != -1)
+        {
+            close(fd);
+        }
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+// fatbench gen [-s MB] [-f fan out] [-d depth] [-n files per directory] [-F fragmented %] [-b block size] <image>
+// writes a synthetic image to a file
+int bench_gen(int argc, char *argv[])
+{
+    struct gen_options options;
+    int arg = parse_gen_options(argc, argv, &options);
+    if (arg == -1 || arg + 1 != argc)
+    {
+        printf("Usage: fatbench gen [-s MB] [-f fan out] [-d depth] [-n files per directory] [-F fragmented %%] [-b block size] <image>\n");
+        return 1;
+    }
+    uint32_t params[GEN_OPTION_COUNT];
+    for (int i = 0; i < GEN_OPTION_COUNT; i++)
+    {
+        params[i] = options.values[i][0];
+    }
+    double start = now_seconds();
+    uint32_t files, directories;
+    struct fs_image *image = gen_image(params, &files, &directories);
+    if (image == NULL || save_image(image, argv[arg]) == -1)
+    {
+        return 1;
+    }
+    printf("Wrote %u files in %u directories into %u blocks in %.3f s\n", files, directories, image->block_count, now_seconds() - start);
+    close_image(image);
+    return 0;
+}
+
+// Benchmark suite
+// Every combination of the gen options is generated into a temporary file which is then opened like the tools open
+// an image (through the FATFS_IO block device) and timed doing what each tool does. Every time is the best of the
+// repeats and the results are printed as csv, one row per image, so runs can be compared
+struct bench_tree
+{
+    uint32_t *dir_blocks;
+    size_t dir_count, dir_capacity;
+    char **file_paths;
+    size_t file_count, file_capacity;
+    uint64_t entries;
+    uint64_t bytes;
+    uint64_t extents;
+};
+
+// adds a value to a growing array
+void *bench_append(void *array, size_t *count, size_t *capacity, size_t size, void *value)
+{
+    if (*count == *capacity)
+    {
+        *capacity = *capacity == 0 ? 64 : *capacity * 2;
+        array = realloc(array, *capacity * size);
+        if (array == NULL)
+        {
+            printf("ERROR: could not allocate memory\n");
+            exit(1);
+        }
+    }
+    memcpy((char *)array + *count * size, value, size);
+    (*count)++;
+    return array;
+}
+
+// collects every directory block and file path under a directory
+void bench_walk(struct fs_image *image, uint32_t dir_block, char *path, struct bench_tree *tree)
+{
+    tree->dir_blocks = bench_append(tree->dir_blocks, &tree->dir_count, &tree->dir_capacity, sizeof(uint32_t), &dir_block);
+    struct dir_reader reader;
+    start_dir_reader(&reader, image, dir_block);
+    struct dir_entry_t *entry;
+    uint32_t *subdirs = NULL;
+    char **subdir_paths = NULL;
+    size_t subdir_count = 0, subdir_capacity = 0, path_count = 0, path_capacity = 0;
+    while ((entry = next_dir_entry(&reader, NULL)) != NULL)
+    {
+        if ((entry->status & 1) == 0)
+        {
+            continue;
+        }
+        tree->entries++;
+        char *child = malloc(strlen(path) + sizeof(entry->filename) + 2);
+        if (child == NULL)
+        {
+            printf("ERROR: could not allocate memory\n");
+            exit(1);
+        }
+        sprintf(child, "%s/%.31s", path, entry->filename);
+        uint32_t start_block = htonl(entry->starting_block);
+        if (entry->status == 3)
+        {
+            tree->file_paths = bench_append(tree->file_paths, &tree->file_count, &tree->file_capacity, sizeof(char *), &child);
+            tree->bytes += htonl(entry->size);
+            uint64_t blocks, extents;
+            count_extents(image, start_block, &blocks, &extents);
+            tree->extents += extents;
+        }
+        else
+        {
+            subdirs = bench_append(subdirs, &subdir_count, &subdir_capacity, sizeof(uint32_t), &start_block);
+            subdir_paths = bench_append(subdir_paths, &path_count, &path_capacity, sizeof(char *), &child);
+        }
+    }
+    end_dir_reader(&reader);
+    for (size_t i = 0; i < subdir_count; i++)
+    {
+        bench_walk(image, subdirs[i], subdir_paths[i], tree);
+        free(subdir_paths[i]);
+    }
+    free(subdirs);
+    free(subdir_paths);
+}
+
+// sends stdout to /dev/null while a tool that prints is timed, returns what to pass to bench_unmute
+int bench_mute(void)
+{
+    fflush(stdout);
+    int saved = dup(STDOUT_FILENO);
+    int null_fd = open("/dev/null", O_WRONLY);
+    dup2(null_fd, STDOUT_FILENO);
+    close(null_fd);
+    return saved;
+}
+
+void bench_unmute(int saved)
+{
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+}
+
+int remove_path(const char *path, const struct stat *path_stat, int type, struct FTW *ftw)
+{
+    return remove(path);
+}
+
+// This function times each tool on one generated image and prints its csv row. returns 0 on success and -1 if the
+// image could not be made
+int bench_suite_image(uint32_t *params, uint32_t repeats)
+{
+    char image_path[] = "/tmp/fatbench-suite-XXXXXX";
+    int image_fd = mkstemp(image_path);
+    if (image_fd == -1)
+    {
+        printf("ERROR: could not make a temporary file\n");
+        return -1;
+    }
+    close(image_fd);
+    double start = now_seconds();
+    uint32_t files, directories;
+    struct fs_image *generated = gen_image(params, &files, &directories);
+    if (generated == NULL || save_image(generated, image_path) == -1)
+    {
+        unlink(image_path);
+        return -1;
+    }
+    close_image(generated);
+    double gen_time = now_seconds() - start;
+
+    struct fs_image *image = open_image(image_path, 0);
+    struct bench_tree tree;
+    memset(&tree, 0, sizeof(tree));
+    bench_walk(image, image->root_dir_start_block, "", &tree);
+    int null_fd = open("/dev/null", O_WRONLY);
+
+    // the order paths are resolved in is shuffled so lookups do not just follow the directory order
+    uint64_t seed = 0x9E3779B97F4A7C15ULL;
+    for (size_t i = tree.file_count; i > 1; i--)
+    {
+        size_t j = bench_random(&seed) % i;
+        char *swap = tree.file_paths[i - 1];
+        tree.file_paths[i - 1] = tree.file_paths[j];
+        tree.file_paths[j] = swap;
+    }
+
+    double best[5] = {1e30, 1e30, 1e30, 1e30, 1e30}; // info, list, resolve, indexed resolve, get
+    for (uint32_t repeat = 0; repeat < repeats; repeat++)
+    {
+        double times[5];
+        int saved = bench_mute();
+        start = now_seconds();
+        diskinfo(image, 0, NULL);
+        times[0] = now_seconds() - start;
+        bench_unmute(saved);
+
+        start = now_seconds();
+        for (size_t i = 0; i < tree.dir_count; i++)
+        {
+            list_dir(image, tree.dir_blocks[i], LIST_TEXT, null_fd);
+        }
+        times[1] = now_seconds() - start;
+
+        for (int indexed = 0; indexed <= 1; indexed++)
+        {
+            if (indexed)
+            {
+                enable_dir_index(image);
+            }
+            start = now_seconds();
+            for (size_t i = 0; i < tree.file_count; i++)
+            {
+                struct dir_entry_t entry;
+                if (find_file_by_path(image, tree.file_paths[i], &entry) == 0)
+                {
+                    printf("ERROR: could not find '%s'\n", tree.file_paths[i]);
+                }
+            }
+            times[2 + indexed] = now_seconds() - start;
+        }
+        free_dir_index(image->dir_index);
+        image->dir_index = NULL;
+
+        char output_dir[] = "/tmp/fatbench-get-XXXXXX";
+        if (mkdtemp(output_dir) == NULL)
+        {
+            printf("ERROR: could not make a temporary directory\n");
+            exit(1);
+        }
+        saved = bench_mute();
+        start = now_seconds();
+        extract_tree(image, default_thread_count(), "/", output_dir);
+        times[4] = now_seconds() - start;
+        bench_unmute(saved);
+        nftw(output_dir, remove_path, 16, FTW_DEPTH | FTW_PHYS);
+
+        for (int i = 0; i < 5; i++)
+        {
+            best[i] = times[i] < best[i] ? times[i] : best[i];
+        }
+    }
+    for (int i = 0; i < 5; i++)
+    {
+        best[i] = best[i] > 0 ? best[i] : 1e-9;
+    }
+    printf("%u,%u,%u,%u,%u,%u,%s,%u,%u,%lu,%.3f,%.3f,%.0f,%.0f,%.0f,%.2f,%.0f\n", params[GEN_SIZE], params[GEN_FAN_OUT],
+           params[GEN_DEPTH], params[GEN_FILES], params[GEN_FRAGMENT], params[GEN_BLOCK_SIZE], image->device->name, files,
+           directories, (unsigned long)tree.extents, gen_time, best[0] * 1000, tree.entries / best[1], tree.file_count / best[2],
+           tree.file_count / best[3], tree.bytes / (1024.0 * 1024.0) / best[4], tree.file_count / best[4]);
+    fflush(stdout);
+
+    close(null_fd);
+    for (size_t i = 0; i < tree.file_count; i++)
+    {
+        free(tree.file_paths[i]);
+    }
+    free(tree.file_paths);
+    free(tree.dir_blocks);
+    close_image(image);
+    unlink(image_path);
+    char journal_path[sizeof(image_path) + sizeof(".journal")];
+    sprintf(journal_path, "%s.journal", image_path);
+    unlink(journal_path);
+    return 0;
+}
+
+// fatbench suite [-s MB,...] [-f fan out,...] [-d depth,...] [-n files per directory,...] [-F fragmented %,...]
+// [-b block size,...] [-r repeats] generates an image for every combination of the values and prints a csv row of
+// timings for each
+int bench_suite(int argc, char *argv[])
+{
+    struct gen_options options;
+    int arg = parse_gen_options(argc, argv, &options);
+    if (arg == -1 || arg != argc)
+    {
+        printf("Usage: fatbench suite [-s MB,...] [-f fan out,...] [-d depth,...] [-n files per directory,...] "
+               "[-F fragmented %%,...] [-b block size,...] [-r repeats]\n");
+        return 1;
+    }
+    printf("size_mb,fan_out,depth,files_per_dir,fragment_pct,block_size,io,files,dirs,extents,gen_s,info_ms,"
+           "list_entries_per_s,resolve_per_s,resolve_indexed_per_s,get_mb_per_s,get_files_per_s\n");
+    size_t position[GEN_OPTION_COUNT] = {0};
+    int failures = 0;
+    while (1)
+    {
+        uint32_t params[GEN_OPTION_COUNT];
+        for (int i = 0; i < GEN_OPTION_COUNT; i++)
+        {
+            params[i] = options.values[i][position[i]];
+        }
+        failures += bench_suite_image(params, options.repeats) == -1;
+        // steps to the next combination like an odometer, the last option changing fastest
+        int option = GEN_OPTION_COUNT - 1;
+        while (option >= 0 && ++position[option] == options.counts[option])
+        {
+            position[option--] = 0;
+        }
+        if (option < 0)
+        {
+            break;
+        }
+    }
+    return failures > 0;
+}
+
+struct benchmark
+{
+    char *name;
+    int (*run)(int argc, char *argv[]);
+    char *usage;
+};
+
+struct benchmark benchmarks[] = {
+    {"chain", bench_chain, "chain [block count]"},
+    {"count", bench_count, "count [entry counts...]"},
+    {"list", bench_list, "list [entry count]"},
+    {"read", bench_read, "read [file MB] [reads]"},
+    {"put", bench_put, "put [files] [file KB]"},
+    {"gen", bench_gen, "gen [-s MB] [-f fan out] [-d depth] [-n files per directory] [-F fragmented %] [-b block size] <image>"},
+    {"suite", bench_suite, "suite [-s MB,...] [-f fan out,...] [-d depth,...] [-n files per directory,...] [-F fragmented %,...] [-b block size,...] [-r repeats]"},
+};
+#define BENCHMARK_COUNT (sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+// runs the benchmark named by the first argument
+int fatbench(int argc, char *argv[])
+{
+    for (size_t i = 0; argc >= 2 && i < BENCHMARK_COUNT; i++)
+    {
+        if (strcmp(benchmarks[i].name, argv[1]) == 0)
+        {
+            return benchmarks[i].run(argc - 2, argv + 2);
+        }
+    }
+    printf("Usage: fatbench <benchmark> [arguments]\n");
+    for (size_t i = 0; i < BENCHMARK_COUNT; i++)
+    {
+        printf("  %s\n", benchmarks[i].usage);
+    }
+    return 1;
+}
+
+// Table of the commands a single image can serve, each one is also a program name the binary can be
+// linked as so that ./diskinfo, ./disklist etc still work like they used to
+struct command
+{
+    char *name;
+    char *program;
+    command_fn run;
+    char *usage;
+    int writes; // set if the command changes the image so it has to be opened for writing
+};
+
+struct command commands[] = {
+    {"info", "diskinfo", diskinfo, "info", 0},
+    {"list", "disklist", disklist, "list [-f text|json|csv] [directory]", 0},
+    {"get", "diskget", diskget, "get [-r | -s store] [-j workers] <path in image> <output file, directory or manifest>", 0},
+    {"put", "diskput", diskput, "put <local file> <path in image>", 1},
+    {"stat", "diskstat", diskstat, "stat [-q] [directory]", 0},
+    {"defrag", "diskdefrag", diskdefrag, "defrag [new image]", 1},
+    {"check", "diskcheck", diskcheck, "check [-j workers]", 0},
+};
+#define COMMAND_COUNT (sizeof(commands) / sizeof(commands[0]))
+
+// Programs that do not run against a single opened image
+struct program
+{
+    char *name;
+    int (*main)(int argc, char *argv[]);
+};
+
+struct program programs[] = {
+    {"fatbench", fatbench},
+    {"fatfsd", fatfsd},
+    {"mkimage", mkimage},
+};
+#define PROGRAM_COUNT (sizeof(programs) / sizeof(programs[0]))
+
+// returns the program with the given name or NULL if there is none
+struct program *find_program(char *name)
+{
+    for (size_t i = 0; i < PROGRAM_COUNT; i++)
+    {
+        if (strcmp(programs[i].name, name) == 0)
+        {
+            return &programs[i];
+        }
+    }
+    return NULL;
+}
+
+// returns the command with the given command or program name or NULL if there is none
+struct command *find_command(char *name)
+{
+    for (size_t i = 0; i < COMMAND_COUNT; i++)
+    {
+        if (strcmp(commands[i].name, name) == 0 || strcmp(commands[i].program, name) == 0)
+        {
+            return &commands[i];
+        }
+    }
+    return NULL;
+}
+
+// opens the image given as the first argument, runs a single command on it and closes it again
+int run_command_once(struct command *command, int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        printf("ERROR: Incorrect command line arguments\n");
+        return 1;
+    }
+    // commands that write still open read only images, they fail themselves if they do need to write
+    struct fs_image *image = open_image(argv[1], command->writes && access(argv[1], W_OK) == 0);
+    int status = command->run(image, argc - 2, argv + 2);
+    close_image(image);
+    return status;
+}
+
+// This function reads commands one line at a time from the input and runs them against an image that
+// is only opened and mapped once, blank lines and lines starting with '#' are skipped
+int run_batch(struct fs_image *image, FILE *input)
+{
+    int interactive = isatty(fileno(input)) && isatty(fileno(stdout));
+    int failures = 0;
+    char *line = NULL;
+    size_t line_size = 0;
+
+    while (1)
+    {
+        if (interactive)
+        {
+            printf("fatfs> ");
+            fflush(stdout);
+        }
+        if (getline(&line, &line_size, input) == -1)
+        {
+            break;
+        }
+
+        // split the line into words
+        char *args[MAX_COMMAND_ARGS];
+        int arg_count = 0;
+        char *saveptr;
+        char *token = strtok_r(line, " \t\r\n", &saveptr);
+        while (token != NULL && arg_count < MAX_COMMAND_ARGS)
+        {
+            args[arg_count++] = token;
+            token = strtok_r(NULL, " \t\r\n", &saveptr);
+        }
+        if (arg_count == 0 || args[0][0] == '#')
+        {
+            continue;
+        }
+
+        if (strcmp(args[0], "quit") == 0 || strcmp(args[0], "exit") == 0)
+        {
+            break;
+        }
+        if (strcmp(args[0], "help") == 0)
+        {
+            for (size_t i = 0; i < COMMAND_COUNT; i++)
+            {
+                printf("%s\n", commands[i].usage);
+            }
+            printf("begin\ncommit\nabort\nhelp\nquit\n");
+            continue;
+        }
+        if (strcmp(args[0], "begin") == 0 || strcmp(args[0], "commit") == 0 || strcmp(args[0], "abort") == 0)
+        {
+            if (args[0][0] == 'b' && begin_transaction(image) == -1)
+            {
+                failures++;
+            }
+            else if (args[0][0] == 'c')
+            {
+                commit_transaction(image);
+            }
+            else if (args[0][0] == 'a')
+            {
+                abort_transaction(image);
+            }
+            continue;
+        }
+        struct command *command = find_command(args[0]);
+        if (command == NULL)
+        {
+            printf("ERROR: unknown command '%s'\n", args[0]);
+            failures++;
+            continue;
+        }
+        if (command->run(image, arg_count - 1, args + 1) != 0)
+        {
+            failures++;
+        }
+        // outside of a transaction each command's changes are committed before the next one runs
+        if (in_transaction(image))
+        {
+            flush_fat(image);
+        }
+        else
+        {
+            commit_transaction(image);
+        }
+        fflush(stdout);
+    }
+    free(line);
+    return failures > 0;
+}
+
+// returns 1 if any line of a script runs a command that changes the image or a transaction, the script is read to
+// the end and rewound so it can be run afterwards
+int script_writes(FILE *input)
+{
+    int writes = 0;
+    char *line = NULL;
+    size_t line_size = 0;
+    while (!writes && getline(&line, &line_size, input) != -1)
+    {
+        char *saveptr;
+        char *word = strtok_r(line, " \t\r\n", &saveptr);
+        if (word == NULL || word[0] == '#')
+        {
+            continue;
+        }
+        struct command *command = find_command(word);
+        writes = (command != NULL && command->writes) || strcmp(word, "begin") == 0 || strcmp(word, "commit") == 0 ||
+                 strcmp(word, "abort") == 0;
+    }
+    free(line);
+    rewind(input);
+    return writes;
+}
+
+// copies a script piped to stdin into a temporary file so it can be read twice, returns NULL if it could not
+FILE *copy_script(FILE *input)
+{
+    FILE *copy = tmpfile();
+    if (copy == NULL)
+    {
+        return NULL;
+    }
+    char buffer[4096];
+    size_t length;
+    while ((length = fread(buffer, 1, sizeof(buffer), input)) > 0)
+    {
+        if (fwrite(buffer, 1, length, copy) != length)
+        {
+            fclose(copy);
+            return NULL;
+        }
+    }
+    rewind(copy);
+    return copy;
+}
+
+// fatfs <image> [script] runs many commands against one image, reading them from the script or stdin
+// fatfs <command> <image> ... or running the binary under a program name runs a single command or program
+int main(int argc, char *argv[])
+{
+    char *program = strrchr(argv[0], '/');
+    program = program == NULL ? argv[0] : program + 1;
+
+    struct command *command = find_command(program);
+    if (command != NULL)
+    {
+        return run_command_once(command, argc, argv);
+    }
+    struct program *other = find_program(program);
+    if (other != NULL)
+    {
+        return other->main(argc, argv);
+    }
+    if (argc >= 2 && (command = find_command(argv[1])) != NULL)
+    {
+        return run_command_once(command, argc - 1, argv + 1);
+    }
+    if (argc >= 2 && (other = find_program(argv[1])) != NULL)
+    {
+        return other->main(argc - 1, argv + 1);
+    }
+
+    if (argc < 2 || argc > 3)
+    {
+        printf("Usage: %s <image> [script]\n", program);
+        return 1;
+    }
+    FILE *input = stdin;
+    if (argc == 3)
+    {
+        input = fopen(argv[2], "r");
+    }
+    else if (!isatty(fileno(stdin)))
+    {
+        input = copy_script(stdin);
+    }
+    if (input == NULL)
+    {
+        printf("ERROR: could not open file\n");
+        return 1;
+    }
+    // the image is only opened for writing if the script changes it, someone typing commands might put files so
+    // an interactive session is opened for writing if possible. Since it will serve many lookups its directories
+    // are indexed as they are visited
+    int writes = input == stdin || script_writes(input);
+    struct fs_image *image = open_image(argv[1], writes && access(argv[1], W_OK) == 0);
+    enable_dir_index(image);
+    int status = run_batch(image, input);
+    close_image(image);
+    if (input != stdin)
+    {
+        fclose(input);
+    }
+    return status;
+}